@@ -2,8 +2,18 @@
 #define _MATH_H_
 
 #include "common.h"
+#include "curves.h"
 #include <math.h>
 
+/* NOTE: SSE2 is always there on x86-64, the scalar functions are the reference and the only path on
+   other targets */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ALGEBRA_SSE 1
+#endif
+/* NOTE: the AVX paths are not here, they are selected at runtime with the pose kernels (see
+   transforms_m34_mul_n in pose_kernels.h) and the build does not need -mavx */
+
 static inline f32 to_rad(f32 degree) {
     return (degree / 180.0f) * M_PI;
 }
@@ -82,7 +92,9 @@ static inline V3 v3_normalize(V3 a) {
     return a;
 }
 
-typedef struct M4 {
+/* NOTE: 16 byte aligned so the rows can be loaded with aligned SSE loads, malloc already returns 16
+   byte aligned memory on 64 bit targets */
+typedef struct alignas(16) M4 {
     float m[16];
 } M4;
 
@@ -268,7 +280,9 @@ static inline void m4_print(M4 m) {
     }
 }
 
-typedef struct Q4 {
+/* NOTE: 16 byte aligned like M4, a quaternion is one aligned SSE load. The streams of quaternions in
+   the clips keep this alignment, see allocate_animation_tracks */
+typedef struct alignas(16) Q4 {
     f32 w, x, y, z;
 } Q4;
 
@@ -351,6 +365,92 @@ static inline Q4 q4_scale(Q4 a, f32 s) {
     return result;
 }
 
+static inline Q4 q4_conjugate(Q4 q) {
+    return q4(q.w, -q.x, -q.y, -q.z);
+}
+
+/* NOTE: a*b applies b first and then a, like q4_to_m4(a)*q4_to_m4(b) */
+static inline Q4 q4_mul(Q4 a, Q4 b) {
+    Q4 result;
+    result.w = a.w*b.w - a.x*b.x - a.y*b.y - a.z*b.z;
+    result.x = a.w*b.x + a.x*b.w + a.y*b.z - a.z*b.y;
+    result.y = a.w*b.y - a.x*b.z + a.y*b.w + a.z*b.x;
+    result.z = a.w*b.z + a.x*b.y - a.y*b.x + a.z*b.w;
+    return result;
+}
+
+/* NOTE: Normalized lerp with a polynomial correction of t (Zeux, "Approximating slerp").
+   Against exact slerp of unit quaternions the max angular error is 7.8e-4 rad (0.045 deg)
+   for any pair and 3.3e-5 rad when the quaternions are less than 30 deg apart, which
+   covers neighbouring keys at 30-60 Hz. Measured by ./build/benchmark onlerp. */
+static inline f32 q4_onlerp_adjust(f32 t, f32 abs_cos_omega) {
+    f32 d = abs_cos_omega;
+    f32 a = 1.0904f + d*(-3.2452f + d*(3.55645f - d*1.43519f));
+    f32 b = 0.848013f + d*(-1.06021f + d*0.215638f);
+    f32 k = a*(t - 0.5f)*(t - 0.5f) + b;
+    return t + t*(t - 0.5f)*(t - 1)*k;
+}
+
+static inline Q4 q4_onlerp(Q4 a, Q4 b, f32 t) {
+    
+    f32 cos_omega = a.w*b.w + a.x*b.x + a.y*b.y + a.z*b.z;
+    f32 sign = cos_omega < 0.0f ? -1.0f : 1.0f;
+    f32 adjusted_t = q4_onlerp_adjust(t, cos_omega*sign);
+    
+    f32 k0 = 1 - adjusted_t;
+    f32 k1 = adjusted_t*sign;
+
+    Q4 result;
+    result.w = a.w*k0 + b.w*k1;
+    result.x = a.x*k0 + b.x*k1;
+    result.y = a.y*k0 + b.y*k1;
+    result.z = a.z*k0 + b.z*k1;
+
+    f32 length_sqr = result.w*result.w + result.x*result.x + result.y*result.y + result.z*result.z;
+    if(length_sqr > 0.0f) {
+        result = q4_scale(result, 1.0f / sqrtf(length_sqr));
+    }
+    return result;
+}
+
+/* NOTE: Cubic Hermite curve between the keys p1 and p2 with Catmull-Rom tangents scaled for
+   non uniform keys. d0, d1, d2 are the time between p0-p1, p1-p2 and p2-p3, at the ends of a
+   track repeat the end key with a delta of 0 and the tangent becomes one sided. */
+static inline V3 v3_cubic(V3 p0, V3 p1, V3 p2, V3 p3, f32 d0, f32 d1, f32 d2, f32 t) {
+    V3 m1 = v3_scale(v3_sub(p2, p0), catmull_rom_tangent_scale(d0, d1));
+    V3 m2 = v3_scale(v3_sub(p3, p1), catmull_rom_tangent_scale(d2, d1));
+    f32 h00, h10, h01, h11;
+    hermite_weights(t, &h00, &h10, &h01, &h11);
+    V3 result;
+    result.x = p1.x*h00 + m1.x*h10 + p2.x*h01 + m2.x*h11;
+    result.y = p1.y*h00 + m1.y*h10 + p2.y*h01 + m2.y*h11;
+    result.z = p1.z*h00 + m1.z*h10 + p2.z*h01 + m2.z*h11;
+    return result;
+}
+
+static inline Q4 q4_align(Q4 q, Q4 reference) {
+    f32 cos_omega = q.w*reference.w + q.x*reference.x + q.y*reference.y + q.z*reference.z;
+    return cos_omega < 0.0f ? q4_scale(q, -1.0f) : q;
+}
+
+/* NOTE: the keys are moved to the same hemisphere and the curve is evaluated per component,
+   the result is normalized. Close to a squad for the small angles between animation keys */
+static inline Q4 q4_cubic(Q4 q0, Q4 q1, Q4 q2, Q4 q3, f32 d0, f32 d1, f32 d2, f32 t) {
+    q0 = q4_align(q0, q1);
+    q2 = q4_align(q2, q1);
+    q3 = q4_align(q3, q2);
+    f32 s1 = catmull_rom_tangent_scale(d0, d1);
+    f32 s2 = catmull_rom_tangent_scale(d2, d1);
+    f32 h00, h10, h01, h11;
+    hermite_weights(t, &h00, &h10, &h01, &h11);
+    Q4 result;
+    result.w = q1.w*h00 + (q2.w - q0.w)*s1*h10 + q2.w*h01 + (q3.w - q1.w)*s2*h11;
+    result.x = q1.x*h00 + (q2.x - q0.x)*s1*h10 + q2.x*h01 + (q3.x - q1.x)*s2*h11;
+    result.y = q1.y*h00 + (q2.y - q0.y)*s1*h10 + q2.y*h01 + (q3.y - q1.y)*s2*h11;
+    result.z = q1.z*h00 + (q2.z - q0.z)*s1*h10 + q2.z*h01 + (q3.z - q1.z)*s2*h11;
+    return q4_normalize(result);
+}
+
 static inline M4 q4_to_m4(Q4 q) {
     
     M4 result;
@@ -383,6 +483,26 @@ static inline M4 q4_to_m4(Q4 q) {
     return result;
 }
 
+// NOTE: turns the matrix of a rotation into the transform of (t, r, s), same as
+// m4_mul(m4_translate(t), m4_mul(q4_to_m4(r), m4_scale_v3(s))). The scale multiplies the columns
+static inline void m4_scale_translate(M4 *m, V3 t, V3 s) {
+#if ALGEBRA_SSE
+    __m128 scale = _mm_set_ps(0, s.z, s.y, s.x);
+    _mm_store_ps(m->m + 0, _mm_add_ps(_mm_mul_ps(_mm_load_ps(m->m + 0), scale), _mm_set_ps(t.x, 0, 0, 0)));
+    _mm_store_ps(m->m + 4, _mm_add_ps(_mm_mul_ps(_mm_load_ps(m->m + 4), scale), _mm_set_ps(t.y, 0, 0, 0)));
+    _mm_store_ps(m->m + 8, _mm_add_ps(_mm_mul_ps(_mm_load_ps(m->m + 8), scale), _mm_set_ps(t.z, 0, 0, 0)));
+#else
+    for(u32 r = 0; r < 3; ++r) {
+        m->m[(r<<2) + 0] *= s.x;
+        m->m[(r<<2) + 1] *= s.y;
+        m->m[(r<<2) + 2] *= s.z;
+    }
+    m->m[3] = t.x;
+    m->m[7] = t.y;
+    m->m[11] = t.z;
+#endif
+}
+
 /* M4 helper functions */
 
 static inline V3 m4_get_v3_translation(M4 a) {
@@ -702,5 +822,236 @@ static inline b32 m4_inverse2(const float m[16], float invOut[16])
     return true;
 }
 
+/* M34 affine transforms */
+
+// NOTE: the first three rows of a row major M4, the last row is always (0, 0, 0, 1). A product of two
+// M34 is 36 multiplies instead of the 64 of m4_mul
+typedef struct alignas(16) M34 {
+    float m[12];
+} M34;
+
+static inline M34 m34_identity(void) {
+    M34 m = (M34){{1, 0, 0, 0,
+                   0, 1, 0, 0,
+                   0, 0, 1, 0}};
+    return m;
+}
+
+// NOTE: same as m4_mul(m4_translate(t), m4_mul(q4_to_m4(r), m4_scale_v3(s))), the scale multiplies
+// the columns of the rotation
+static inline M34 m34_from_trs(V3 t, Q4 r, V3 s) {
+    f32 xx = r.x*r.x, yy = r.y*r.y, zz = r.z*r.z;
+    f32 xy = r.x*r.y, xz = r.x*r.z, yz = r.y*r.z;
+    f32 wx = r.w*r.x, wy = r.w*r.y, wz = r.w*r.z;
+    M34 m = (M34){{(1 - 2*(yy + zz))*s.x, 2*(xy - wz)*s.y, 2*(xz + wy)*s.z, t.x,
+                   2*(xy + wz)*s.x, (1 - 2*(xx + zz))*s.y, 2*(yz - wx)*s.z, t.y,
+                   2*(xz - wy)*s.x, 2*(yz + wx)*s.y, (1 - 2*(xx + yy))*s.z, t.z}};
+    return m;
+}
+
+static inline M34 m34_mul(M34 a, M34 b) {
+#define RTC(r, c) a.m[(r<<2)]*b.m[c] + a.m[(r<<2)+1]*b.m[c+4] + a.m[(r<<2)+2]*b.m[c+8]
+    M34 m = {{
+        RTC(0, 0), RTC(0, 1), RTC(0, 2), RTC(0, 3) + a.m[3],
+        RTC(1, 0), RTC(1, 1), RTC(1, 2), RTC(1, 3) + a.m[7],
+        RTC(2, 0), RTC(2, 1), RTC(2, 2), RTC(2, 3) + a.m[11]}};
+#undef RTC
+    return m;
+}
+
+// NOTE: drops the last row, only valid for affine matrices
+static inline M34 m34_from_m4(M4 a) {
+    M34 m;
+    for(u32 i = 0; i < 12; ++i) {
+        m.m[i] = a.m[i];
+    }
+    return m;
+}
+
+static inline M4 m34_to_m4(M34 a) {
+    M4 m = (M4){{a.m[0], a.m[1], a.m[2],  a.m[3],
+                 a.m[4], a.m[5], a.m[6],  a.m[7],
+                 a.m[8], a.m[9], a.m[10], a.m[11],
+                 0,      0,      0,       1}};
+    return m;
+}
+
+
+/* DQ dual quaternions */
+
+// NOTE: rigid transform, the rotation in real and the translation in dual = 0.5*(0, t)*real. A skinning
+// palette of dual quaternions is 8 floats per joint and blends without the candy wrapper artifacts of
+// the matrices, but it can not represent scale
+typedef struct DQ {
+    Q4 real;
+    Q4 dual;
+} DQ;
+
+static inline DQ dq_from_rotation_translation(Q4 r, V3 t) {
+    DQ result;
+    result.real = r;
+    result.dual = q4_scale(q4_mul(q4(0, t.x, t.y, t.z), r), 0.5f);
+    return result;
+}
+
+// NOTE: the scale of the columns is removed, only the rotation and the translation are kept. A column
+// scaled to zero (a joint scaled away) has no rotation left, the rotation is the identity then
+#define DQ_MIN_SCALE 1e-6f
+static inline DQ dq_from_m34(M34 a) {
+    V3 s = v3(v3_length(v3(a.m[0], a.m[4], a.m[8])),
+              v3_length(v3(a.m[1], a.m[5], a.m[9])),
+              v3_length(v3(a.m[2], a.m[6], a.m[10])));
+    V3 translation = v3(a.m[3], a.m[7], a.m[11]);
+    if(s.x < DQ_MIN_SCALE || s.y < DQ_MIN_SCALE || s.z < DQ_MIN_SCALE) {
+        return dq_from_rotation_translation(q4(1, 0, 0, 0), translation);
+    }
+    M4 rotation = (M4){{a.m[0]/s.x, a.m[1]/s.y, a.m[2]/s.z,  0,
+                        a.m[4]/s.x, a.m[5]/s.y, a.m[6]/s.z,  0,
+                        a.m[8]/s.x, a.m[9]/s.y, a.m[10]/s.z, 0,
+                        0,          0,          0,           1}};
+    return dq_from_rotation_translation(q4_normalize(q4_from_m4(rotation)), translation);
+}
+
+static inline DQ dq_scale(DQ a, f32 s) {
+    DQ result;
+    result.real = q4_scale(a.real, s);
+    result.dual = q4_scale(a.dual, s);
+    return result;
+}
+
+static inline DQ dq_add(DQ a, DQ b) {
+    DQ result;
+    result.real = q4_add(a.real, b.real);
+    result.dual = q4_add(a.dual, b.dual);
+    return result;
+}
+
+// NOTE: divides by the length of the real part, the result of a weighted sum is a rigid transform again
+static inline DQ dq_normalize(DQ a) {
+    f32 len = sqrtf(a.real.w*a.real.w + a.real.x*a.real.x + a.real.y*a.real.y + a.real.z*a.real.z);
+    if(len != 0) {
+        a = dq_scale(a, 1.0f / len);
+    }
+    return a;
+}
+
+// NOTE: a must be normalized
+static inline V3 dq_transform_point(DQ a, V3 p) {
+    V3 v = v3(a.real.x, a.real.y, a.real.z);
+    V3 d = v3(a.dual.x, a.dual.y, a.dual.z);
+    V3 rotated = v3_add(p, v3_scale(v3_cross(v, v3_add(v3_cross(v, p), v3_scale(p, a.real.w))), 2));
+    V3 translation = v3_scale(v3_add(v3_sub(v3_scale(d, a.real.w), v3_scale(v, a.dual.w)), v3_cross(v, d)), 2);
+    return v3_add(rotated, translation);
+}
+
+/* SIMD paths */
+
+// NOTE: a row of the result is a linear combination of the rows of b, the result can alias a or b
+#if ALGEBRA_SSE
+static inline void m4_mul_sse(M4 *result, M4 *a, M4 *b) {
+    __m128 b0 = _mm_load_ps(b->m + 0);
+    __m128 b1 = _mm_load_ps(b->m + 4);
+    __m128 b2 = _mm_load_ps(b->m + 8);
+    __m128 b3 = _mm_load_ps(b->m + 12);
+    for(u32 r = 0; r < 4; ++r) {
+        f32 *row = a->m + (r<<2);
+        __m128 sum = _mm_mul_ps(_mm_set1_ps(row[0]), b0);
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[1]), b1));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[2]), b2));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[3]), b3));
+        _mm_store_ps(result->m + (r<<2), sum);
+    }
+}
+
+// NOTE: the last row of b is (0, 0, 0, 1), the fourth term only adds the translation of a
+static inline void m34_mul_sse(f32 *result, M34 *a, M34 *b) {
+    __m128 b0 = _mm_load_ps(b->m + 0);
+    __m128 b1 = _mm_load_ps(b->m + 4);
+    __m128 b2 = _mm_load_ps(b->m + 8);
+    __m128 b3 = _mm_set_ps(1, 0, 0, 0);
+    for(u32 r = 0; r < 3; ++r) {
+        f32 *row = a->m + (r<<2);
+        __m128 sum = _mm_mul_ps(_mm_set1_ps(row[0]), b0);
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[1]), b1));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[2]), b2));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[3]), b3));
+        _mm_store_ps(result + (r<<2), sum);
+    }
+}
+
+// NOTE: converts four quaternions at a time, they are transposed to one register per component
+static inline void q4_to_m4_sse(M4 *result, Q4 *q) {
+    __m128 w = _mm_load_ps(&q[0].w);
+    __m128 x = _mm_load_ps(&q[1].w);
+    __m128 y = _mm_load_ps(&q[2].w);
+    __m128 z = _mm_load_ps(&q[3].w);
+    _MM_TRANSPOSE4_PS(w, x, y, z);
+
+    __m128 one = _mm_set1_ps(1);
+    __m128 two = _mm_set1_ps(2);
+    __m128 zero = _mm_setzero_ps();
+    __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+    __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+    __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+    __m128 rows[3][4];
+    rows[0][0] = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz)));
+    rows[0][1] = _mm_mul_ps(two, _mm_sub_ps(xy, wz));
+    rows[0][2] = _mm_mul_ps(two, _mm_add_ps(xz, wy));
+    rows[1][0] = _mm_mul_ps(two, _mm_add_ps(xy, wz));
+    rows[1][1] = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz)));
+    rows[1][2] = _mm_mul_ps(two, _mm_sub_ps(yz, wx));
+    rows[2][0] = _mm_mul_ps(two, _mm_sub_ps(xz, wy));
+    rows[2][1] = _mm_mul_ps(two, _mm_add_ps(yz, wx));
+    rows[2][2] = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy)));
+
+    __m128 last_row = _mm_set_ps(1, 0, 0, 0);
+    for(u32 r = 0; r < 3; ++r) {
+        rows[r][3] = zero;
+        _MM_TRANSPOSE4_PS(rows[r][0], rows[r][1], rows[r][2], rows[r][3]);
+        for(u32 i = 0; i < 4; ++i) {
+            _mm_store_ps(result[i].m + (r<<2), rows[r][i]);
+        }
+    }
+    for(u32 i = 0; i < 4; ++i) {
+        _mm_store_ps(result[i].m + 12, last_row);
+    }
+}
+#endif
+
+/* NOTE: batch entry points, they use the SSE paths when there is one and the scalar functions
+   otherwise. The results can alias the inputs */
+
+static inline void m4_mul_n(M4 *result, M4 *a, M4 *b, u32 count) {
+    for(u32 i = 0; i < count; ++i) {
+#if ALGEBRA_SSE
+        m4_mul_sse(result + i, a + i, b + i);
+#else
+        result[i] = m4_mul(a[i], b[i]);
+#endif
+    }
+}
+
+static inline void m34_mul_n(M34 *result, M34 *a, M34 *b, u32 count) {
+    for(u32 i = 0; i < count; ++i) {
+#if ALGEBRA_SSE
+        m34_mul_sse(result[i].m, a + i, b + i);
+#else
+        result[i] = m34_mul(a[i], b[i]);
+#endif
+    }
+}
+
+static inline void q4_to_m4_n(M4 *result, Q4 *q, u32 count) {
+    u32 i = 0;
+#if ALGEBRA_SSE
+    for(; i + 4 <= count; i += 4) {
+        q4_to_m4_sse(result + i, q + i);
+    }
+#endif
+    for(; i < count; ++i) {
+        result[i] = q4_to_m4(q[i]);
+    }
+}
 
 #endif /* _MATH_H_ */
@@ -1,21 +1,113 @@
 #include "animation.h"
 #include "algebra.h"
 #include "common.h"
+#include "pose_kernels.h"
+#include "blend_tree.h"
 
 #include <cmath>
 #include <cstdlib>
 #include <string.h>
 
+/* -------------------------------------------- */
+/*        Name Table                            */
+/* -------------------------------------------- */
+
+// NOTE: FNV-1a
+static u32 hash_name(const char *name) {
+    u32 hash = 2166136261u;
+    for(const u8 *c = (const u8 *)name; *c; ++c) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void NameTable::initialize(u32 num_names) {
+    // NOTE: power of two with at most half of the slots used, the probe sequences stay short
+    capacity = 4;
+    while(capacity < num_names*2) {
+        capacity <<= 1;
+    }
+    entries = (NameTableEntry *)malloc(sizeof(NameTableEntry)*capacity);
+    memset(entries, 0, sizeof(NameTableEntry)*capacity);
+}
+
+void NameTable::terminate(void) {
+    free(entries);
+    entries = nullptr;
+    capacity = 0;
+}
+
+void NameTable::insert(const char *name, u32 index) {
+    u32 hash = hash_name(name);
+    u32 mask = capacity - 1;
+    for(u32 slot = hash & mask;; slot = (slot + 1) & mask) {
+        NameTableEntry *entry = entries + slot;
+        if(entry->name == nullptr) {
+            entry->name = name;
+            entry->hash = hash;
+            entry->index = index;
+            return;
+        }
+        // NOTE: duplicated names keep the first index, like the linear search did
+        if(entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return;
+        }
+    }
+}
+
+bool NameTable::find(const char *name, u32 *index) {
+    u32 hash = hash_name(name);
+    u32 mask = capacity - 1;
+    for(u32 slot = hash & mask;; slot = (slot + 1) & mask) {
+        NameTableEntry *entry = entries + slot;
+        if(entry->name == nullptr) {
+            return false;
+        }
+        if(entry->hash == hash && strcmp(entry->name, name) == 0) {
+            *index = entry->index;
+            return true;
+        }
+    }
+}
+
 /* -------------------------------------------- */
 /*        Skeleton                              */
 /* -------------------------------------------- */
 
-s32 Skeleton::get_joint_index(const char *name) {
+void Skeleton::initialize_bind_local_poses(void) {
+    bind_local_poses = (JointPose *)malloc(sizeof(JointPose)*num_joints);
     for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
-        Joint *joint = joints + joint_index;
-        if(strcmp(joint->name, name) == 0) {
-            return joint_index;
+        M4 m = joints[joint_index].local_transform;
+        JointPose *pose = bind_local_poses + joint_index;
+        
+        pose->position = m4_get_v3_translation(m);
+        pose->scale.x = v3_length(v3(m.m[0], m.m[4], m.m[8]));
+        pose->scale.y = v3_length(v3(m.m[1], m.m[5], m.m[9]));
+        pose->scale.z = v3_length(v3(m.m[2], m.m[6], m.m[10]));
+
+        // NOTE: remove the scale from the columns before extracting the rotation
+        M4 rotation = m4_identity();
+        for(u32 row = 0; row < 3; ++row) {
+            rotation.m[(row<<2)+0] = pose->scale.x != 0 ? m.m[(row<<2)+0] / pose->scale.x : 0;
+            rotation.m[(row<<2)+1] = pose->scale.y != 0 ? m.m[(row<<2)+1] / pose->scale.y : 0;
+            rotation.m[(row<<2)+2] = pose->scale.z != 0 ? m.m[(row<<2)+2] / pose->scale.z : 0;
         }
+        pose->rotation = q4_normalize(q4_from_m4(rotation));
+    }
+}
+
+void Skeleton::initialize_joint_names(void) {
+    joint_names.initialize(num_joints);
+    for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+        joint_names.insert(joints[joint_index].name, joint_index);
+    }
+}
+
+s32 Skeleton::get_joint_index(const char *name) {
+    u32 joint_index = 0;
+    if(joint_names.find(name, &joint_index)) {
+        return joint_index;
     }
     ASSERT(!"Invalid code path");
     return -1;
@@ -32,44 +124,501 @@ bool Skeleton::joint_is_in_hierarchy(s32 index, s32 parent_index) {
     return false;
 }
 
+u32 Skeleton::get_hierarchy_end(s32 index) {
+    u32 end = index + 1;
+    while(end < num_joints && joints[end].parent >= index) {
+        ++end;
+    }
+    return end;
+}
+
 /* -------------------------------------------- */
-/*        Animation State                       */
+/*        Animation Clip                        */
 /* -------------------------------------------- */
 
-void AnimationState::sample_prev_and_next_animation_pose(AnimationSample *prev, AnimationSample *next, f32 time) {
+// NOTE: every segment is padded to 16 bytes so the streams of all the segments keep the same alignment
+static u32 segment_stream_offset(u32 capacity) {
+    u32 time_stamps_size = (sizeof(f32)*capacity + 15) & ~15;
+    return sizeof(AnimationSegment) + time_stamps_size;
+}
+
+// NOTE: rounded to 16 bytes, the rotations of every track stay aligned
+static u32 segment_track_size(u32 capacity) {
+    return ((sizeof(Q4) + sizeof(V3) + sizeof(V3))*capacity + 15) & ~15;
+}
+
+void AnimationClip::build_segments(u32 samples_per_segment) {
+    
+    ASSERT(layout == ANIMATION_CLIP_LAYOUT_SOA);
+    ASSERT(samples_per_segment > 0);
+    u32 num_joints = skeleton->num_joints;
+
+    // NOTE: samples_per_segment intervals need samples_per_segment + 1 samples, plus the neighbour
+    // sample before and after the segment for the cubic tangents
+    segment_capacity = samples_per_segment + 3;
+    segment_size = segment_stream_offset(segment_capacity) + segment_track_size(segment_capacity)*num_joints;
+    segment_size = (segment_size + 15) & ~15;
+    num_segments = num_samples > 1 ? (num_samples - 2) / samples_per_segment + 1 : 1;
     
-    u32 next_sample_index = 1;
-    for(u32 sample_index = 0; sample_index < animation->num_samples; ++sample_index) {
-        AnimationSample *sample = animation->samples + sample_index;
-        if(sample->time_stamp > time) {
-            next_sample_index = sample_index;
-            break;
+    segments = (u8 *)malloc((u64)segment_size*num_segments);
+    segment_times = (f32 *)malloc(sizeof(f32)*(num_segments + 1));
+
+    for(u32 segment_index = 0; segment_index < num_segments; ++segment_index) {
+        AnimationSegment *segment = get_segment(segment_index);
+        segment->first_sample = segment_index*samples_per_segment;
+        segment->num_samples = MIN(samples_per_segment + 1, num_samples - segment->first_sample);
+        segment->start_time = time_stamps[segment->first_sample];
+        segment->end_time = time_stamps[segment->first_sample + segment->num_samples - 1];
+        segment_times[segment_index] = segment->start_time;
+        
+        // NOTE: the neighbour samples are clamped to the clip, like the cubic sampling of the other layouts
+        f32 *segment_time_stamps = get_segment_time_stamps(segment);
+        for(s32 key_index = -1; key_index <= (s32)segment->num_samples; ++key_index) {
+            s32 sample_index = CLAMP((s32)segment->first_sample + key_index, 0, (s32)num_samples - 1);
+            segment_time_stamps[key_index] = time_stamps[sample_index];
+            for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+                AnimationTrack *track = tracks + joint_index;
+                get_segment_rotations(segment, joint_index)[key_index] = track->rotations[sample_index];
+                get_segment_positions(segment, joint_index)[key_index] = track->positions[sample_index];
+                get_segment_scales(segment, joint_index)[key_index] = track->scales[sample_index];
+            }
         }
     }
+    segment_times[num_segments] = get_segment(num_segments - 1)->end_time;
+
+    // NOTE: the segments replace the tracks, the track streams live in the tracks allocation
+    free(tracks);
+    free(time_stamps);
+    tracks = nullptr;
+    time_stamps = nullptr;
+    layout = ANIMATION_CLIP_LAYOUT_SEGMENTED;
+}
+
+AnimationSegment *AnimationClip::get_segment(u32 index) {
+    ASSERT(index < num_segments);
+    return (AnimationSegment *)(segments + (u64)segment_size*index);
+}
+
+// NOTE: the streams returned point to the first sample of the segment, index -1 and num_samples
+// are the neighbour samples
+f32 *AnimationClip::get_segment_time_stamps(AnimationSegment *segment) {
+    return (f32 *)((u8 *)segment + sizeof(AnimationSegment)) + 1;
+}
+
+Q4 *AnimationClip::get_segment_rotations(AnimationSegment *segment, u32 joint_index) {
+    u8 *track = (u8 *)segment + segment_stream_offset(segment_capacity) + segment_track_size(segment_capacity)*joint_index;
+    return (Q4 *)track + 1;
+}
+
+V3 *AnimationClip::get_segment_positions(AnimationSegment *segment, u32 joint_index) {
+    u8 *track = (u8 *)(get_segment_rotations(segment, joint_index) - 1);
+    return (V3 *)(track + sizeof(Q4)*segment_capacity) + 1;
+}
+
+V3 *AnimationClip::get_segment_scales(AnimationSegment *segment, u32 joint_index) {
+    return get_segment_positions(segment, joint_index) + segment_capacity;
+}
+
+// NOTE: the fields are compared one by one, the padding of JointPose is not initialized
+static bool pose_equal(JointPose *a, JointPose *b) {
+    return memcmp(&a->position, &b->position, sizeof(V3)) == 0 &&
+           memcmp(&a->rotation, &b->rotation, sizeof(Q4)) == 0 &&
+           memcmp(&a->scale, &b->scale, sizeof(V3)) == 0;
+}
+
+static bool stream_is_constant(u8 *keys, u32 key_size, u32 num_keys) {
+    for(u32 key_index = 1; key_index < num_keys; ++key_index) {
+        if(memcmp(keys + (u64)key_size*key_index, keys, key_size) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AnimationClip::is_constant(void) {
+    u32 num_joints = skeleton->num_joints;
+    if(layout == ANIMATION_CLIP_LAYOUT_AOS) {
+        for(u32 sample_index = 1; sample_index < num_samples; ++sample_index) {
+            for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+                if(!pose_equal(samples[sample_index].local_poses + joint_index, samples[0].local_poses + joint_index)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    if(layout == ANIMATION_CLIP_LAYOUT_SEGMENTED) {
+        // NOTE: every sample of every segment against the first sample of the clip
+        AnimationSegment *first = get_segment(0);
+        for(u32 segment_index = 0; segment_index < num_segments; ++segment_index) {
+            AnimationSegment *segment = get_segment(segment_index);
+            for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+                Q4 rotation = get_segment_rotations(first, joint_index)[0];
+                V3 position = get_segment_positions(first, joint_index)[0];
+                V3 scale = get_segment_scales(first, joint_index)[0];
+                for(u32 key_index = 0; key_index < segment->num_samples; ++key_index) {
+                    if(memcmp(get_segment_rotations(segment, joint_index) + key_index, &rotation, sizeof(Q4)) != 0 ||
+                       memcmp(get_segment_positions(segment, joint_index) + key_index, &position, sizeof(V3)) != 0 ||
+                       memcmp(get_segment_scales(segment, joint_index) + key_index, &scale, sizeof(V3)) != 0) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+    for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+        AnimationTrack *track = tracks + joint_index;
+        bool sparse = layout == ANIMATION_CLIP_LAYOUT_SPARSE;
+        if(!stream_is_constant((u8 *)track->rotations, sizeof(Q4), sparse ? track->num_rotation_keys : num_samples) ||
+           !stream_is_constant((u8 *)track->positions, sizeof(V3), sparse ? track->num_position_keys : num_samples) ||
+           !stream_is_constant((u8 *)track->scales, sizeof(V3), sparse ? track->num_scale_keys : num_samples)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* -------------------------------------------- */
+/*        Animation State                       */
+/* -------------------------------------------- */
+
+// NOTE: move the cursor to the last key with time stamp <= time, while playing forward the
+// cursor only moves one or two keys each frame. Returns an index in [0, num_keys - 2]
+static u32 advance_key_cursor(f32 *time_stamps, u32 num_keys, u32 cursor, f32 time) {
     
-    u32 prev_sample_index = next_sample_index - 1;
+    ASSERT(num_keys > 1);
+    u32 last_prev_index = num_keys - 2;
+    
+    if(cursor > last_prev_index) {
+        cursor = last_prev_index;
+    }
     
-    *prev = animation->samples[prev_sample_index];
-    *next = animation->samples[next_sample_index];
+    // NOTE: backward seek, this only happens after a loop or when the time is set manually
+    while(cursor > 0 && time_stamps[cursor] > time) {
+        --cursor;
+    }
+    
+    while(cursor < last_prev_index && time_stamps[cursor + 1] <= time) {
+        ++cursor;
+    }
 
+    return cursor;
 }
 
-void AnimationState::mix_samples(JointPose *dst, JointPose *a, JointPose *b, f32 t) {
-    Skeleton *skeleton = animation->skeleton;
-    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
-        dst[joint_index].position = v3_lerp(a[joint_index].position, b[joint_index].position, t);
-        dst[joint_index].rotation = q4_slerp(a[joint_index].rotation, b[joint_index].rotation, t);
-        dst[joint_index].scale = v3_lerp(a[joint_index].scale, b[joint_index].scale, t);
+static f32 key_progression(f32 *time_stamps, u32 prev_index, u32 next_index, f32 time) {
+    f32 prev_time_stamp = time_stamps[prev_index];
+    f32 next_time_stamp = time_stamps[next_index];
+    f32 progression = 0;
+    if(next_time_stamp > prev_time_stamp) {
+        progression = (time - prev_time_stamp) / (next_time_stamp - prev_time_stamp);
+        progression = CLAMP(progression, 0.0f, 1.0f);
     }
+    return progression;
+}
+
+// NOTE: time between the four keys of a cubic curve, the neighbours are clamped at the ends of the track
+static void cubic_key_deltas(f32 *time_stamps, s32 prev_index, s32 next_index, s32 num_keys, f32 *d0, f32 *d1, f32 *d2) {
+    s32 before = MAX(prev_index - 1, 0);
+    s32 after = MIN(next_index + 1, num_keys - 1);
+    *d0 = time_stamps[prev_index] - time_stamps[before];
+    *d1 = time_stamps[next_index] - time_stamps[prev_index];
+    *d2 = time_stamps[after] - time_stamps[next_index];
 }
 
-void AnimationState::sample_animation_pose(JointPose *pose) {
+u32 AnimationState::find_prev_sample_index(f32 time) {
     
-    AnimationSample prev, next; 
-    sample_prev_and_next_animation_pose(&prev, &next, time);
+    ASSERT(animation->num_samples > 0);
+    if(animation->num_samples == 1) return 0;
+
+    u32 last_prev_index = animation->num_samples - 2;
+    f32 *time_stamps = animation->time_stamps;
+
+    if(animation->flags & ANIMATION_CLIP_UNIFORM) {
+        // NOTE: uniformly sampled clips map time to the sample index directly
+        f32 index = (time - time_stamps[0]) * animation->inv_sample_delta;
+        if(index <= 0) {
+            cursor = 0;
+        } else {
+            cursor = MIN((u32)index, last_prev_index);
+        }
+        return cursor;
+    }
+
+    cursor = advance_key_cursor(time_stamps, animation->num_samples, cursor, time);
+    return cursor;
+}
+
+void AnimationState::reset_cursors(void) {
+    cursor = 0;
+    if(track_cursors) {
+        memset(track_cursors, 0, sizeof(TrackCursor)*animation->skeleton->num_joints);
+    }
+}
+
+void AnimationState::build_mask_runs(void) {
+    num_mask_runs = 0;
+    u32 num_joints = animation->skeleton->num_joints;
+    for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+        f32 joint_weight = joint_weights[joint_index];
+        if(joint_weight == 0) continue;
+        JointMaskRun *last = num_mask_runs > 0 ? mask_runs + num_mask_runs - 1 : nullptr;
+        if(last && last->first_joint + last->num_joints == joint_index && last->weight == joint_weight) {
+            ++last->num_joints;
+        } else {
+            JointMaskRun *run = mask_runs + num_mask_runs++;
+            run->first_joint = joint_index;
+            run->num_joints = 1;
+            run->weight = joint_weight;
+        }
+    }
+}
+
+void AnimationState::mix_samples(JointPose *dst, JointPose *a, JointPose *b, f32 t, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint) {
+    pose_mix(dst + begin_joint, a + begin_joint, b + begin_joint, t, end_joint - begin_joint, interpolation);
+}
+
+void AnimationState::mix_tracks(JointPose *dst, u32 a, u32 b, f32 t, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint) {
+    // NOTE: the keys of the tracks are gathered in lanes of joints for the kernels
+    PoseLanes lanes_a;
+    PoseLanes lanes_b;
+    f32 lanes_t[POSE_LANES];
+    for(u32 lane = 0; lane < POSE_LANES; ++lane) {
+        lanes_t[lane] = t;
+    }
+    for(u32 first_joint = begin_joint; first_joint < end_joint; first_joint += POSE_LANES) {
+        u32 num_lanes = MIN(end_joint - first_joint, POSE_LANES);
+        for(u32 lane = 0; lane < num_lanes; ++lane) {
+            AnimationTrack *track = animation->tracks + first_joint + lane;
+            pose_lanes_set(&lanes_a, lane, track->positions[a], track->rotations[a], track->scales[a]);
+            pose_lanes_set(&lanes_b, lane, track->positions[b], track->rotations[b], track->scales[b]);
+        }
+        pose_lanes_mix(&lanes_a, &lanes_a, &lanes_b, lanes_t, num_lanes, interpolation);
+        for(u32 lane = 0; lane < num_lanes; ++lane) {
+            pose_lanes_get(&lanes_a, lane, dst + first_joint + lane);
+        }
+    }
+}
+
+void AnimationState::mix_samples_cubic(JointPose *dst, u32 a, u32 b, f32 t, u32 begin_joint, u32 end_joint) {
+    u32 before = a > 0 ? a - 1 : a;
+    u32 after = MIN(b + 1, animation->num_samples - 1);
+    f32 d0, d1, d2;
+    cubic_key_deltas(animation->time_stamps, a, b, animation->num_samples, &d0, &d1, &d2);
+    JointPose *p0 = animation->samples[before].local_poses;
+    JointPose *p1 = animation->samples[a].local_poses;
+    JointPose *p2 = animation->samples[b].local_poses;
+    JointPose *p3 = animation->samples[after].local_poses;
+    for(u32 joint_index = begin_joint; joint_index < end_joint; ++joint_index) {
+        dst[joint_index].position = v3_cubic(p0[joint_index].position, p1[joint_index].position, p2[joint_index].position, p3[joint_index].position, d0, d1, d2, t);
+        dst[joint_index].rotation = q4_cubic(p0[joint_index].rotation, p1[joint_index].rotation, p2[joint_index].rotation, p3[joint_index].rotation, d0, d1, d2, t);
+        dst[joint_index].scale = v3_lerp(p1[joint_index].scale, p2[joint_index].scale, t);
+    }
+}
+
+void AnimationState::mix_tracks_cubic(JointPose *dst, u32 a, u32 b, f32 t, u32 begin_joint, u32 end_joint) {
+    u32 before = a > 0 ? a - 1 : a;
+    u32 after = MIN(b + 1, animation->num_samples - 1);
+    f32 d0, d1, d2;
+    cubic_key_deltas(animation->time_stamps, a, b, animation->num_samples, &d0, &d1, &d2);
+    for(u32 joint_index = begin_joint; joint_index < end_joint; ++joint_index) {
+        AnimationTrack *track = animation->tracks + joint_index;
+        dst[joint_index].position = v3_cubic(track->positions[before], track->positions[a], track->positions[b], track->positions[after], d0, d1, d2, t);
+        dst[joint_index].rotation = q4_cubic(track->rotations[before], track->rotations[a], track->rotations[b], track->rotations[after], d0, d1, d2, t);
+        dst[joint_index].scale = v3_lerp(track->scales[a], track->scales[b], t);
+    }
+}
+
+void AnimationState::sample_sparse_tracks(JointPose *dst, f32 time, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint) {
+    Skeleton *skeleton = animation->skeleton;
+    bool cubic = (animation->flags & ANIMATION_CLIP_CUBIC) != 0;
+    // NOTE: the streams that are not written are the bind pose, or no change for the additive clips
+    bool additive = (animation->flags & ANIMATION_CLIP_ADDITIVE) != 0;
+    JointPose identity_pose;
+    identity_pose.position = v3(0, 0, 0);
+    identity_pose.rotation = q4(1, 0, 0, 0);
+    identity_pose.scale = v3(1, 1, 1);
+    // NOTE: the linear rotations of the animated tracks are compacted in lanes, each lane with the
+    // progression between its own keys
+    PoseLanes lanes_a;
+    PoseLanes lanes_b;
+    f32 lanes_t[POSE_LANES];
+    u32 lane_joints[POSE_LANES];
+    u32 num_lanes = 0;
+    for(u32 joint_index = begin_joint; joint_index < end_joint; ++joint_index) {
+        AnimationTrack *track = animation->tracks + joint_index;
+        TrackCursor *track_cursor = track_cursors + joint_index;
+        JointPose *pose = dst + joint_index;
+        JointPose *bind_pose = additive ? &identity_pose : skeleton->bind_local_poses + joint_index;
+
+        // NOTE: constant streams have one key and the streams equal to the bind pose have none,
+        // only the animated streams are interpolated
+        if(track->num_position_keys > 1) {
+            u32 prev = track_cursor->position = advance_key_cursor(track->position_times, track->num_position_keys, track_cursor->position, time);
+            f32 t = key_progression(track->position_times, prev, prev + 1, time);
+            if(cubic) {
+                u32 before = prev > 0 ? prev - 1 : prev;
+                u32 after = MIN(prev + 2, track->num_position_keys - 1);
+                f32 d0, d1, d2;
+                cubic_key_deltas(track->position_times, prev, prev + 1, track->num_position_keys, &d0, &d1, &d2);
+                pose->position = v3_cubic(track->positions[before], track->positions[prev], track->positions[prev + 1], track->positions[after], d0, d1, d2, t);
+            } else {
+                pose->position = v3_lerp(track->positions[prev], track->positions[prev + 1], t);
+            }
+        } else if(track->num_position_keys == 1) {
+            pose->position = track->positions[0];
+        } else {
+            pose->position = bind_pose->position;
+        }
+        
+        if(track->num_rotation_keys > 1) {
+            u32 prev = track_cursor->rotation = advance_key_cursor(track->rotation_times, track->num_rotation_keys, track_cursor->rotation, time);
+            f32 t = key_progression(track->rotation_times, prev, prev + 1, time);
+            if(cubic) {
+                u32 before = prev > 0 ? prev - 1 : prev;
+                u32 after = MIN(prev + 2, track->num_rotation_keys - 1);
+                f32 d0, d1, d2;
+                cubic_key_deltas(track->rotation_times, prev, prev + 1, track->num_rotation_keys, &d0, &d1, &d2);
+                pose->rotation = q4_cubic(track->rotations[before], track->rotations[prev], track->rotations[prev + 1], track->rotations[after], d0, d1, d2, t);
+            } else {
+                pose_lanes_set_rotation(&lanes_a, num_lanes, track->rotations[prev]);
+                pose_lanes_set_rotation(&lanes_b, num_lanes, track->rotations[prev + 1]);
+                lanes_t[num_lanes] = t;
+                lane_joints[num_lanes++] = joint_index;
+                if(num_lanes == POSE_LANES) {
+                    pose_lanes_mix_rotations(&lanes_a, &lanes_a, &lanes_b, lanes_t, num_lanes, interpolation);
+                    for(u32 lane = 0; lane < num_lanes; ++lane) {
+                        dst[lane_joints[lane]].rotation = pose_lanes_get_rotation(&lanes_a, lane);
+                    }
+                    num_lanes = 0;
+                }
+            }
+        } else if(track->num_rotation_keys == 1) {
+            pose->rotation = track->rotations[0];
+        } else {
+            pose->rotation = bind_pose->rotation;
+        }
+        
+        if(track->num_scale_keys > 1) {
+            u32 prev = track_cursor->scale = advance_key_cursor(track->scale_times, track->num_scale_keys, track_cursor->scale, time);
+            f32 t = key_progression(track->scale_times, prev, prev + 1, time);
+            pose->scale = v3_lerp(track->scales[prev], track->scales[prev + 1], t);
+        } else if(track->num_scale_keys == 1) {
+            pose->scale = track->scales[0];
+        } else {
+            pose->scale = bind_pose->scale;
+        }
+    }
+
+    pose_lanes_mix_rotations(&lanes_a, &lanes_a, &lanes_b, lanes_t, num_lanes, interpolation);
+    for(u32 lane = 0; lane < num_lanes; ++lane) {
+        dst[lane_joints[lane]].rotation = pose_lanes_get_rotation(&lanes_a, lane);
+    }
+}
+
+void AnimationState::sample_segment(JointPose *dst, f32 time, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint) {
+
+    // NOTE: find the segment with the small segment_times table, uniform clips compute it directly,
+    // after that only the memory of the segment is touched
+    u32 segment_index = 0;
+    if(animation->num_segments > 1) {
+        if(animation->flags & ANIMATION_CLIP_UNIFORM) {
+            f32 index = (time - animation->segment_times[0]) * animation->inv_sample_delta;
+            u32 sample_index = index > 0 ? (u32)index : 0;
+            u32 samples_per_segment = animation->segment_capacity - 3;
+            segment_index = MIN(sample_index / samples_per_segment, animation->num_segments - 1);
+        } else {
+            segment_index = advance_key_cursor(animation->segment_times, animation->num_segments + 1, cursor, time);
+        }
+    }
+    cursor = segment_index;
+
+    AnimationSegment *segment = animation->get_segment(segment_index);
+    f32 *time_stamps = animation->get_segment_time_stamps(segment);
+    u32 prev = 0;
+    u32 next = 0;
+    f32 t = 0;
+    if(segment->num_samples > 1) {
+        prev = advance_key_cursor(time_stamps, segment->num_samples, 0, time);
+        next = prev + 1;
+        t = key_progression(time_stamps, prev, next, time);
+    }
+
+    // NOTE: the neighbour samples of the cubic curve are stored in the segment, at index -1 and num_samples
+    bool cubic = (animation->flags & ANIMATION_CLIP_CUBIC) != 0;
+    s32 before = (s32)prev - 1;
+    s32 after = (s32)next + 1;
+    f32 d0 = time_stamps[prev] - time_stamps[before];
+    f32 d1 = time_stamps[next] - time_stamps[prev];
+    f32 d2 = time_stamps[after] - time_stamps[next];
+
+    if(cubic) {
+        for(u32 joint_index = begin_joint; joint_index < end_joint; ++joint_index) {
+            Q4 *rotations = animation->get_segment_rotations(segment, joint_index);
+            V3 *positions = animation->get_segment_positions(segment, joint_index);
+            V3 *scales = animation->get_segment_scales(segment, joint_index);
+            dst[joint_index].position = v3_cubic(positions[before], positions[prev], positions[next], positions[after], d0, d1, d2, t);
+            dst[joint_index].rotation = q4_cubic(rotations[before], rotations[prev], rotations[next], rotations[after], d0, d1, d2, t);
+            dst[joint_index].scale = v3_lerp(scales[prev], scales[next], t);
+        }
+        return;
+    }
+
+    PoseLanes lanes_a;
+    PoseLanes lanes_b;
+    f32 lanes_t[POSE_LANES];
+    for(u32 lane = 0; lane < POSE_LANES; ++lane) {
+        lanes_t[lane] = t;
+    }
+    for(u32 first_joint = begin_joint; first_joint < end_joint; first_joint += POSE_LANES) {
+        u32 num_lanes = MIN(end_joint - first_joint, POSE_LANES);
+        for(u32 lane = 0; lane < num_lanes; ++lane) {
+            Q4 *rotations = animation->get_segment_rotations(segment, first_joint + lane);
+            V3 *positions = animation->get_segment_positions(segment, first_joint + lane);
+            V3 *scales = animation->get_segment_scales(segment, first_joint + lane);
+            pose_lanes_set(&lanes_a, lane, positions[prev], rotations[prev], scales[prev]);
+            pose_lanes_set(&lanes_b, lane, positions[next], rotations[next], scales[next]);
+        }
+        pose_lanes_mix(&lanes_a, &lanes_a, &lanes_b, lanes_t, num_lanes, interpolation);
+        for(u32 lane = 0; lane < num_lanes; ++lane) {
+            pose_lanes_get(&lanes_a, lane, dst + first_joint + lane);
+        }
+    }
+}
+
+void AnimationState::sample_animation_pose(JointPose *pose, RotationInterpolation interpolation) {
+    sample_animation_pose(pose, interpolation, 0, animation->skeleton->num_joints);
+}
+
+void AnimationState::sample_animation_pose(JointPose *pose, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint) {
     
-    f32 progression = (time - prev.time_stamp) / (next.time_stamp - prev.time_stamp);
-    mix_samples(pose, prev.local_poses, next.local_poses, progression);
+    ASSERT(begin_joint <= end_joint && end_joint <= animation->skeleton->num_joints);
+    if(animation->layout == ANIMATION_CLIP_LAYOUT_SPARSE) {
+        sample_sparse_tracks(pose, time, interpolation, begin_joint, end_joint);
+        return;
+    }
+    if(animation->layout == ANIMATION_CLIP_LAYOUT_SEGMENTED) {
+        sample_segment(pose, time, interpolation, begin_joint, end_joint);
+        return;
+    }
+
+    u32 prev_sample_index = find_prev_sample_index(time);
+    u32 next_sample_index = MIN(prev_sample_index + 1, animation->num_samples - 1);
+    f32 progression = key_progression(animation->time_stamps, prev_sample_index, next_sample_index, time);
+
+    if(animation->flags & ANIMATION_CLIP_CUBIC) {
+        if(animation->layout == ANIMATION_CLIP_LAYOUT_SOA) {
+            mix_tracks_cubic(pose, prev_sample_index, next_sample_index, progression, begin_joint, end_joint);
+        } else {
+            mix_samples_cubic(pose, prev_sample_index, next_sample_index, progression, begin_joint, end_joint);
+        }
+    } else if(animation->layout == ANIMATION_CLIP_LAYOUT_SOA) {
+        mix_tracks(pose, prev_sample_index, next_sample_index, progression, interpolation, begin_joint, end_joint);
+    } else {
+        AnimationSample *prev = animation->samples + prev_sample_index;
+        AnimationSample *next = animation->samples + next_sample_index;
+        mix_samples(pose, prev->local_poses, next->local_poses, progression, interpolation, begin_joint, end_joint);
+    }
 }
 
 /* -------------------------------------------- */
@@ -79,6 +628,9 @@ void AnimationState::sample_animation_pose(JointPose *pose) {
 void AnimationSet::initialize(AnimationClip *animations, u32 num_animations) {
     
     skeleton = animations[0].skeleton;
+    rotation_interpolation = ROTATION_INTERPOLATION_SLERP;
+    blend_mode = POSE_BLEND_MODE_MIX;
+    blend_tree = nullptr;
     num_states = num_animations;
     states = (AnimationState *)malloc(sizeof(AnimationState)*num_states);
 
@@ -93,28 +645,169 @@ void AnimationSet::initialize(AnimationClip *animations, u32 num_animations) {
         animation_state->time = 0;
         animation_state->weight = 0;
         animation_state->enable = false;
+        animation_state->contributes = false;
         animation_state->loop = false;
+        animation_state->layer = false;
         animation_state->root = 0;
+        animation_state->sync_group = ANIMATION_SYNC_GROUP_NONE;
+        animation_state->root_motion_time = 0;
+        animation_state->constant = animation->is_constant();
+        animation_state->sampled_time = 0;
+        animation_state->sampled_weight = 0;
+        animation_state->sampled_enable = false;
+        animation_state->joint_weights = (f32 *)malloc(sizeof(f32)*skeleton->num_joints);
+        animation_state->mask_runs = (JointMaskRun *)malloc(sizeof(JointMaskRun)*skeleton->num_joints);
+        u32 end_joint = skeleton->get_hierarchy_end(0);
+        for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+            animation_state->joint_weights[joint_index] = joint_index < end_joint ? 1.0f : 0.0f;
+        }
+        animation_state->build_mask_runs();
+        animation_state->cursor = 0;
+        animation_state->track_cursors = nullptr;
+        if(animation->layout == ANIMATION_CLIP_LAYOUT_SPARSE) {
+            animation_state->track_cursors = (TrackCursor *)malloc(sizeof(TrackCursor)*skeleton->num_joints);
+            animation_state->reset_cursors();
+        }
     
     }
 
+    for(u32 group_index = 0; group_index < ANIMATION_MAX_SYNC_GROUPS; ++group_index) {
+        sync_groups[group_index].phase = 0;
+        sync_groups[group_index].duration = 0;
+    }
+
+    state_names.initialize(num_states);
+    for(u32 state_index = 0; state_index < num_states; ++state_index) {
+        state_names.insert(states[state_index].animation->name, state_index);
+    }
+
     final_local_pose = (JointPose *)malloc(sizeof(JointPose)*skeleton->num_joints);
     intermidiate_local_pose = (JointPose *)malloc(sizeof(JointPose)*skeleton->num_joints);
+    final_joint_weights = (f32 *)malloc(sizeof(f32)*skeleton->num_joints);
+    joint_overridden = (bool *)malloc(sizeof(bool)*skeleton->num_joints);
+    memset(&stats, 0, sizeof(stats));
     
+    root_motion_translation = v3(0, 0, 0);
+    root_motion_yaw = 0;
+    root_motion_weights = (f32 *)malloc(sizeof(f32)*num_states);
+
+    last_local_pose = (JointPose *)malloc(sizeof(JointPose)*skeleton->num_joints);
+    previous_local_pose = (JointPose *)malloc(sizeof(JointPose)*skeleton->num_joints);
+    last_dt = 0;
+    num_pose_history = 0;
+    inertial_offsets = (InertialOffset *)malloc(sizeof(InertialOffset)*skeleton->num_joints);
+    inertialization_pending = false;
+    inertialization_active = false;
+    inertialization_time = 0;
+    inertialization_duration = 0;
+
+    model_transforms = (M4 *)malloc(sizeof(M4)*skeleton->num_joints);
+    inv_bind_transforms = (M4 *)malloc(sizeof(M4)*skeleton->num_joints);
+    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+        inv_bind_transforms[joint_index] = skeleton->joints[joint_index].inv_bind_transform;
+    }
+
+    transforms_valid = false;
+    joint_pose_dirty = (bool *)malloc(sizeof(bool)*skeleton->num_joints);
+    joint_pose_overridden = (bool *)malloc(sizeof(bool)*skeleton->num_joints);
+    memset(joint_pose_dirty, 0, sizeof(bool)*skeleton->num_joints);
+    memset(joint_pose_overridden, 0, sizeof(bool)*skeleton->num_joints);
+    pose_valid = false;
+    pose_edited = false;
+    joint_hierarchy_ends = (u32 *)malloc(sizeof(u32)*skeleton->num_joints);
+    joint_parents = (s32 *)malloc(sizeof(s32)*skeleton->num_joints);
+    joint_dirty = (bool *)malloc(sizeof(bool)*skeleton->num_joints);
+    joint_required = (bool *)malloc(sizeof(bool)*skeleton->num_joints);
+    palette_joints = (u32 *)malloc(sizeof(u32)*skeleton->num_joints);
+    num_palette_joints = skeleton->num_joints;
+    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+        joint_hierarchy_ends[joint_index] = skeleton->get_hierarchy_end(joint_index);
+        joint_parents[joint_index] = skeleton->joints[joint_index].parent;
+        joint_required[joint_index] = true;
+        palette_joints[joint_index] = joint_index;
+    }
+
+    batch_rotations = (Q4 *)malloc(sizeof(Q4)*skeleton->num_joints);
+    batch_matrices = (M4 *)malloc(sizeof(M4)*skeleton->num_joints);
+    batch_indices = (u32 *)malloc(sizeof(u32)*skeleton->num_joints);
+
     final_transform_matrices = (M4 *)malloc(sizeof(M4)*skeleton->num_joints);
+    final_dual_quaternions = (DQ *)malloc(sizeof(DQ)*skeleton->num_joints);
+    skinning_mode = SKINNING_MODE_LINEAR;
 }
 
 void AnimationSet::terminate(void) {
+    for(u32 state_index = 0; state_index < num_states; ++state_index) {
+        free(states[state_index].track_cursors);
+        free(states[state_index].joint_weights);
+        free(states[state_index].mask_runs);
+    }
     free(states);
+    state_names.terminate();
     free(final_local_pose);
     free(intermidiate_local_pose);
+    free(final_joint_weights);
+    free(joint_overridden);
+    free(last_local_pose);
+    free(previous_local_pose);
+    free(inertial_offsets);
+    free(root_motion_weights);
+    free(model_transforms);
+    free(inv_bind_transforms);
+    free(joint_pose_dirty);
+    free(joint_pose_overridden);
+    free(joint_hierarchy_ends);
+    free(joint_parents);
+    free(joint_dirty);
+    free(joint_required);
+    free(palette_joints);
+    free(batch_rotations);
+    free(batch_matrices);
+    free(batch_indices);
     free(final_transform_matrices);
+    free(final_dual_quaternions);
 }
 
-void AnimationSet::play(const char *name, f32 weight, bool loop) {
-    AnimationState *animation = find_animation_by_name(name);
-    ASSERT(animation != nullptr);
+AnimationHandle AnimationSet::get_animation(const char *name) {
+    AnimationHandle handle;
+    handle.index = ANIMATION_INVALID_HANDLE;
+    bool found = state_names.find(name, &handle.index);
+    ASSERT(found);
+    (void)found;
+    return handle;
+}
+
+JointHandle AnimationSet::get_joint(const char *joint) {
+    JointHandle handle;
+    handle.index = ANIMATION_INVALID_HANDLE;
+    s32 joint_index = skeleton->get_joint_index(joint);
+    if(joint_index >= 0) {
+        handle.index = (u32)joint_index;
+    }
+    return handle;
+}
+
+// NOTE: nullptr for ANIMATION_INVALID_HANDLE, the ASSERT catches it in debug builds and the callers
+// ignore the handle in release builds
+AnimationState *AnimationSet::get_state(AnimationHandle handle) {
+    ASSERT(handle.index < num_states);
+    return handle.index < num_states ? states + handle.index : nullptr;
+}
+
+bool AnimationSet::is_valid_joint(JointHandle joint) {
+    ASSERT(joint.index < skeleton->num_joints);
+    return joint.index < skeleton->num_joints;
+}
+
+void AnimationSet::play(AnimationHandle handle, f32 weight, bool loop) {
+    AnimationState *animation = get_state(handle);
+    if(!animation) return;
     animation->time = 0;
+    if(animation->sync_group != ANIMATION_SYNC_GROUP_NONE) {
+        animation->time = get_sync_time(animation, sync_groups[animation->sync_group].phase);
+    }
+    animation->root_motion_time = animation->time;
+    animation->reset_cursors();
     animation->weight = weight;
     animation->enable = true;
     animation->loop = loop;
@@ -122,16 +815,18 @@ void AnimationSet::play(const char *name, f32 weight, bool loop) {
     animation->transition_time = 0;
 }
 
-void AnimationSet::stop(const char *name) {
-    AnimationState *animation = find_animation_by_name(name);
-    ASSERT(animation != nullptr);
+void AnimationSet::stop(AnimationHandle handle) {
+    AnimationState *animation = get_state(handle);
+    if(!animation) return;
     animation->enable = false;
 }
 
-void AnimationSet::play_smooth(const char *name, f32 transition_time) {
-    AnimationState *animation = find_animation_by_name(name);
-    ASSERT(animation != nullptr);
+void AnimationSet::play_smooth(AnimationHandle handle, f32 transition_time) {
+    AnimationState *animation = get_state(handle);
+    if(!animation) return;
     animation->time = 0;
+    animation->root_motion_time = 0;
+    animation->reset_cursors();
     animation->weight = 1;
     animation->enable = true;
     animation->loop = false;
@@ -139,35 +834,326 @@ void AnimationSet::play_smooth(const char *name, f32 transition_time) {
     animation->transition_time = transition_time;    
 }
 
-void AnimationSet::update_weight(const char *name, f32 weight) {
-    AnimationState *animation = find_animation_by_name(name);
-    ASSERT(animation != nullptr);
+// NOTE: the runs are sorted by joint, true if a joint has a weight in both masks
+static bool masks_overlap(AnimationState *a, AnimationState *b) {
+    u32 run_a = 0;
+    u32 run_b = 0;
+    while(run_a < a->num_mask_runs && run_b < b->num_mask_runs) {
+        JointMaskRun *ra = a->mask_runs + run_a;
+        JointMaskRun *rb = b->mask_runs + run_b;
+        u32 end_a = ra->first_joint + ra->num_joints;
+        u32 end_b = rb->first_joint + rb->num_joints;
+        if(ra->first_joint < end_b && rb->first_joint < end_a) {
+            return true;
+        }
+        if(end_a <= end_b) {
+            ++run_a;
+        } else {
+            ++run_b;
+        }
+    }
+    return false;
+}
+
+void AnimationSet::play_inertialized(AnimationHandle handle, f32 blend_time, bool loop) {
+    AnimationState *target = get_state(handle);
+    if(!target) return;
+    for(u32 state_index = 0; state_index < num_states; ++state_index) {
+        AnimationState *state = states + state_index;
+        if(state_index != handle.index && !(state->animation->flags & ANIMATION_CLIP_ADDITIVE) && masks_overlap(state, target)) {
+            state->enable = false;
+        }
+    }
+    play(handle, 1, loop);
+
+    // NOTE: the offsets are computed by the next update, once the pose of the new state is known.
+    // Without a previous pose the state just starts
+    inertialization_pending = blend_time > 0 && num_pose_history > 0;
+    inertialization_active = false;
+    inertialization_duration = blend_time;
+}
+
+void AnimationSet::update_weight(AnimationHandle handle, f32 weight) {
+    AnimationState *animation = get_state(handle);
+    if(!animation) return;
     animation->weight = weight;
 }
 
+void AnimationSet::set_root_joint(AnimationHandle handle, JointHandle joint) {
+    AnimationState *animation = get_state(handle);
+    if(!animation || !is_valid_joint(joint)) return;
+    animation->root = (s32)joint.index;
+
+    // NOTE: the hierarchy of the root joint is the contiguous range [root, hierarchy end)
+    u32 end_joint = skeleton->get_hierarchy_end(animation->root);
+    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+        bool in_hierarchy = joint_index >= (u32)animation->root && joint_index < end_joint;
+        f32 joint_weight = in_hierarchy ? 1.0f : 0.0f;
+        if(animation->joint_weights[joint_index] != joint_weight) {
+            animation->joint_weights[joint_index] = joint_weight;
+            joint_pose_dirty[joint_index] = true;
+            pose_edited = true;
+        }
+    }
+    animation->build_mask_runs();
+}
+
+void AnimationSet::set_joint_weight(AnimationHandle handle, JointHandle joint, f32 weight) {
+    AnimationState *animation = get_state(handle);
+    if(!animation || !is_valid_joint(joint)) return;
+    if(animation->joint_weights[joint.index] != weight) {
+        joint_pose_dirty[joint.index] = true;
+        pose_edited = true;
+    }
+    animation->joint_weights[joint.index] = weight;
+    animation->build_mask_runs();
+}
+
+void AnimationSet::set_sync_group(AnimationHandle handle, u32 group) {
+    ASSERT(group < ANIMATION_MAX_SYNC_GROUPS || group == ANIMATION_SYNC_GROUP_NONE);
+    AnimationState *animation = get_state(handle);
+    if(!animation) return;
+    animation->sync_group = group;
+}
+
+void AnimationSet::set_layer(AnimationHandle handle, bool layer) {
+    AnimationState *animation = get_state(handle);
+    if(!animation) return;
+    pose_valid = pose_valid && animation->layer == layer;
+    animation->layer = layer;
+}
+
+bool AnimationSet::animation_finish(AnimationHandle handle) {
+    AnimationState *animation = get_state(handle);
+    return animation == nullptr || animation->enable == false;
+}
+
+// NOTE: the string API resolves the handles on every call, keep the handles when calling every frame
+
+void AnimationSet::play(const char *name, f32 weight, bool loop) {
+    play(get_animation(name), weight, loop);
+}
+
+void AnimationSet::stop(const char *name) {
+    stop(get_animation(name));
+}
+
+void AnimationSet::play_smooth(const char *name, f32 transition_time) {
+    play_smooth(get_animation(name), transition_time);
+}
+
+void AnimationSet::play_inertialized(const char *name, f32 blend_time, bool loop) {
+    play_inertialized(get_animation(name), blend_time, loop);
+}
+
+void AnimationSet::update_weight(const char *name, f32 weight) {
+    update_weight(get_animation(name), weight);
+}
+
 void AnimationSet::set_root_joint(const char *name, const char *joint) {
-    AnimationState *animation = find_animation_by_name(name);
-    ASSERT(animation != nullptr);
-    animation->root = skeleton->get_joint_index(joint);
+    set_root_joint(get_animation(name), get_joint(joint));
+}
+
+void AnimationSet::set_joint_weight(const char *name, const char *joint, f32 weight) {
+    set_joint_weight(get_animation(name), get_joint(joint), weight);
+}
+
+void AnimationSet::set_sync_group(const char *name, u32 group) {
+    set_sync_group(get_animation(name), group);
+}
+
+void AnimationSet::set_layer(const char *name, bool layer) {
+    set_layer(get_animation(name), layer);
 }
 
 bool AnimationSet::animation_finish(const char *name) {
-    AnimationState *animation = find_animation_by_name(name);
-    ASSERT(animation != nullptr);
-    return animation->enable == false;
+    return animation_finish(get_animation(name));
+}
+
+void AnimationSet::set_rotation_interpolation(RotationInterpolation interpolation) {
+    pose_valid = pose_valid && rotation_interpolation == interpolation;
+    rotation_interpolation = interpolation;
+}
 
+void AnimationSet::set_blend_mode(PoseBlendMode mode) {
+    pose_valid = pose_valid && blend_mode == mode;
+    blend_mode = mode;
+}
+
+void AnimationSet::set_blend_tree(BlendTree *tree) {
+    ASSERT(tree == nullptr || tree->set == this);
+    pose_valid = pose_valid && blend_tree == tree;
+    blend_tree = tree;
+}
+
+void AnimationSet::set_skinning_mode(SkinningMode mode) {
+    // NOTE: the palette of the other mode is out of date for every joint
+    if(skinning_mode != mode) {
+        transforms_valid = false;
+    }
+    skinning_mode = mode;
+}
+
+void AnimationSet::set_skinning_palette(u32 *joints, u32 num_joints) {
+    ASSERT(num_joints <= skeleton->num_joints);
+    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+        joint_required[joint_index] = false;
+    }
+    for(u32 slot = 0; slot < num_joints; ++slot) {
+        ASSERT(joints[slot] < skeleton->num_joints);
+        palette_joints[slot] = joints[slot];
+        for(s32 joint_index = (s32)joints[slot]; joint_index != -1 && !joint_required[joint_index]; joint_index = skeleton->joints[joint_index].parent) {
+            joint_required[joint_index] = true;
+        }
+    }
+    num_palette_joints = num_joints;
+    transforms_valid = false;
+}
+
+JointPose AnimationSet::get_local_pose(JointHandle joint) {
+    if(!is_valid_joint(joint)) {
+        JointPose identity_pose;
+        identity_pose.position = v3(0, 0, 0);
+        identity_pose.rotation = q4(1, 0, 0, 0);
+        identity_pose.scale = v3(1, 1, 1);
+        return identity_pose;
+    }
+    return final_local_pose[joint.index];
+}
+
+void AnimationSet::set_local_pose(JointHandle joint, JointPose pose) {
+    if(!is_valid_joint(joint)) return;
+    final_local_pose[joint.index] = pose;
+    joint_pose_dirty[joint.index] = true;
+    joint_pose_overridden[joint.index] = true;
+    pose_edited = true;
+}
+
+void AnimationSet::update_transforms(void) {
+    calculate_final_transform_matrices();
+}
+
+// NOTE: marks the joints whose local pose changes with this update, from the states whose time (when the
+// clip is not constant), weight or enable changed. Returns false when the pose does not have to be sampled
+bool AnimationSet::mark_dirty_joints(void) {
+
+    bool all_dirty = !pose_valid || inertialization_pending || inertialization_active;
+    bool resample = all_dirty || pose_edited;
+    for(u32 state_index = 0; state_index < num_states; ++state_index) {
+        AnimationState *state = states + state_index;
+        bool changed = state->enable != state->sampled_enable || (state->enable &&
+            (state->weight != state->sampled_weight || (state->time != state->sampled_time && !state->constant)));
+        state->sampled_time = state->time;
+        state->sampled_weight = state->weight;
+        state->sampled_enable = state->enable;
+        resample = resample || changed;
+        if(!changed || all_dirty) continue;
+        for(u32 run_index = 0; run_index < state->num_mask_runs; ++run_index) {
+            JointMaskRun *run = state->mask_runs + run_index;
+            memset(joint_pose_dirty + run->first_joint, 1, sizeof(bool)*run->num_joints);
+        }
+    }
+
+    // NOTE: the joints set with set_local_pose go back to the sampled pose
+    if(pose_edited) {
+        for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+            joint_pose_dirty[joint_index] = joint_pose_dirty[joint_index] || joint_pose_overridden[joint_index];
+            joint_pose_overridden[joint_index] = false;
+        }
+    }
+    if(all_dirty) {
+        memset(joint_pose_dirty, 1, sizeof(bool)*skeleton->num_joints);
+    }
+    pose_valid = true;
+    pose_edited = false;
+    return resample;
 }
 
 void AnimationSet::update(f32 dt) {
     
+    // NOTE: the clocks of all the states advance, even the ones that are not sampled. The states of a
+    // sync group take their time from the phase of the group
+    for(u32 state_index = 0; state_index < num_states; ++state_index) {
+        AnimationState *state = states + state_index;
+        if(state->enable && state->sync_group == ANIMATION_SYNC_GROUP_NONE) {
+            advance_animation_state(state, dt);
+        }
+    }
+    advance_sync_groups(dt);
+    update_root_motion();
+
+    stats.sampled_states = 0;
+    stats.skipped_states = 0;
+    bool resample = mark_dirty_joints();
+
+    // NOTE: the tree keeps its own slots, all the joints are dirty when its result changed
+    if(blend_tree) {
+        zero_final_local_pose();
+        blend_tree->evaluate(final_local_pose);
+        if(blend_tree->changed[blend_tree->num_instructions - 1]) {
+            memset(joint_pose_dirty, 1, sizeof(bool)*skeleton->num_joints);
+        }
+        apply_inertialization(dt);
+        calculate_final_transform_matrices();
+        return;
+    }
+
+    // NOTE: nothing changed since the last update, final_local_pose is still the pose of the states
+    if(!resample) {
+        for(u32 state_index = 0; state_index < num_states; ++state_index) {
+            stats.skipped_states += states[state_index].enable ? 1 : 0;
+        }
+        stats.total_skipped_states += stats.skipped_states;
+        apply_inertialization(dt);
+        calculate_final_transform_matrices();
+        return;
+    }
+
     zero_final_local_pose();
-    
+    find_contributing_states();
+    for(u32 state_index = 0; state_index < num_states; ++state_index) {
+        AnimationState *state = states + state_index;
+        if(!state->enable || (state->animation->flags & ANIMATION_CLIP_ADDITIVE)) continue;
+        if(blend_mode == POSE_BLEND_MODE_ACCUMULATE && state->layer) continue;
+        if(state->contributes) {
+            blend_animation_state(state, blend_mode);
+            ++stats.sampled_states;
+        } else {
+            ++stats.skipped_states;
+        }
+    }
+
+    if(blend_mode == POSE_BLEND_MODE_ACCUMULATE) {
+        pose_normalize(final_local_pose, final_joint_weights, skeleton->bind_local_poses, skeleton->num_joints);
+
+        // NOTE: the layers are mixed over the normalized pose, in the order of the states
+        for(u32 state_index = 0; state_index < num_states; ++state_index) {
+            AnimationState *state = states + state_index;
+            if(!state->enable || !state->layer || (state->animation->flags & ANIMATION_CLIP_ADDITIVE)) continue;
+            if(state->contributes) {
+                blend_animation_state(state, POSE_BLEND_MODE_MIX);
+                ++stats.sampled_states;
+            } else {
+                ++stats.skipped_states;
+            }
+        }
+    }
+
+    // NOTE: the additive states are applied on top of the blended pose, in the order of the states
     for(u32 state_index = 0; state_index < num_states; ++state_index) {
         AnimationState *state = states + state_index;
-        if(state->enable) {
-            update_animation_state(state, dt);
+        if(!state->enable || !(state->animation->flags & ANIMATION_CLIP_ADDITIVE)) continue;
+        if(state->contributes) {
+            add_animation_state(state);
+            ++stats.sampled_states;
+        } else {
+            ++stats.skipped_states;
         }
     }
+    stats.total_sampled_states += stats.sampled_states;
+    stats.total_skipped_states += stats.skipped_states;
+
+    apply_inertialization(dt);
 
     calculate_final_transform_matrices();
 
@@ -175,33 +1161,113 @@ void AnimationSet::update(f32 dt) {
 
 void AnimationSet::calculate_final_transform_matrices(void) {
 
-    // NOTE: Calculate final transformation Matrix
-    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) { 
-        V3 final_position = final_local_pose[joint_index].position;
-        Q4 final_rotation = final_local_pose[joint_index].rotation;
-        V3 final_scale    = final_local_pose[joint_index].scale;
-        final_transform_matrices[joint_index] = m4_mul(m4_translate(final_position), m4_mul(q4_to_m4(final_rotation), m4_scale_v3(final_scale)));
+    // NOTE: the joints are in depth first order, so everything before dirty_end is in the hierarchy of a
+    // joint that changed. The rotations of the dirty joints are gathered for one batch conversion
+    u32 dirty_end = 0;
+    u32 count = 0;
+    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+        if(!transforms_valid || joint_pose_dirty[joint_index]) {
+            dirty_end = MAX(dirty_end, joint_hierarchy_ends[joint_index]);
+        }
+        joint_pose_dirty[joint_index] = false;
+        joint_dirty[joint_index] = joint_index < dirty_end && joint_required[joint_index];
+        if(joint_dirty[joint_index]) {
+            batch_rotations[count] = final_local_pose[joint_index].rotation;
+            batch_indices[count] = joint_index;
+            ++count;
+        }
     }
+    transforms_valid = true;
+    stats.updated_joints = count;
+    stats.total_updated_joints += stats.updated_joints;
 
-    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
-        Joint *joint = skeleton->joints + joint_index;
-        if(joint->parent == -1) {
-            final_transform_matrices[joint_index] = m4_mul(m4_identity(), final_transform_matrices[joint_index]);
+    // NOTE: the rotations are converted in one batch, then the local transforms are multiplied in depth
+    // first order so the parent of a joint is always ready
+    transforms_q4_to_m4_n(batch_matrices, batch_rotations, count);
+    for(u32 batch_index = 0; batch_index < count; ++batch_index) {
+        u32 joint_index = batch_indices[batch_index];
+        JointPose *pose = final_local_pose + joint_index;
+        M4 *local_transform = batch_matrices + batch_index;
+        m4_scale_translate(local_transform, pose->position, pose->scale);
+        s32 parent = joint_parents[joint_index];
+        if(parent == -1) {
+            model_transforms[joint_index] = *local_transform;
         } else {
-            ASSERT(joint->parent < (s32)joint_index);
-            final_transform_matrices[joint_index] = m4_mul(final_transform_matrices[joint->parent], final_transform_matrices[joint_index]);
-
+            transforms_m4_mul_n(model_transforms + joint_index, model_transforms + parent, local_transform, 1);
         }
     }
 
-    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
-        Joint *joint = skeleton->joints + joint_index;
-        final_transform_matrices[joint_index] = m4_mul(final_transform_matrices[joint_index], joint->inv_bind_transform);
+    // NOTE: the bind pass multiplies the runs of dirty palette slots whose joints are consecutive in one
+    // batch, without gathering. The palette is usually the skeleton in order, one run when every joint
+    // is dirty
+    for(u32 slot = 0; slot < num_palette_joints; ++slot) {
+        u32 joint_index = palette_joints[slot];
+        if(!joint_dirty[joint_index]) continue;
+        u32 end_slot = slot + 1;
+        while(end_slot < num_palette_joints && palette_joints[end_slot] == palette_joints[end_slot - 1] + 1 &&
+              joint_dirty[palette_joints[end_slot]]) {
+            ++end_slot;
+        }
+        u32 run = end_slot - slot;
+        if(skinning_mode == SKINNING_MODE_DUAL_QUATERNION) {
+            transforms_m4_mul_n(batch_matrices, model_transforms + joint_index, inv_bind_transforms + joint_index, run);
+            for(u32 batch_index = 0; batch_index < run; ++batch_index) {
+                final_dual_quaternions[slot + batch_index] = dq_from_m34(m34_from_m4(batch_matrices[batch_index]));
+            }
+        } else {
+            transforms_m4_mul_n(final_transform_matrices + slot, model_transforms + joint_index, inv_bind_transforms + joint_index, run);
+        }
+        slot = end_slot - 1;
     }
 
 }
 
-void AnimationSet::update_animation_state(AnimationState *state, f32 dt) {
+void AnimationSet::skin_vertices(V3 *positions, Vertex *vertices, u32 num_vertices) {
+    for(u32 vertex_index = 0; vertex_index < num_vertices; ++vertex_index) {
+        Vertex *vertex = vertices + vertex_index;
+        V3 p = vertex->pos;
+        f32 total_weight = 0;
+        if(skinning_mode == SKINNING_MODE_DUAL_QUATERNION) {
+            // NOTE: the quaternions are flipped to the hemisphere of the first one before the sum
+            DQ blend = {};
+            Q4 first = {};
+            for(u32 i = 0; i < MAX_BONES_INFLUENCE; ++i) {
+                if(vertex->bones_id[i] < 0) continue;
+                ASSERT((u32)vertex->bones_id[i] < num_palette_joints);
+                DQ dq = final_dual_quaternions[vertex->bones_id[i]];
+                f32 weight = vertex->weights[i];
+                if(total_weight == 0) {
+                    first = dq.real;
+                } else if(first.w*dq.real.w + first.x*dq.real.x + first.y*dq.real.y + first.z*dq.real.z < 0) {
+                    weight = -weight;
+                }
+                blend = dq_add(blend, dq_scale(dq, weight));
+                total_weight += vertex->weights[i];
+            }
+            if(total_weight > 0) {
+                p = dq_transform_point(dq_normalize(blend), p);
+            }
+        } else {
+            V3 sum = v3(0, 0, 0);
+            for(u32 i = 0; i < MAX_BONES_INFLUENCE; ++i) {
+                if(vertex->bones_id[i] < 0) continue;
+                ASSERT((u32)vertex->bones_id[i] < num_palette_joints);
+                f32 *m = final_transform_matrices[vertex->bones_id[i]].m;
+                f32 weight = vertex->weights[i];
+                sum.x += (m[0]*p.x + m[1]*p.y + m[2]*p.z + m[3])*weight;
+                sum.y += (m[4]*p.x + m[5]*p.y + m[6]*p.z + m[7])*weight;
+                sum.z += (m[8]*p.x + m[9]*p.y + m[10]*p.z + m[11])*weight;
+                total_weight += weight;
+            }
+            if(total_weight > 0) {
+                p = sum;
+            }
+        }
+        positions[vertex_index] = p;
+    }
+}
+
+void AnimationSet::advance_animation_state(AnimationState *state, f32 dt) {
     AnimationClip *animation = state->animation;
     
     // NOTE: update animation time
@@ -209,6 +1275,7 @@ void AnimationSet::update_animation_state(AnimationState *state, f32 dt) {
     if(state->time >= animation->duration) {
         if(state->loop == true) {
             state->time = 0;
+            state->reset_cursors();
         } else {
             state->enable = false;
             return;
@@ -231,29 +1298,363 @@ void AnimationSet::update_animation_state(AnimationState *state, f32 dt) {
         }
 
     }
+}
 
-    state->sample_animation_pose(intermidiate_local_pose);
+// NOTE: with sync markers the phase is split in one equal part per marker interval (the last one wraps
+// to the first marker), so the contacts of all the members happen at the same phase
+f32 AnimationSet::get_sync_time(AnimationState *state, f32 phase) {
+    AnimationClip *animation = state->animation;
+    f32 time = phase*animation->duration;
+    if(animation->num_sync_markers > 0) {
+        u32 num_markers = animation->num_sync_markers;
+        f32 position = phase*num_markers;
+        u32 marker = MIN((u32)position, num_markers - 1);
+        f32 start = animation->sync_markers[marker];
+        f32 end = marker + 1 < num_markers ? animation->sync_markers[marker + 1] : animation->sync_markers[0] + animation->duration;
+        time = start + (position - marker)*(end - start);
+        if(time >= animation->duration) {
+            time -= animation->duration;
+        }
+    }
+    return CLAMP(time, 0.0f, animation->duration);
+}
 
-    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) { 
-        if(skeleton->joint_is_in_hierarchy(joint_index, state->root)) {
-            JointPose *sample_local_pose = intermidiate_local_pose + joint_index;
-            JointPose *local_pose = final_local_pose + joint_index;
-            
-            local_pose->position = v3_lerp(local_pose->position, sample_local_pose->position, state->weight);
-            local_pose->rotation = q4_slerp(local_pose->rotation, sample_local_pose->rotation, state->weight);
-            local_pose->scale = v3_lerp(local_pose->scale, sample_local_pose->scale, state->weight);
+void AnimationSet::advance_sync_groups(f32 dt) {
+
+    for(u32 group_index = 0; group_index < ANIMATION_MAX_SYNC_GROUPS; ++group_index) {
+        AnimationSyncGroup *group = sync_groups + group_index;
+
+        // NOTE: duration of the cycle averaged by the weights of the members, the plain average when
+        // none of them has weight
+        u32 num_members = 0;
+        f32 total_weight = 0;
+        f32 weighted_duration = 0;
+        f32 total_duration = 0;
+        for(u32 state_index = 0; state_index < num_states; ++state_index) {
+            AnimationState *state = states + state_index;
+            if(!state->enable || state->sync_group != group_index) continue;
+            f32 weight = MAX(state->weight, 0.0f);
+            total_weight += weight;
+            weighted_duration += weight*state->animation->duration;
+            total_duration += state->animation->duration;
+            ++num_members;
+        }
+        if(num_members == 0) continue;
+
+        group->duration = total_weight > 0 ? weighted_duration / total_weight : total_duration / num_members;
+        if(group->duration > 0) {
+            group->phase += dt / group->duration;
+            group->phase -= floorf(group->phase);
+        }
+
+        for(u32 state_index = 0; state_index < num_states; ++state_index) {
+            AnimationState *state = states + state_index;
+            if(!state->enable || state->sync_group != group_index) continue;
+            f32 time = get_sync_time(state, group->phase);
+            if(time < state->time) {
+                state->reset_cursors();
+            }
+            state->time = time;
         }
     }
 }
 
-AnimationState *AnimationSet::find_animation_by_name(const char *name) {
+static V3 rotate_y(V3 v, f32 angle) {
+    f32 s = sinf(angle);
+    f32 c = cosf(angle);
+    return v3(c*v.x + s*v.z, v.y, c*v.z - s*v.x);
+}
+
+static void sample_root_motion(AnimationClip *animation, f32 time, V3 *translation, f32 *yaw) {
+    RootMotionKey *keys = animation->root_motion_keys;
+    u32 num_keys = animation->num_root_motion_keys;
+    if(num_keys == 1 || time <= keys[0].time) {
+        *translation = keys[0].translation;
+        *yaw = keys[0].yaw;
+        return;
+    }
+    if(time >= keys[num_keys - 1].time) {
+        *translation = keys[num_keys - 1].translation;
+        *yaw = keys[num_keys - 1].yaw;
+        return;
+    }
+    // NOTE: last key with time stamp <= time
+    u32 low = 0;
+    u32 high = num_keys - 1;
+    while(high - low > 1) {
+        u32 middle = (low + high) / 2;
+        if(keys[middle].time <= time) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    f32 t = (time - keys[low].time) / (keys[high].time - keys[low].time);
+    *translation = v3_lerp(keys[low].translation, keys[high].translation, t);
+    *yaw = lerp(keys[low].yaw, keys[high].yaw, t);
+}
+
+// NOTE: motion between two times of the clip in the space of the character at the first time, a loop
+// adds the motion to the end of the clip and the motion from the start
+static void root_motion_delta(AnimationClip *animation, f32 from, f32 to, bool wrapped, V3 *translation, f32 *yaw) {
+    V3 from_translation, to_translation;
+    f32 from_yaw, to_yaw;
+    sample_root_motion(animation, from, &from_translation, &from_yaw);
+    sample_root_motion(animation, to, &to_translation, &to_yaw);
+    if(!wrapped) {
+        *translation = rotate_y(v3_sub(to_translation, from_translation), -from_yaw);
+        *yaw = to_yaw - from_yaw;
+        return;
+    }
+    V3 end_translation, start_translation;
+    f32 end_yaw, start_yaw;
+    sample_root_motion(animation, animation->duration, &end_translation, &end_yaw);
+    sample_root_motion(animation, 0, &start_translation, &start_yaw);
+    V3 first = rotate_y(v3_sub(end_translation, from_translation), -from_yaw);
+    V3 second = rotate_y(v3_sub(to_translation, start_translation), -start_yaw);
+    f32 first_yaw = end_yaw - from_yaw;
+    *translation = v3_add(first, rotate_y(second, first_yaw));
+    *yaw = first_yaw + (to_yaw - start_yaw);
+}
+
+// NOTE: the deltas are blended like the poses, mixed in the order of the states or averaged by weight
+// with POSE_BLEND_MODE_ACCUMULATE. The mask weight of the root motion joint scales the weight of a state.
+// With a blend tree the weights of the clips in the tree at the root motion joint are averaged instead
+void AnimationSet::update_root_motion(void) {
+
+    root_motion_translation = v3(0, 0, 0);
+    root_motion_yaw = 0;
+    f32 total_weight = 0;
+    u32 tree_weights_joint = ANIMATION_INVALID_HANDLE;
+
     for(u32 state_index = 0; state_index < num_states; ++state_index) {
         AnimationState *state = states + state_index;
-        if(strcmp(state->animation->name, name) == 0) {
-            return state;
+        AnimationClip *animation = state->animation;
+        f32 from = state->root_motion_time;
+        state->root_motion_time = state->time;
+        if(!state->enable || animation->num_root_motion_keys == 0 || (animation->flags & ANIMATION_CLIP_ADDITIVE)) continue;
+        if(!blend_tree && blend_mode == POSE_BLEND_MODE_ACCUMULATE && state->layer) continue;
+
+        f32 weight;
+        if(blend_tree) {
+            // NOTE: the clips usually share the root motion joint, the tree is walked once per joint
+            if(animation->root_motion_joint != tree_weights_joint) {
+                tree_weights_joint = animation->root_motion_joint;
+                blend_tree->calculate_state_weights(tree_weights_joint, root_motion_weights);
+            }
+            weight = root_motion_weights[state_index];
+        } else {
+            weight = state->weight*state->joint_weights[animation->root_motion_joint];
+        }
+        if(weight <= 0) continue;
+
+        V3 translation;
+        f32 yaw;
+        root_motion_delta(animation, from, state->time, state->time < from, &translation, &yaw);
+        if(blend_tree || blend_mode == POSE_BLEND_MODE_ACCUMULATE) {
+            root_motion_translation = v3_add(root_motion_translation, v3_scale(translation, weight));
+            root_motion_yaw += yaw*weight;
+            total_weight += weight;
+        } else {
+            weight = MIN(weight, 1.0f);
+            root_motion_translation = v3_lerp(root_motion_translation, translation, weight);
+            root_motion_yaw = lerp(root_motion_yaw, yaw, weight);
+        }
+    }
+
+    if(total_weight > 0) {
+        root_motion_translation = v3_scale(root_motion_translation, 1.0f / total_weight);
+        root_motion_yaw /= total_weight;
+    }
+}
+
+/* -------------------------------------------- */
+/*        Inertialization                       */
+/* -------------------------------------------- */
+
+static InertialCurve inertial_curve(f32 x0, f32 v0, f32 duration) {
+    InertialCurve curve = {};
+    curve.x0 = x0;
+    if(x0 <= 0 || duration <= 0) {
+        return curve;
+    }
+    // NOTE: a velocity away from the target would overshoot, and a fast velocity towards it shortens the decay
+    v0 = MIN(v0, 0.0f);
+    if(v0 < 0) {
+        duration = MIN(duration, -5*x0/v0);
+    }
+    f32 t2 = duration*duration;
+    f32 a0 = MAX((-8*v0*duration - 20*x0) / t2, 0.0f);
+    curve.v0 = v0;
+    curve.a0 = a0;
+    curve.a = -(a0*t2 + 6*v0*duration + 12*x0) / (2*t2*t2*duration);
+    curve.b = (3*a0*t2 + 16*v0*duration + 30*x0) / (2*t2*t2);
+    curve.c = -(3*a0*t2 + 12*v0*duration + 20*x0) / (2*t2*duration);
+    curve.duration = duration;
+    return curve;
+}
+
+static f32 inertial_curve_evaluate(InertialCurve *curve, f32 t) {
+    if(t >= curve->duration) return 0;
+    return (((((curve->a*t + curve->b)*t + curve->c)*t + curve->a0*0.5f)*t + curve->v0)*t) + curve->x0;
+}
+
+// NOTE: axis and angle of the rotation in the shortest way, the axis is x when there is no rotation
+static f32 q4_axis_angle(Q4 q, V3 *axis) {
+    if(q.w < 0) {
+        q = q4(-q.w, -q.x, -q.y, -q.z);
+    }
+    f32 length = sqrtf(q.x*q.x + q.y*q.y + q.z*q.z);
+    if(length <= 1e-8f) {
+        *axis = v3(1, 0, 0);
+        return 0;
+    }
+    *axis = v3(q.x/length, q.y/length, q.z/length);
+    return 2*atan2f(length, q.w);
+}
+
+static Q4 q4_from_axis_angle(V3 axis, f32 angle) {
+    f32 s = sinf(angle*0.5f);
+    return q4(cosf(angle*0.5f), axis.x*s, axis.y*s, axis.z*s);
+}
+
+// NOTE: the offset of a vector component, its length decays along its direction
+static InertialCurve vector_inertial_curve(V3 source, V3 previous, V3 target, f32 dt, f32 duration, V3 *direction) {
+    V3 offset = v3_sub(source, target);
+    f32 x0 = v3_length(offset);
+    *direction = x0 > 0 ? v3_scale(offset, 1.0f/x0) : v3(0, 0, 0);
+    f32 v0 = dt > 0 ? v3_dot(v3_sub(source, previous), *direction) / dt : 0;
+    return inertial_curve(x0, v0, duration);
+}
+
+// NOTE: the offsets are computed once, from the last two poses of the previous states and the first pose of
+// the new state. Every update after it adds the decayed offsets to the pose of the new state, so only
+// the new state is sampled during the transition
+void AnimationSet::apply_inertialization(f32 dt) {
+
+    if(inertialization_pending) {
+        f32 velocity_dt = num_pose_history > 1 ? last_dt : 0;
+        for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+            JointPose *source = last_local_pose + joint_index;
+            JointPose *previous = previous_local_pose + joint_index;
+            JointPose *target = final_local_pose + joint_index;
+            InertialOffset *offset = inertial_offsets + joint_index;
+
+            offset->position = vector_inertial_curve(source->position, previous->position, target->position, velocity_dt, inertialization_duration, &offset->position_direction);
+            offset->scale = vector_inertial_curve(source->scale, previous->scale, target->scale, velocity_dt, inertialization_duration, &offset->scale_direction);
+
+            f32 angle = q4_axis_angle(q4_mul(source->rotation, q4_conjugate(target->rotation)), &offset->rotation_axis);
+            f32 angular_velocity = 0;
+            if(velocity_dt > 0) {
+                V3 velocity_axis;
+                f32 velocity_angle = q4_axis_angle(q4_mul(source->rotation, q4_conjugate(previous->rotation)), &velocity_axis);
+                angular_velocity = v3_dot(velocity_axis, offset->rotation_axis)*velocity_angle / velocity_dt;
+            }
+            offset->rotation = inertial_curve(angle, angular_velocity, inertialization_duration);
+        }
+        inertialization_pending = false;
+        inertialization_active = true;
+        inertialization_time = dt;
+    } else if(inertialization_active) {
+        inertialization_time += dt;
+    }
+
+    if(inertialization_active) {
+        if(inertialization_time >= inertialization_duration) {
+            inertialization_active = false;
+        } else {
+            for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+                JointPose *pose = final_local_pose + joint_index;
+                InertialOffset *offset = inertial_offsets + joint_index;
+                f32 position = inertial_curve_evaluate(&offset->position, inertialization_time);
+                f32 rotation = inertial_curve_evaluate(&offset->rotation, inertialization_time);
+                f32 scale = inertial_curve_evaluate(&offset->scale, inertialization_time);
+                pose->position = v3_add(pose->position, v3_scale(offset->position_direction, position));
+                pose->rotation = q4_normalize(q4_mul(q4_from_axis_angle(offset->rotation_axis, rotation), pose->rotation));
+                pose->scale = v3_add(pose->scale, v3_scale(offset->scale_direction, scale));
+            }
+        }
+    }
+
+    // NOTE: keep the last two poses, swap the arrays instead of copying both
+    JointPose *oldest_pose = previous_local_pose;
+    previous_local_pose = last_local_pose;
+    last_local_pose = oldest_pose;
+    memcpy(last_local_pose, final_local_pose, sizeof(JointPose)*skeleton->num_joints);
+    last_dt = dt;
+    num_pose_history = MIN(num_pose_history + 1, 2u);
+}
+
+// NOTE: walk the states from the last one blended to the first one. A state contributes if it has
+// weight on a joint that no later state overrides, with POSE_BLEND_MODE_MIX a joint is overridden
+// by a state that blends it with weight 1. The accumulate mode only skips the states without weight.
+// The additive states are applied after all the others, they never override a joint and are only
+// skipped when they have no weight
+void AnimationSet::find_contributing_states(void) {
+    
+    memset(joint_overridden, 0, sizeof(bool)*skeleton->num_joints);
+
+    for(s32 state_index = (s32)num_states - 1; state_index >= 0; --state_index) {
+        AnimationState *state = states + state_index;
+        state->contributes = false;
+        if(!state->enable) continue;
+        
+        for(u32 run_index = 0; run_index < state->num_mask_runs; ++run_index) {
+            JointMaskRun *run = state->mask_runs + run_index;
+            f32 weight = state->weight*run->weight;
+            if(weight <= 0) continue;
+            if(state->animation->flags & ANIMATION_CLIP_ADDITIVE) {
+                state->contributes = true;
+                break;
+            }
+            u32 end_joint = run->first_joint + run->num_joints;
+            for(u32 joint_index = run->first_joint; joint_index < end_joint; ++joint_index) {
+                if(!joint_overridden[joint_index]) {
+                    state->contributes = true;
+                }
+                if(blend_mode == POSE_BLEND_MODE_MIX && weight >= 1) {
+                    joint_overridden[joint_index] = true;
+                }
+            }
         }
     }
-    return nullptr;
+}
+
+// NOTE: only the joints from the first to the last run of the mask are sampled
+static void sample_mask_range(AnimationState *state, JointPose *pose, RotationInterpolation interpolation) {
+    if(state->num_mask_runs == 0) return;
+    JointMaskRun *last_run = state->mask_runs + state->num_mask_runs - 1;
+    state->sample_animation_pose(pose, interpolation, state->mask_runs[0].first_joint, last_run->first_joint + last_run->num_joints);
+}
+
+void AnimationSet::blend_animation_state(AnimationState *state, PoseBlendMode mode) {
+
+    sample_mask_range(state, intermidiate_local_pose, rotation_interpolation);
+
+    // NOTE: the mask runs are contiguous ranges of joints with the same weight
+    for(u32 run_index = 0; run_index < state->num_mask_runs; ++run_index) {
+        JointMaskRun *run = state->mask_runs + run_index;
+        u32 first_joint = run->first_joint;
+        if(mode == POSE_BLEND_MODE_ACCUMULATE) {
+            pose_accumulate(final_local_pose + first_joint, final_joint_weights + first_joint, intermidiate_local_pose + first_joint, skeleton->bind_local_poses + first_joint, state->weight*run->weight, run->num_joints);
+            continue;
+        }
+        // NOTE: clamped, a weight above 1 would extrapolate the pose while find_contributing_states skips the
+        // states under it as overridden
+        f32 weight = CLAMP(state->weight*run->weight, 0.0f, 1.0f);
+        pose_mix(final_local_pose + first_joint, final_local_pose + first_joint, intermidiate_local_pose + first_joint, weight, run->num_joints, rotation_interpolation);
+    }
+}
+
+void AnimationSet::add_animation_state(AnimationState *state) {
+
+    sample_mask_range(state, intermidiate_local_pose, rotation_interpolation);
+
+    for(u32 run_index = 0; run_index < state->num_mask_runs; ++run_index) {
+        JointMaskRun *run = state->mask_runs + run_index;
+        u32 first_joint = run->first_joint;
+        pose_add(final_local_pose + first_joint, final_local_pose + first_joint, intermidiate_local_pose + first_joint, state->weight*run->weight, run->num_joints);
+    }
 }
 
 void AnimationSet::zero_final_local_pose(void) {
@@ -263,5 +1664,6 @@ void AnimationSet::zero_final_local_pose(void) {
         local_pose->position = v3(0, 0, 0);
         local_pose->rotation = q4(0, 0, 0, 0);
         local_pose->scale = v3(0, 0, 0);
+        final_joint_weights[joint_index] = 0;
     }
 }
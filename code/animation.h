@@ -8,6 +8,16 @@
 #define MAX_FINAL_BONE_MATRICES 100
 #define MAX_BONES_INFLUENCE 4
 
+// NOTE: AnimationClip flags, written by the exporter for each animation
+#define ANIMATION_CLIP_UNIFORM (1 << 0)
+// NOTE: positions and rotations are sampled with Catmull-Rom curves instead of lerp/slerp, the clips
+// exported with a lower key rate use it. Scales stay linear
+#define ANIMATION_CLIP_CUBIC   (1 << 1)
+// NOTE: the poses are deltas from a reference pose baked by the exporter (position offset, local rotation
+// and scale ratio), the joints without track are the identity. The states of additive clips are applied
+// on top of the blended pose of the other states, see pose_add
+#define ANIMATION_CLIP_ADDITIVE (1 << 2)
+
 typedef struct Vertex {
     V3 pos;
     V2 uv;
@@ -18,6 +28,43 @@ typedef struct Vertex {
 
 } Vertex;
 
+// NOTE: open addressing hash table from names to indices, the names are not copied and must live as
+// long as the table. Built once at load time, the lookups do one strcmp in the common case
+struct NameTableEntry {
+    const char *name;
+    u32 hash;
+    u32 index;
+};
+
+struct NameTable {
+    NameTableEntry *entries;
+    u32 capacity;
+
+    void initialize(u32 num_names);
+    void terminate(void);
+    void insert(const char *name, u32 index);
+    bool find(const char *name, u32 *index);
+};
+
+// NOTE: resolved once from the names, the handles are indices into the states and the joints.
+// A name that is not found gives ANIMATION_INVALID_HANDLE, the functions that take a handle ignore it
+#define ANIMATION_INVALID_HANDLE 0xFFFFFFFF
+
+struct AnimationHandle {
+    u32 index;
+};
+
+struct JointHandle {
+    u32 index;
+};
+
+// NOTE: the size of all JointPose array is the number of joints of the parent skeleton
+struct JointPose {
+    V3 position;
+    Q4 rotation;
+    V3 scale;
+};
+
 struct Joint {
     char name[MAX_NAME_SIZE];
     s32 parent;
@@ -30,8 +77,17 @@ struct Skeleton {
     Joint *joints;
     u32 num_joints;
 
+    // NOTE: local_transform of every joint decomposed, used for the joints a clip does not animate
+    JointPose *bind_local_poses;
+
+    NameTable joint_names;
+
+    void initialize_bind_local_poses(void);
+    void initialize_joint_names(void);
     s32 get_joint_index(const char *name);
     bool joint_is_in_hierarchy(s32 index, s32 parent_index);
+    // NOTE: the joints are sorted depth first, the hierarchy of a joint is the range [index, end)
+    u32 get_hierarchy_end(s32 index);
 };
 
 typedef struct Mesh {
@@ -58,13 +114,25 @@ typedef struct Model {
 
     Skeleton *skeleton;
 
+    // NOTE: joint of every skinning palette slot, the bone ids of the vertices are slots. nullptr for
+    // the files without palette, the bone ids are joint indices then
+    u32 *palette_joints;
+    u32 num_palette_joints;
+
 } Model;
 
-// NOTE: the size of all JointPose array is the number of joints of the parent skeleton
-struct JointPose {
-    V3 position;
-    Q4 rotation;
-    V3 scale;
+enum RotationInterpolation {
+    ROTATION_INTERPOLATION_SLERP,
+    // NOTE: cheaper normalized lerp, see q4_onlerp in algebra.h for the error bounds
+    ROTATION_INTERPOLATION_ONLERP,
+};
+
+enum PoseBlendMode {
+    // NOTE: every state is mixed into the result of the previous states with its weight (order dependent)
+    POSE_BLEND_MODE_MIX,
+    // NOTE: weighted sum of all the states, the quaternions are aligned with the bind pose and
+    // everything is normalized once per joint at the end (order independent)
+    POSE_BLEND_MODE_ACCUMULATE,
 };
 
 struct SkeletonPose {
@@ -77,13 +145,120 @@ struct AnimationSample {
     JointPose *local_poses;
 };
 
+// NOTE: ANIMATION_CLIP_LAYOUT_AOS is the default for dense clips, one sample of a pose reads two
+// contiguous arrays. The track major layouts read every stream on its own lines, about 4x the lines
+// of AOS for a full pose (see benchmark layouts), they are opt-in
+enum AnimationClipLayout {
+    // NOTE: one JointPose array per sample (key major)
+    ANIMATION_CLIP_LAYOUT_AOS,
+    // NOTE: one contiguous stream per joint and per component (track major), the lanes of the SIMD
+    // kernels are loaded from the streams without a transpose
+    ANIMATION_CLIP_LAYOUT_SOA,
+    // NOTE: track major, every stream has its own keys (clips exported with key reduction)
+    ANIMATION_CLIP_LAYOUT_SPARSE,
+    // NOTE: fixed size time segments, each one track major and contiguous in memory (long clips)
+    ANIMATION_CLIP_LAYOUT_SEGMENTED,
+};
+
+// NOTE: ANIMATION_CLIP_LAYOUT_SOA streams have num_samples keys and use the time stamps of the clip,
+// ANIMATION_CLIP_LAYOUT_SPARSE streams have their own keys. All the streams of a clip live in the same allocation
+struct AnimationTrack {
+    Q4 *rotations;
+    V3 *positions;
+    V3 *scales;
+
+    u32 num_rotation_keys;
+    u32 num_position_keys;
+    u32 num_scale_keys;
+    f32 *rotation_times;
+    f32 *position_times;
+    f32 *scale_times;
+};
+
+#define ANIMATION_SEGMENT_SAMPLES 16
+
+// NOTE: a segment covers ANIMATION_SEGMENT_SAMPLES intervals of the clip, the last sample of a segment is
+// repeated as the first sample of the next one, so any time is sampled from a single segment.
+// In memory the header is followed by the time stamps and then, for every joint, the rotations,
+// positions and scales of the segment. Every stream also keeps the sample before and after the
+// segment for the cubic curves. All the segments of a clip have the same size
+struct AnimationSegment {
+    f32 start_time;
+    f32 end_time;
+    u32 first_sample;
+    u32 num_samples;
+};
+
+// NOTE: cursors of the three streams of a track, for ANIMATION_CLIP_LAYOUT_SPARSE clips
+struct TrackCursor {
+    u32 rotation;
+    u32 position;
+    u32 scale;
+};
+
+// NOTE: horizontal translation and yaw of the root motion joint relative to the first key, in the space
+// of the parent of the joint. The yaw is unwrapped so it can go past pi
+struct RootMotionKey {
+    f32 time;
+    V3 translation;
+    f32 yaw;
+};
+
 struct AnimationClip {
     Skeleton *skeleton;
     
     char name[MAX_NAME_SIZE];
     f32 duration;
-    AnimationSample *samples;
     u32 num_samples;
+    
+    // NOTE: the time stamps of the samples are shared by the AOS and SOA layouts
+    f32 *time_stamps;
+
+    AnimationClipLayout layout;
+    // NOTE: ANIMATION_CLIP_LAYOUT_AOS
+    AnimationSample *samples;
+    // NOTE: ANIMATION_CLIP_LAYOUT_SOA and SPARSE, the size of the array is the number of joints
+    AnimationTrack *tracks;
+
+    // NOTE: ANIMATION_CLIP_LAYOUT_SEGMENTED, segment_times has the start time of every segment
+    // and the end time of the last one, it is the only data touched to find a segment
+    u8 *segments;
+    u32 num_segments;
+    u32 segment_size;
+    u32 segment_capacity;
+    f32 *segment_times;
+
+    u32 flags;
+    // NOTE: only valid for ANIMATION_CLIP_UNIFORM clips, maps time to sample index directly
+    f32 inv_sample_delta;
+
+    // NOTE: sorted times of the foot contacts found by the exporter, the sync groups align them. Clips
+    // without markers are synchronized by their normalized time
+    f32 *sync_markers;
+    u32 num_sync_markers;
+
+    // NOTE: written by the exporter when the motion of root_motion_joint is extracted, the joint keeps
+    // only its vertical translation and the rotation without the yaw
+    RootMotionKey *root_motion_keys;
+    u32 num_root_motion_keys;
+    u32 root_motion_joint;
+
+    // NOTE: convert ANIMATION_CLIP_LAYOUT_SOA tracks into segments of samples_per_segment intervals
+    void build_segments(u32 samples_per_segment);
+    AnimationSegment *get_segment(u32 index);
+    f32 *get_segment_time_stamps(AnimationSegment *segment);
+    Q4 *get_segment_rotations(AnimationSegment *segment, u32 joint_index);
+    V3 *get_segment_positions(AnimationSegment *segment, u32 joint_index);
+    V3 *get_segment_scales(AnimationSegment *segment, u32 joint_index);
+    // NOTE: every key of every stream is the same, the pose does not depend on the time
+    bool is_constant(void);
+};
+
+// NOTE: contiguous joints with the same mask weight, a state is blended with one pose_mix per run
+struct JointMaskRun {
+    u32 first_joint;
+    u32 num_joints;
+    f32 weight;
 };
 
 struct AnimationState {
@@ -97,16 +272,110 @@ struct AnimationState {
     bool enable;
     bool loop;
     bool smooth;
+    // NOTE: POSE_BLEND_MODE_ACCUMULATE only, the state is mixed over the normalized pose of the other
+    // states on the joints of its mask (an upper body layer), see AnimationSet::set_layer
+    bool layer;
+    // NOTE: false when the state has no weight or later states override all its joints, the clock of
+    // the state still advances but the clip is not sampled
+    bool contributes;
 
     s32 root;
 
-    void sample_animation_pose(JointPose *pose);
+    // NOTE: ANIMATION_SYNC_GROUP_NONE or the group that drives the time of the state
+    u32 sync_group;
+    // NOTE: time of the state at the last root motion update
+    f32 root_motion_time;
+    // NOTE: AnimationClip::is_constant, the clock of the state does not change the pose
+    bool constant;
+    // NOTE: the inputs of the state when the pose was last sampled, the joints of the mask changed when
+    // one of them is different
+    f32 sampled_time;
+    f32 sampled_weight;
+    bool sampled_enable;
+
+    // NOTE: per joint mask weight, multiplied by the state weight. The runs are rebuilt when the mask
+    // changes, the joints with weight 0 are not in any run
+    f32 *joint_weights;
+    JointMaskRun *mask_runs;
+    u32 num_mask_runs;
+
+    // NOTE: index of the last prev sample found, the next lookup starts from here.
+    // For ANIMATION_CLIP_LAYOUT_SEGMENTED clips it is the index of the last segment used
+    u32 cursor;
+    // NOTE: one per joint, only used by ANIMATION_CLIP_LAYOUT_SPARSE clips
+    TrackCursor *track_cursors;
+
+    void sample_animation_pose(JointPose *pose, RotationInterpolation interpolation);
+    // NOTE: only the joints [begin_joint, end_joint) of pose are written, a masked state reads only the
+    // keys of the joints of its mask
+    void sample_animation_pose(JointPose *pose, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint);
+    void reset_cursors(void);
+    void build_mask_runs(void);
 
 private:
 
-    void sample_prev_and_next_animation_pose(AnimationSample *prev, AnimationSample *next, f32 time);
-    void mix_samples(JointPose *dst, JointPose *a, JointPose *b, f32 t);
+    u32 find_prev_sample_index(f32 time);
+    void mix_samples(JointPose *dst, JointPose *a, JointPose *b, f32 t, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint);
+    void mix_tracks(JointPose *dst, u32 a, u32 b, f32 t, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint);
+    void mix_samples_cubic(JointPose *dst, u32 a, u32 b, f32 t, u32 begin_joint, u32 end_joint);
+    void mix_tracks_cubic(JointPose *dst, u32 a, u32 b, f32 t, u32 begin_joint, u32 end_joint);
+    void sample_sparse_tracks(JointPose *dst, f32 time, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint);
+    void sample_segment(JointPose *dst, f32 time, RotationInterpolation interpolation, u32 begin_joint, u32 end_joint);
+
+};
+
+// NOTE: quintic decay of one offset from x0 to 0 in duration, with the initial velocity v0 and
+// zero velocity and acceleration at the end (Bollo, Inertialization, GDC 2018)
+struct InertialCurve {
+    f32 x0;
+    f32 v0;
+    f32 a0;
+    f32 a;
+    f32 b;
+    f32 c;
+    f32 duration;
+};
+
+// NOTE: offset between the pose before an inertialized transition and the target clip for one joint,
+// every component decays along a fixed direction (the rotation around a fixed axis)
+struct InertialOffset {
+    V3 position_direction;
+    V3 rotation_axis;
+    V3 scale_direction;
+    InertialCurve position;
+    InertialCurve rotation;
+    InertialCurve scale;
+};
+
+struct BlendTree;
+
+enum SkinningMode {
+    // NOTE: final_transform_matrices, one M4 per joint
+    SKINNING_MODE_LINEAR,
+    // NOTE: final_dual_quaternions, one DQ per joint (8 floats). The scale of the joints is ignored
+    SKINNING_MODE_DUAL_QUATERNION,
+};
+
+#define ANIMATION_MAX_SYNC_GROUPS 8
+#define ANIMATION_SYNC_GROUP_NONE 0xFFFFFFFF
+
+// NOTE: the members of a group share one normalized phase instead of their own clocks. The phase
+// advances with the duration of the members averaged by weight, so clips of different lengths stay
+// aligned while they blend. The members always loop with the phase
+struct AnimationSyncGroup {
+    f32 phase;
+    f32 duration;
+};
 
+// NOTE: the per frame counters are reset by every AnimationSet::update
+struct AnimationStats {
+    u32 sampled_states;
+    u32 skipped_states;
+    u64 total_sampled_states;
+    u64 total_skipped_states;
+    // NOTE: joints whose model transform was recomputed by the last transform update
+    u32 updated_joints;
+    u64 total_updated_joints;
 };
 
 struct AnimationSet {
@@ -114,33 +383,157 @@ struct AnimationSet {
     Skeleton *skeleton;
     AnimationState *states;
     u32 num_states;
+    // NOTE: the palettes are indexed by skinning palette slot, not by joint
     M4 *final_transform_matrices;
+    // NOTE: only updated with SKINNING_MODE_DUAL_QUATERNION, final_transform_matrices is not updated then
+    DQ *final_dual_quaternions;
+    SkinningMode skinning_mode;
+
+    // NOTE: joint of every palette slot, every joint in order until set_skinning_palette is called
+    u32 *palette_joints;
+    u32 num_palette_joints;
+
+    // NOTE: used for sampling the clips and for blending the states
+    RotationInterpolation rotation_interpolation;
+    PoseBlendMode blend_mode;
+
+    AnimationStats stats;
+    NameTable state_names;
+
+    // NOTE: when set, the tree computes the final pose instead of the list of states, the states still
+    // own the clocks of the clips
+    BlendTree *blend_tree;
+
+    AnimationSyncGroup sync_groups[ANIMATION_MAX_SYNC_GROUPS];
+
+    // NOTE: motion of the last update blended with the weights of the states, the translation is in the
+    // space of the character at the start of the update (rotate it by the yaw of the character)
+    V3 root_motion_translation;
+    f32 root_motion_yaw;
+    // NOTE: weights of the states in the result of the blend tree
+    f32 *root_motion_weights;
 
     void initialize(AnimationClip *animations, u32 num_animations);
     void terminate(void);
     
+    AnimationHandle get_animation(const char *name);
+    JointHandle get_joint(const char *joint);
+
+    void play(AnimationHandle handle, f32 weight, bool loop);
+    void play_smooth(AnimationHandle handle, f32 transition_time);
+    // NOTE: stop the other states whose masks overlap the mask of the state (except the additive ones) and
+    // play it alone on those joints, the difference with the last pose decays on top of it in blend_time.
+    // The states of other joints (an upper body layer) keep playing
+    void play_inertialized(AnimationHandle handle, f32 blend_time, bool loop);
+    void stop(AnimationHandle handle);
+    void update_weight(AnimationHandle handle, f32 weight);
+    bool animation_finish(AnimationHandle handle);
+    void set_root_joint(AnimationHandle handle, JointHandle joint);
+    // NOTE: scale the mask of a single joint, after set_root_joint. Used for falloffs like spine blends
+    void set_joint_weight(AnimationHandle handle, JointHandle joint, f32 weight);
+    // NOTE: group in [0, ANIMATION_MAX_SYNC_GROUPS) or ANIMATION_SYNC_GROUP_NONE to use the clock of the state
+    void set_sync_group(AnimationHandle handle, u32 group);
+    // NOTE: POSE_BLEND_MODE_ACCUMULATE, the layers are mixed with their weight over the normalized pose of
+    // the other states, in the order of the states, so an upper body layer overrides the joints of its
+    // mask. The layers do not move the root motion
+    void set_layer(AnimationHandle handle, bool layer);
+
+    // NOTE: same as the handle API, the names are resolved on every call
     void play(const char *name, f32 weight, bool loop);
     void play_smooth(const char *name, f32 transition_time);
+    void play_inertialized(const char *name, f32 blend_time, bool loop);
     void stop(const char *name);
     void update_weight(const char *name, f32 weight);
-
     bool animation_finish(const char *name);
+    void set_root_joint(const char *name, const char *joint);
+    void set_joint_weight(const char *name, const char *joint, f32 weight);
+    void set_sync_group(const char *name, u32 group);
+    void set_layer(const char *name, bool layer);
 
     void update(f32 dt);
-    
-    void set_root_joint(const char *name, const char *joint);
+
+    void set_rotation_interpolation(RotationInterpolation interpolation);
+    void set_blend_mode(PoseBlendMode mode);
+    void set_blend_tree(BlendTree *tree);
+    void set_skinning_mode(SkinningMode mode);
+    // NOTE: only the slots of the palette are computed, and only the hierarchy of the joints of the
+    // palette. The joints are copied
+    void set_skinning_palette(u32 *joints, u32 num_joints);
+
+    // NOTE: override the local pose of a joint after update (IK corrections, procedural joints), then
+    // call update_transforms once to recompute the hierarchies of the joints that changed
+    JointPose get_local_pose(JointHandle joint);
+    void set_local_pose(JointHandle joint, JointPose pose);
+    void update_transforms(void);
+
+    // NOTE: CPU skinning of the vertex positions with the palette of the current skinning mode, the same
+    // result as the vertex shader of the mode. The vertices without weights keep their position
+    void skin_vertices(V3 *positions, Vertex *vertices, u32 num_vertices);
 
 private:
     
-    void update_animation_state(AnimationState *state, f32 dt);
+    AnimationState *get_state(AnimationHandle handle);
+    bool is_valid_joint(JointHandle joint);
+    void advance_animation_state(AnimationState *state, f32 dt);
+    void advance_sync_groups(f32 dt);
+    void update_root_motion(void);
+    void apply_inertialization(f32 dt);
+    f32 get_sync_time(AnimationState *state, f32 phase);
+    void find_contributing_states(void);
+    void blend_animation_state(AnimationState *state, PoseBlendMode mode);
+    void add_animation_state(AnimationState *state);
     void zero_final_local_pose(void);
     void calculate_final_transform_matrices(void);
-    
-    AnimationState *find_animation_by_name(const char *name);
+    bool mark_dirty_joints(void);
 
     // NOTE: This must be skeleton poses
     JointPose *intermidiate_local_pose;
     JointPose *final_local_pose;
+    // NOTE: sum of the weights of every joint, only for POSE_BLEND_MODE_ACCUMULATE
+    f32 *final_joint_weights;
+    // NOTE: scratch for find_contributing_states
+    bool *joint_overridden;
+
+    // NOTE: model space transform and inverse bind transform of every joint, the hierarchy and bind passes
+    // multiply them with transforms_m4_mul_n
+    M4 *model_transforms;
+    M4 *inv_bind_transforms;
+    // NOTE: a joint is recomputed only when its local pose changed or it is in the hierarchy of one that
+    // changed. Invalid until the first update and after the skinning mode or the palette changes
+    bool transforms_valid;
+    // NOTE: the local poses changed since the last transform update, marked where they change: the masks
+    // of the states whose inputs changed, the edited mask weights and set_local_pose
+    bool *joint_pose_dirty;
+    // NOTE: false until the first update and after the blend settings change, every joint is dirty then
+    bool pose_valid;
+    // NOTE: a mask or a local pose was edited, the next update samples the states again even if none of
+    // them changed. The joints set with set_local_pose are dirty again after that update
+    bool pose_edited;
+    bool *joint_pose_overridden;
+    // NOTE: end of the hierarchy of every joint (Skeleton::get_hierarchy_end) and scratch for the bind pass
+    u32 *joint_hierarchy_ends;
+    // NOTE: the parents of Skeleton::joints packed together, the hierarchy pass reads one per joint
+    s32 *joint_parents;
+    bool *joint_dirty;
+    // NOTE: the joints of the palette and their ancestors, the other joints are not computed
+    bool *joint_required;
+    // NOTE: the dirty joints, their rotations and their local transforms in the hierarchy pass, the
+    // products of a run of palette slots before the conversion to dual quaternions in the bind pass
+    Q4 *batch_rotations;
+    M4 *batch_matrices;
+    u32 *batch_indices;
+
+    // NOTE: the final poses of the last two updates, the source of an inertialized transition
+    JointPose *last_local_pose;
+    JointPose *previous_local_pose;
+    f32 last_dt;
+    u32 num_pose_history;
+
+    InertialOffset *inertial_offsets;
+    bool inertialization_pending;
+    bool inertialization_active;
+    f32 inertialization_time;
+    f32 inertialization_duration;
 
 };
 
@@ -0,0 +1,900 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "algebra.h"
+#include "animation.h"
+#include "pose_kernels.h"
+
+// NOTE: benchmarks and accuracy checks of the runtime on synthetic clips, build with build.sh and run
+// ./build/benchmark [name]. Without a name every benchmark runs. The exit code is not zero when an
+// accuracy check fails
+
+/* -------------------------------------------- */
+/*        Timer and counters                    */
+/* -------------------------------------------- */
+
+static f64 get_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (f64)ts.tv_sec + (f64)ts.tv_nsec*1e-9;
+}
+
+// NOTE: hardware counters of this process with perf_event_open, fd is -1 when the kernel or the
+// virtual machine does not expose them
+struct CacheCounters {
+    s32 l1d_fd;
+    s32 llc_fd;
+};
+
+#if defined(__linux__)
+static s32 open_counter(u32 type, u64 config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (s32)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void cache_counters_start(CacheCounters *counters) {
+    counters->l1d_fd = -1;
+    counters->llc_fd = -1;
+#if defined(__linux__)
+    counters->l1d_fd = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counters->llc_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    s32 fds[2] = {counters->l1d_fd, counters->llc_fd};
+    for(u32 i = 0; i < 2; ++i) {
+        if(fds[i] < 0) continue;
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+// NOTE: -1 for the counters that are not available
+static void cache_counters_stop(CacheCounters *counters, s64 *l1d_misses, s64 *llc_misses) {
+    *l1d_misses = -1;
+    *llc_misses = -1;
+#if defined(__linux__)
+    s32 fds[2] = {counters->l1d_fd, counters->llc_fd};
+    s64 *values[2] = {l1d_misses, llc_misses};
+    for(u32 i = 0; i < 2; ++i) {
+        if(fds[i] < 0) continue;
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        u64 value = 0;
+        if(read(fds[i], &value, sizeof(value)) == sizeof(value)) {
+            *values[i] = (s64)value;
+        }
+        close(fds[i]);
+    }
+#endif
+}
+
+/* -------------------------------------------- */
+/*        Synthetic clips                       */
+/* -------------------------------------------- */
+
+static u32 random_state = 1;
+
+static f32 random_f32(void) {
+    random_state = random_state*1664525u + 1013904223u;
+    return (f32)(random_state >> 8) / (f32)(1 << 24);
+}
+
+static void build_skeleton(Skeleton *skeleton, u32 num_joints) {
+    memset(skeleton, 0, sizeof(Skeleton));
+    skeleton->num_joints = num_joints;
+    skeleton->joints = (Joint *)malloc(sizeof(Joint)*num_joints);
+    for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+        Joint *joint = skeleton->joints + joint_index;
+        sprintf(joint->name, "joint_%d", joint_index);
+        joint->parent = (s32)joint_index - 1;
+        joint->local_transform = m4_translate(v3(0, 1, 0));
+        joint->inv_bind_transform = m4_translate(v3(0, -(f32)joint_index, 0));
+    }
+    skeleton->initialize_bind_local_poses();
+    skeleton->initialize_joint_names();
+}
+
+// NOTE: smooth motion sampled at 30 Hz, every joint rotates around its own axis with its own frequency
+static JointPose synthetic_pose(u32 joint_index, f32 time) {
+    f32 frequency = 0.5f + 0.37f*(f32)(joint_index % 7);
+    f32 angle = 1.2f*sinf(time*frequency + (f32)joint_index);
+    V3 axis = v3_normalize(v3(sinf((f32)joint_index), 1, cosf((f32)joint_index*0.5f)));
+    JointPose pose;
+    pose.position = v3(0.1f*sinf(time + joint_index), 1, 0.1f*cosf(time*1.3f));
+    pose.rotation = q4(cosf(angle*0.5f), axis.x*sinf(angle*0.5f), axis.y*sinf(angle*0.5f), axis.z*sinf(angle*0.5f));
+    pose.scale = v3(1, 1, 1);
+    return pose;
+}
+
+#define SYNTHETIC_KEY_DELTA (1.0f/30.0f)
+
+static void build_clip(AnimationClip *clip, Skeleton *skeleton, u32 num_samples, AnimationClipLayout layout) {
+    memset(clip, 0, sizeof(AnimationClip));
+    clip->skeleton = skeleton;
+    sprintf(clip->name, "clip");
+    clip->num_samples = num_samples;
+    clip->duration = (num_samples - 1)*SYNTHETIC_KEY_DELTA;
+    clip->flags = ANIMATION_CLIP_UNIFORM;
+    clip->inv_sample_delta = 1.0f / SYNTHETIC_KEY_DELTA;
+    clip->time_stamps = (f32 *)malloc(sizeof(f32)*num_samples);
+    for(u32 sample_index = 0; sample_index < num_samples; ++sample_index) {
+        clip->time_stamps[sample_index] = sample_index*SYNTHETIC_KEY_DELTA;
+    }
+
+    u32 num_joints = skeleton->num_joints;
+    if(layout == ANIMATION_CLIP_LAYOUT_AOS) {
+        // NOTE: one allocation per sample, like read_sample in the importer
+        clip->layout = ANIMATION_CLIP_LAYOUT_AOS;
+        clip->samples = (AnimationSample *)malloc(sizeof(AnimationSample)*num_samples);
+        for(u32 sample_index = 0; sample_index < num_samples; ++sample_index) {
+            AnimationSample *sample = clip->samples + sample_index;
+            sample->time_stamp = clip->time_stamps[sample_index];
+            sample->local_poses = (JointPose *)malloc(sizeof(JointPose)*num_joints);
+            for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+                sample->local_poses[joint_index] = synthetic_pose(joint_index, sample->time_stamp);
+            }
+        }
+        return;
+    }
+
+    // NOTE: one block for all the streams, like allocate_animation_tracks in the importer
+    clip->layout = ANIMATION_CLIP_LAYOUT_SOA;
+    // NOTE: the tracks are rounded to 16 bytes and start with the rotations, every Q4 stream is aligned
+    u64 track_size = ((sizeof(Q4) + sizeof(V3) + sizeof(V3))*num_samples + 15) & ~15;
+    u8 *memory = (u8 *)malloc(sizeof(AnimationTrack)*num_joints + track_size*num_joints);
+    clip->tracks = (AnimationTrack *)memory;
+    u8 *streams = memory + sizeof(AnimationTrack)*num_joints;
+    for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+        AnimationTrack *track = clip->tracks + joint_index;
+        memset(track, 0, sizeof(AnimationTrack));
+        track->rotations = (Q4 *)streams;
+        streams += sizeof(Q4)*num_samples;
+        track->positions = (V3 *)streams;
+        streams += sizeof(V3)*num_samples;
+        track->scales = (V3 *)streams;
+        streams += sizeof(V3)*num_samples;
+        for(u32 sample_index = 0; sample_index < num_samples; ++sample_index) {
+            JointPose pose = synthetic_pose(joint_index, clip->time_stamps[sample_index]);
+            track->rotations[sample_index] = pose.rotation;
+            track->positions[sample_index] = pose.position;
+            track->scales[sample_index] = pose.scale;
+        }
+    }
+    if(layout == ANIMATION_CLIP_LAYOUT_SEGMENTED) {
+        clip->build_segments(ANIMATION_SEGMENT_SAMPLES);
+    }
+    if(layout == ANIMATION_CLIP_LAYOUT_SPARSE) {
+        // NOTE: the odd joints keep every other rotation key, so the joints of a pose are between
+        // different keys
+        clip->layout = ANIMATION_CLIP_LAYOUT_SPARSE;
+        u32 num_half_keys = (num_samples + 1) / 2;
+        f32 *half_times = (f32 *)malloc(sizeof(f32)*num_half_keys);
+        for(u32 key_index = 0; key_index < num_half_keys; ++key_index) {
+            half_times[key_index] = clip->time_stamps[key_index*2];
+        }
+        for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+            AnimationTrack *track = clip->tracks + joint_index;
+            track->num_position_keys = num_samples;
+            track->num_scale_keys = num_samples;
+            track->position_times = clip->time_stamps;
+            track->scale_times = clip->time_stamps;
+            if(joint_index & 1) {
+                for(u32 key_index = 0; key_index < num_half_keys; ++key_index) {
+                    track->rotations[key_index] = track->rotations[key_index*2];
+                }
+                track->num_rotation_keys = num_half_keys;
+                track->rotation_times = half_times;
+            } else {
+                track->num_rotation_keys = num_samples;
+                track->rotation_times = clip->time_stamps;
+            }
+        }
+    }
+}
+
+static void initialize_state(AnimationState *state, AnimationClip *clip) {
+    memset(state, 0, sizeof(AnimationState));
+    state->animation = clip;
+    state->enable = true;
+    state->loop = true;
+    state->weight = 1;
+    state->time = random_f32()*clip->duration;
+    state->track_cursors = nullptr;
+    if(clip->layout == ANIMATION_CLIP_LAYOUT_SPARSE) {
+        state->track_cursors = (TrackCursor *)malloc(sizeof(TrackCursor)*clip->skeleton->num_joints);
+    }
+    state->reset_cursors();
+}
+
+/* -------------------------------------------- */
+/*        Clip layouts                          */
+/* -------------------------------------------- */
+
+// NOTE: sorted cache lines, the counter the layouts are compared with when the hardware counters are
+// not available
+#define CACHE_LINE_SIZE 64
+
+struct LineSet {
+    u64 *lines;
+    u32 count;
+    u32 capacity;
+};
+
+static void line_set_add(LineSet *set, void *memory, u64 size) {
+    u64 first = (u64)memory / CACHE_LINE_SIZE;
+    u64 last = ((u64)memory + size - 1) / CACHE_LINE_SIZE;
+    for(u64 line = first; line <= last; ++line) {
+        ASSERT(set->count < set->capacity);
+        set->lines[set->count++] = line;
+    }
+}
+
+static int compare_lines(const void *a, const void *b) {
+    u64 x = *(const u64 *)a;
+    u64 y = *(const u64 *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void line_set_sort(LineSet *set) {
+    qsort(set->lines, set->count, sizeof(u64), compare_lines);
+    u32 unique = 0;
+    for(u32 i = 0; i < set->count; ++i) {
+        if(unique == 0 || set->lines[unique - 1] != set->lines[i]) {
+            set->lines[unique++] = set->lines[i];
+        }
+    }
+    set->count = unique;
+}
+
+// NOTE: lines of a that are not in b, both sorted
+static u32 line_set_difference(LineSet *a, LineSet *b) {
+    u32 count = 0;
+    u32 j = 0;
+    for(u32 i = 0; i < a->count; ++i) {
+        while(j < b->count && b->lines[j] < a->lines[i]) ++j;
+        if(j == b->count || b->lines[j] != a->lines[i]) ++count;
+    }
+    return count;
+}
+
+// NOTE: the memory read by sample_animation_pose for the linear clips of build_clip (uniform, not cubic)
+static void sample_lines(AnimationState *state, LineSet *set, u32 begin_joint, u32 end_joint) {
+    set->count = 0;
+    AnimationClip *clip = state->animation;
+    u32 num_joints = end_joint - begin_joint;
+    u32 prev = MIN((u32)(state->time*clip->inv_sample_delta), clip->num_samples - 2);
+    u32 next = prev + 1;
+
+    if(clip->layout == ANIMATION_CLIP_LAYOUT_AOS) {
+        line_set_add(set, clip->time_stamps + prev, sizeof(f32)*2);
+        line_set_add(set, clip->samples + prev, sizeof(AnimationSample)*2);
+        line_set_add(set, clip->samples[prev].local_poses + begin_joint, sizeof(JointPose)*num_joints);
+        line_set_add(set, clip->samples[next].local_poses + begin_joint, sizeof(JointPose)*num_joints);
+    } else if(clip->layout == ANIMATION_CLIP_LAYOUT_SOA) {
+        line_set_add(set, clip->time_stamps + prev, sizeof(f32)*2);
+        line_set_add(set, clip->tracks + begin_joint, sizeof(AnimationTrack)*num_joints);
+        for(u32 joint_index = begin_joint; joint_index < end_joint; ++joint_index) {
+            AnimationTrack *track = clip->tracks + joint_index;
+            line_set_add(set, track->rotations + prev, sizeof(Q4)*2);
+            line_set_add(set, track->positions + prev, sizeof(V3)*2);
+            line_set_add(set, track->scales + prev, sizeof(V3)*2);
+        }
+    } else {
+        u32 samples_per_segment = clip->segment_capacity - 3;
+        u32 segment_index = MIN(prev / samples_per_segment, clip->num_segments - 1);
+        AnimationSegment *segment = clip->get_segment(segment_index);
+        u32 segment_prev = prev - segment->first_sample;
+        line_set_add(set, segment, sizeof(AnimationSegment));
+        line_set_add(set, clip->get_segment_time_stamps(segment), sizeof(f32)*segment->num_samples);
+        for(u32 joint_index = begin_joint; joint_index < end_joint; ++joint_index) {
+            line_set_add(set, clip->get_segment_rotations(segment, joint_index) + segment_prev, sizeof(Q4)*2);
+            line_set_add(set, clip->get_segment_positions(segment, joint_index) + segment_prev, sizeof(V3)*2);
+            line_set_add(set, clip->get_segment_scales(segment, joint_index) + segment_prev, sizeof(V3)*2);
+        }
+    }
+    line_set_sort(set);
+}
+
+// NOTE: many characters playing their clips forward at 60 Hz, every character samples its state once
+// per frame. The clips together are bigger than the L2 cache, so the layouts differ by the number of
+// cache lines the samples touch and how many of them are still in the cache from the last frame.
+// The masked states sample only the joints of their mask, here the last quarter of the skeleton
+static void benchmark_layouts(void) {
+
+    u32 num_joints = 100;
+    u32 num_samples = 600;
+    u32 num_clips = 16;
+    u32 num_characters = 256;
+    u32 num_frames = 120;
+
+    Skeleton skeleton;
+    build_skeleton(&skeleton, num_joints);
+    JointPose *pose = (JointPose *)malloc(sizeof(JointPose)*num_joints);
+
+    // NOTE: the same scalar interpolation for every layout, only the memory access differs
+    PoseKernelType kernel = pose_kernels_initialize(POSE_KERNEL_SCALAR);
+
+    AnimationClipLayout layouts[3] = {ANIMATION_CLIP_LAYOUT_AOS, ANIMATION_CLIP_LAYOUT_SOA, ANIMATION_CLIP_LAYOUT_SEGMENTED};
+    const char *layout_names[3] = {"aos", "soa", "segmented"};
+    const char *range_names[2] = {"full", "masked"};
+    u32 range_begins[2] = {0, num_joints - num_joints/4};
+
+    printf("layouts: %d characters, %d clips of %d joints and %d samples, %d frames, masked samples joints %d to %d\n",
+           num_characters, num_clips, num_joints, num_samples, num_frames, range_begins[1], num_joints - 1);
+    for(u32 layout_index = 0; layout_index < 3; ++layout_index) {
+        AnimationClip *clips = (AnimationClip *)malloc(sizeof(AnimationClip)*num_clips);
+        for(u32 clip_index = 0; clip_index < num_clips; ++clip_index) {
+            build_clip(clips + clip_index, &skeleton, num_samples, layouts[layout_index]);
+        }
+        AnimationState *states = (AnimationState *)malloc(sizeof(AnimationState)*num_characters);
+
+        for(u32 range_index = 0; range_index < 2; ++range_index) {
+            u32 begin_joint = range_begins[range_index];
+            random_state = 1;
+            for(u32 character = 0; character < num_characters; ++character) {
+                initialize_state(states + character, clips + (character % num_clips));
+            }
+
+            CacheCounters counters;
+            cache_counters_start(&counters);
+            f64 start = get_seconds();
+            for(u32 frame = 0; frame < num_frames; ++frame) {
+                for(u32 character = 0; character < num_characters; ++character) {
+                    AnimationState *state = states + character;
+                    state->time += 1.0f/60.0f;
+                    if(state->time > state->animation->duration) {
+                        state->time -= state->animation->duration;
+                    }
+                    state->sample_animation_pose(pose, ROTATION_INTERPOLATION_SLERP, begin_joint, num_joints);
+                }
+            }
+            f64 seconds = get_seconds() - start;
+            s64 l1d_misses, llc_misses;
+            cache_counters_stop(&counters, &l1d_misses, &llc_misses);
+
+            u32 num_poses = num_frames*num_characters;
+            printf("  %-10s %-6s %8.2f us/pose", layout_names[layout_index], range_names[range_index], seconds*1e6 / num_poses);
+            if(l1d_misses >= 0) printf("  %8.1f L1d misses/pose", (f64)l1d_misses / num_poses);
+            if(llc_misses >= 0) printf("  %8.1f LLC misses/pose", (f64)llc_misses / num_poses);
+            if(l1d_misses < 0 && llc_misses < 0) printf("  (no hardware counters)");
+            printf("\n");
+
+            // NOTE: touched lines per pose, and the lines that were not touched by the character in the
+            // previous frame. The new lines have to come from memory when other characters evicted them
+            LineSet sets[2];
+            u32 line_capacity = 4*num_joints*4 + 64;
+            for(u32 i = 0; i < 2; ++i) {
+                sets[i].lines = (u64 *)malloc(sizeof(u64)*line_capacity);
+                sets[i].count = 0;
+                sets[i].capacity = line_capacity;
+            }
+            u64 touched_lines = 0;
+            u64 new_lines = 0;
+            for(u32 character = 0; character < num_characters; ++character) {
+                AnimationState *state = states + character;
+                for(u32 frame = 0; frame < num_frames; ++frame) {
+                    LineSet *current = sets + (frame & 1);
+                    LineSet *previous = sets + ((frame + 1) & 1);
+                    state->time += 1.0f/60.0f;
+                    if(state->time > state->animation->duration) {
+                        state->time -= state->animation->duration;
+                    }
+                    sample_lines(state, current, begin_joint, num_joints);
+                    touched_lines += current->count;
+                    new_lines += frame > 0 ? line_set_difference(current, previous) : current->count;
+                }
+            }
+            printf("  %-17s %8.1f lines/pose  %8.1f new lines/pose\n", "", (f64)touched_lines / num_poses, (f64)new_lines / num_poses);
+
+            free(sets[0].lines);
+            free(sets[1].lines);
+            for(u32 character = 0; character < num_characters; ++character) {
+                free(states[character].track_cursors);
+            }
+        }
+        free(states);
+    }
+    free(pose);
+    pose_kernels_initialize(kernel);
+}
+
+/* -------------------------------------------- */
+/*        Pose kernels                          */
+/* -------------------------------------------- */
+
+static Q4 random_rotation(void) {
+    Q4 q = q4(random_f32()*2 - 1, random_f32()*2 - 1, random_f32()*2 - 1, random_f32()*2 - 1);
+    return q4_normalize(q);
+}
+
+static f32 rotation_error(Q4 a, Q4 b) {
+    f32 error = MAX(fabsf(a.w - b.w), fabsf(a.x - b.x));
+    return MAX(error, MAX(fabsf(a.y - b.y), fabsf(a.z - b.z)));
+}
+
+static f32 pose_error(JointPose *a, JointPose *b, u32 count) {
+    f32 error = 0;
+    for(u32 joint_index = 0; joint_index < count; ++joint_index) {
+        error = MAX(error, rotation_error(a[joint_index].rotation, b[joint_index].rotation));
+        error = MAX(error, v3_length(v3_sub(a[joint_index].position, b[joint_index].position)));
+        error = MAX(error, v3_length(v3_sub(a[joint_index].scale, b[joint_index].scale)));
+    }
+    return error;
+}
+
+// NOTE: the SIMD kernels against the scalar q4_slerp and q4_onlerp, first on random pairs of rotations,
+// near and far apart, then through the samplers of every layout, for all the joints and for a range of
+// joints. Every error must be below
+// POSE_KERNEL_EPSILON. The time per joint of pose_lanes_mix and of pose_mix, which transposes the
+// joints to lanes and back, is measured for every kernel
+static bool check_pose_kernels(PoseKernelType max_kernel) {
+
+    bool passed = true;
+    const char *interpolation_names[2] = {"slerp", "onlerp"};
+    RotationInterpolation interpolations[2] = {ROTATION_INTERPOLATION_SLERP, ROTATION_INTERPOLATION_ONLERP};
+
+    // NOTE: 61 lanes so the kernels also run their tail
+    u32 num_lanes = 61;
+    u32 num_chunks = 4096;
+    PoseLanes *a = (PoseLanes *)aligned_alloc(alignof(PoseLanes), sizeof(PoseLanes)*num_chunks);
+    PoseLanes *b = (PoseLanes *)aligned_alloc(alignof(PoseLanes), sizeof(PoseLanes)*num_chunks);
+    PoseLanes *result = (PoseLanes *)aligned_alloc(alignof(PoseLanes), sizeof(PoseLanes));
+    f32 *t = (f32 *)malloc(sizeof(f32)*POSE_LANES*num_chunks);
+    for(u32 chunk = 0; chunk < num_chunks; ++chunk) {
+        for(u32 lane = 0; lane < num_lanes; ++lane) {
+            Q4 qa = random_rotation();
+            Q4 qb = random_rotation();
+            if(lane & 1) {
+                // NOTE: close rotations, the common case between two keys
+                qb = q4_normalize(q4_add(qa, q4_scale(qb, 0.05f*random_f32())));
+            }
+            pose_lanes_set(a + chunk, lane, v3(random_f32(), random_f32(), random_f32()), qa, v3(1, 1, 1));
+            pose_lanes_set(b + chunk, lane, v3(random_f32(), random_f32(), random_f32()), qb, v3(2, 2, 2));
+            t[chunk*POSE_LANES + lane] = lane == 0 ? 0 : (lane == 2 ? 1 : random_f32());
+        }
+    }
+    JointPose *mix_a = (JointPose *)malloc(sizeof(JointPose)*num_chunks*POSE_LANES);
+    JointPose *mix_b = (JointPose *)malloc(sizeof(JointPose)*num_chunks*POSE_LANES);
+    JointPose *mix_result = (JointPose *)malloc(sizeof(JointPose)*num_chunks*POSE_LANES);
+    for(u32 joint_index = 0; joint_index < num_chunks*POSE_LANES; ++joint_index) {
+        u32 lane = MIN(joint_index % POSE_LANES, num_lanes - 1);
+        pose_lanes_get(a + joint_index / POSE_LANES, lane, mix_a + joint_index);
+        pose_lanes_get(b + joint_index / POSE_LANES, lane, mix_b + joint_index);
+    }
+
+    Skeleton skeleton;
+    build_skeleton(&skeleton, 100);
+    AnimationClipLayout layouts[4] = {ANIMATION_CLIP_LAYOUT_AOS, ANIMATION_CLIP_LAYOUT_SOA, ANIMATION_CLIP_LAYOUT_SEGMENTED, ANIMATION_CLIP_LAYOUT_SPARSE};
+    const char *layout_names[4] = {"aos", "soa", "segmented", "sparse"};
+    AnimationClip clips[4];
+    for(u32 i = 0; i < 4; ++i) {
+        build_clip(clips + i, &skeleton, 90, layouts[i]);
+    }
+    u32 num_times = 200;
+    JointPose *expected = (JointPose *)malloc(sizeof(JointPose)*skeleton.num_joints*num_times*4*2);
+    JointPose *pose = (JointPose *)malloc(sizeof(JointPose)*skeleton.num_joints);
+
+    for(u32 kernel = POSE_KERNEL_SCALAR; kernel <= (u32)max_kernel; ++kernel) {
+        pose_kernels_initialize((PoseKernelType)kernel);
+        for(u32 i = 0; i < 2; ++i) {
+            RotationInterpolation interpolation = interpolations[i];
+
+            f32 pair_error = 0;
+            for(u32 chunk = 0; chunk < num_chunks; ++chunk) {
+                pose_lanes_mix(result, a + chunk, b + chunk, t + chunk*POSE_LANES, num_lanes, interpolation);
+                for(u32 lane = 0; lane < num_lanes; ++lane) {
+                    Q4 qa = pose_lanes_get_rotation(a + chunk, lane);
+                    Q4 qb = pose_lanes_get_rotation(b + chunk, lane);
+                    f32 lane_t = t[chunk*POSE_LANES + lane];
+                    Q4 reference = interpolation == ROTATION_INTERPOLATION_ONLERP ? q4_onlerp(qa, qb, lane_t) : q4_slerp(qa, qb, lane_t);
+                    pair_error = MAX(pair_error, rotation_error(pose_lanes_get_rotation(result, lane), reference));
+                    for(u32 c = 0; c < 3; ++c) {
+                        f32 position = lerp(a[chunk].position[c][lane], b[chunk].position[c][lane], lane_t);
+                        pair_error = MAX(pair_error, fabsf(result->position[c][lane] - position));
+                    }
+                }
+            }
+
+            f64 start = get_seconds();
+            u32 num_iterations = 16;
+            for(u32 iteration = 0; iteration < num_iterations; ++iteration) {
+                for(u32 chunk = 0; chunk < num_chunks; ++chunk) {
+                    pose_lanes_mix(result, a + chunk, b + chunk, t + chunk*POSE_LANES, POSE_LANES, interpolation);
+                }
+            }
+            f64 ns_per_joint = (get_seconds() - start)*1e9 / ((f64)num_iterations*num_chunks*POSE_LANES);
+
+            // NOTE: the same joints through pose_mix, the difference is the cost of the transposes
+            start = get_seconds();
+            for(u32 iteration = 0; iteration < num_iterations; ++iteration) {
+                pose_mix(mix_result, mix_a, mix_b, 0.5f, num_chunks*POSE_LANES, interpolation);
+            }
+            f64 mix_ns_per_joint = (get_seconds() - start)*1e9 / ((f64)num_iterations*num_chunks*POSE_LANES);
+
+            printf("  %-6s %-6s %6.2f ns/joint  pose_mix %6.2f ns/joint  pairs %.1e", pose_kernel_name((PoseKernelType)kernel), interpolation_names[i], ns_per_joint, mix_ns_per_joint, pair_error);
+            passed = passed && pair_error <= POSE_KERNEL_EPSILON;
+
+            // NOTE: the scalar kernel gives the reference poses of the samplers
+            for(u32 layout = 0; layout < 4; ++layout) {
+                AnimationState state;
+                random_state = 7;
+                initialize_state(&state, clips + layout);
+                f32 sampler_error = 0;
+                for(u32 time_index = 0; time_index < num_times; ++time_index) {
+                    state.time = clips[layout].duration*time_index / num_times;
+                    JointPose *reference = expected + ((i*4 + layout)*num_times + time_index)*skeleton.num_joints;
+                    state.sample_animation_pose(kernel == POSE_KERNEL_SCALAR ? reference : pose, interpolation);
+                    if(kernel != POSE_KERNEL_SCALAR) {
+                        sampler_error = MAX(sampler_error, pose_error(pose, reference, skeleton.num_joints));
+                    }
+                    // NOTE: a range of joints, as sampled by the masked states, against the same joints of the full pose
+                    u32 begin_joint = time_index % (skeleton.num_joints/2);
+                    u32 end_joint = skeleton.num_joints - time_index % 7;
+                    state.sample_animation_pose(pose, interpolation, begin_joint, end_joint);
+                    sampler_error = MAX(sampler_error, pose_error(pose + begin_joint, reference + begin_joint, end_joint - begin_joint));
+                }
+                free(state.track_cursors);
+                printf("  %s %.1e", layout_names[layout], sampler_error);
+                passed = passed && sampler_error <= POSE_KERNEL_EPSILON;
+            }
+            printf("\n");
+        }
+    }
+    pose_kernels_initialize(max_kernel);
+
+    printf("  epsilon %.1e: %s\n", POSE_KERNEL_EPSILON, passed ? "passed" : "FAILED");
+
+    free(pose);
+    free(expected);
+    free(mix_result);
+    free(mix_b);
+    free(mix_a);
+    free(t);
+    free(result);
+    free(b);
+    free(a);
+    return passed;
+}
+
+/* -------------------------------------------- */
+/*        Onlerp accuracy                       */
+/* -------------------------------------------- */
+
+// NOTE: exact slerp in double precision, the reference of the onlerp errors
+static void slerp_f64(Q4 a, Q4 b, f32 t, f64 *result) {
+    f64 qa[4] = {a.w, a.x, a.y, a.z};
+    f64 qb[4] = {b.w, b.x, b.y, b.z};
+    f64 cos_omega = qa[0]*qb[0] + qa[1]*qb[1] + qa[2]*qb[2] + qa[3]*qb[3];
+    f64 sign = cos_omega < 0 ? -1 : 1;
+    cos_omega *= sign;
+    f64 k0 = 1 - t;
+    f64 k1 = t;
+    if(cos_omega < 1 - 1e-12) {
+        f64 omega = acos(cos_omega);
+        f64 sin_omega = sin(omega);
+        k0 = sin((1 - t)*omega) / sin_omega;
+        k1 = sin(t*omega) / sin_omega;
+    }
+    f64 length_sqr = 0;
+    for(u32 c = 0; c < 4; ++c) {
+        result[c] = qa[c]*k0 + qb[c]*k1*sign;
+        length_sqr += result[c]*result[c];
+    }
+    for(u32 c = 0; c < 4; ++c) {
+        result[c] /= sqrt(length_sqr);
+    }
+}
+
+// NOTE: rotation angle between q and the reference, 4*asin(|q - r|/2) keeps the precision of the small angles
+static f64 angular_error(Q4 q, f64 *reference) {
+    f64 value[4] = {q.w, q.x, q.y, q.z};
+    f64 dot = 0;
+    for(u32 c = 0; c < 4; ++c) dot += value[c]*reference[c];
+    f64 sign = dot < 0 ? -1 : 1;
+    f64 distance_sqr = 0;
+    for(u32 c = 0; c < 4; ++c) {
+        f64 d = value[c]*sign - reference[c];
+        distance_sqr += d*d;
+    }
+    return 4*asin(MIN(sqrt(distance_sqr)*0.5, 1.0));
+}
+
+// NOTE: the error bounds documented with q4_onlerp. Random pairs with a uniform rotation angle between
+// them, the max angular error against a double precision slerp for every 30 deg of separation, then
+// on the keys of the synthetic clips. q4_slerp is measured with the same reference for comparison
+static void check_onlerp(void) {
+
+    u32 num_pairs = 3000000;
+    f64 onlerp_errors[6] = {};
+    f64 slerp_errors[6] = {};
+    random_state = 11;
+    for(u32 pair = 0; pair < num_pairs; ++pair) {
+        Q4 a = random_rotation();
+        V3 axis = v3_normalize(v3(random_f32()*2 - 1, random_f32()*2 - 1, random_f32()*2 - 1));
+        f32 angle = random_f32()*(f32)M_PI;
+        Q4 delta = q4(cosf(angle*0.5f), axis.x*sinf(angle*0.5f), axis.y*sinf(angle*0.5f), axis.z*sinf(angle*0.5f));
+        Q4 b = q4_normalize(q4_mul(a, delta));
+        if(pair & 1) {
+            b = q4_scale(b, -1);
+        }
+        f32 t = random_f32();
+
+        f64 reference[4];
+        slerp_f64(a, b, t, reference);
+        u32 bucket = MIN((u32)(angle*(6/M_PI)), 5u);
+        onlerp_errors[bucket] = MAX(onlerp_errors[bucket], angular_error(q4_onlerp(a, b, t), reference));
+        slerp_errors[bucket] = MAX(slerp_errors[bucket], angular_error(q4_slerp(a, b, t), reference));
+    }
+    f64 max_onlerp_error = 0;
+    for(u32 bucket = 0; bucket < 6; ++bucket) {
+        max_onlerp_error = MAX(max_onlerp_error, onlerp_errors[bucket]);
+        printf("  %3d-%3d deg  onlerp %.1e rad  slerp %.1e rad\n", bucket*30, (bucket + 1)*30, onlerp_errors[bucket], slerp_errors[bucket]);
+    }
+    printf("  any angle    onlerp %.1e rad\n", max_onlerp_error);
+
+    // NOTE: the keys of the synthetic clips, every joint sampled between its 30 Hz keys
+    f64 clip_error = 0;
+    f32 max_key_angle = 0;
+    for(u32 joint_index = 0; joint_index < 100; ++joint_index) {
+        for(u32 key_index = 0; key_index < 600; ++key_index) {
+            Q4 a = synthetic_pose(joint_index, key_index*SYNTHETIC_KEY_DELTA).rotation;
+            Q4 b = synthetic_pose(joint_index, (key_index + 1)*SYNTHETIC_KEY_DELTA).rotation;
+            f32 cos_omega = fabsf(a.w*b.w + a.x*b.x + a.y*b.y + a.z*b.z);
+            max_key_angle = MAX(max_key_angle, 2*acosf(MIN(cos_omega, 1.0f)));
+            for(u32 step = 1; step < 8; ++step) {
+                f32 t = step / 8.0f;
+                f64 reference[4];
+                slerp_f64(a, b, t, reference);
+                clip_error = MAX(clip_error, angular_error(q4_onlerp(a, b, t), reference));
+            }
+        }
+    }
+    printf("  clip keys    onlerp %.1e rad, keys up to %.1f deg apart\n", clip_error, max_key_angle*180/M_PI);
+
+    // NOTE: scalar cost of one call, the pairs are in memory so the loop is not only latency
+    u32 num_calls = 1 << 20;
+    Q4 *pairs = (Q4 *)malloc(sizeof(Q4)*2*1024);
+    for(u32 i = 0; i < 2*1024; ++i) {
+        pairs[i] = random_rotation();
+    }
+    f32 sum = 0;
+    f64 start = get_seconds();
+    for(u32 i = 0; i < num_calls; ++i) {
+        sum += q4_slerp(pairs[(i*2) & 2047], pairs[(i*2 + 1) & 2047], (f32)(i & 255)/255.0f).w;
+    }
+    f64 slerp_ns = (get_seconds() - start)*1e9 / num_calls;
+    start = get_seconds();
+    for(u32 i = 0; i < num_calls; ++i) {
+        sum += q4_onlerp(pairs[(i*2) & 2047], pairs[(i*2 + 1) & 2047], (f32)(i & 255)/255.0f).w;
+    }
+    f64 onlerp_ns = (get_seconds() - start)*1e9 / num_calls;
+    printf("  q4_slerp %.2f ns  q4_onlerp %.2f ns  (%g)\n", slerp_ns, onlerp_ns, sum);
+    free(pairs);
+}
+
+/* -------------------------------------------- */
+/*        Transforms                            */
+/* -------------------------------------------- */
+
+// NOTE: a random tree in depth first order, the parent of a joint is the previous joint or one of its
+// ancestors, so the hierarchy of every joint stays contiguous
+static void build_tree_skeleton(Skeleton *skeleton, u32 num_joints) {
+    build_skeleton(skeleton, num_joints);
+    for(u32 joint_index = 1; joint_index < num_joints; ++joint_index) {
+        s32 parent = (s32)joint_index - 1;
+        f32 branch = random_f32();
+        for(u32 step = 0; branch < 0.3f && step < 3 && skeleton->joints[parent].parent != -1; ++step) {
+            parent = skeleton->joints[parent].parent;
+            branch = random_f32();
+        }
+        skeleton->joints[joint_index].parent = parent;
+    }
+    skeleton->initialize_bind_local_poses();
+}
+
+static f32 matrix_error(f32 *a, f32 *b, u32 count) {
+    f32 error = 0;
+    for(u32 i = 0; i < count; ++i) {
+        error = MAX(error, fabsf(a[i] - b[i]));
+    }
+    return error;
+}
+
+// NOTE: the batch entry points against the scalar functions, and the hierarchy and bind passes of
+// AnimationSet against one scalar product per joint. The transforms_ entry points use the pose kernel
+static bool benchmark_transforms(PoseKernelType kernel) {
+
+    const f32 max_error = 1e-4f;
+    bool passed = true;
+    printf("transforms: %s kernel\n", pose_kernel_name(kernel));
+
+    u32 num_matrices = 256;
+    u32 num_repeats = 4096;
+    M4 *a = (M4 *)malloc(sizeof(M4)*num_matrices);
+    M4 *b = (M4 *)malloc(sizeof(M4)*num_matrices);
+    M34 *a34 = (M34 *)malloc(sizeof(M34)*num_matrices);
+    M34 *b34 = (M34 *)malloc(sizeof(M34)*num_matrices);
+    Q4 *q = (Q4 *)malloc(sizeof(Q4)*num_matrices);
+    M4 *scalar_m4 = (M4 *)malloc(sizeof(M4)*num_matrices);
+    M4 *batch_m4 = (M4 *)malloc(sizeof(M4)*num_matrices);
+    M34 *scalar_m34 = (M34 *)malloc(sizeof(M34)*num_matrices);
+    M34 *batch_m34 = (M34 *)malloc(sizeof(M34)*num_matrices);
+    random_state = 5;
+    for(u32 i = 0; i < num_matrices; ++i) {
+        for(u32 k = 0; k < 16; ++k) {
+            a[i].m[k] = random_f32()*2 - 1;
+            b[i].m[k] = random_f32()*2 - 1;
+        }
+        a34[i] = m34_from_m4(a[i]);
+        b34[i] = m34_from_m4(b[i]);
+        q[i] = q4_normalize(q4(random_f32()*2 - 1, random_f32()*2 - 1, random_f32()*2 - 1, random_f32()*2 - 1));
+    }
+
+    f64 start = get_seconds();
+    for(u32 repeat = 0; repeat < num_repeats; ++repeat) {
+        for(u32 i = 0; i < num_matrices; ++i) {
+            scalar_m4[i] = m4_mul(a[i], b[i]);
+        }
+    }
+    f64 scalar_m4_ns = (get_seconds() - start)*1e9 / ((f64)num_repeats*num_matrices);
+    start = get_seconds();
+    for(u32 repeat = 0; repeat < num_repeats; ++repeat) {
+        transforms_m4_mul_n(batch_m4, a, b, num_matrices);
+    }
+    f64 batch_m4_ns = (get_seconds() - start)*1e9 / ((f64)num_repeats*num_matrices);
+    f32 m4_error = matrix_error(scalar_m4[0].m, batch_m4[0].m, 16*num_matrices);
+    printf("  m4_mul           scalar %6.2f ns  batch %6.2f ns  max error %.1e\n", scalar_m4_ns, batch_m4_ns, m4_error);
+
+    start = get_seconds();
+    for(u32 repeat = 0; repeat < num_repeats; ++repeat) {
+        for(u32 i = 0; i < num_matrices; ++i) {
+            scalar_m4[i] = q4_to_m4(q[i]);
+        }
+    }
+    f64 scalar_q4_ns = (get_seconds() - start)*1e9 / ((f64)num_repeats*num_matrices);
+    start = get_seconds();
+    for(u32 repeat = 0; repeat < num_repeats; ++repeat) {
+        transforms_q4_to_m4_n(batch_m4, q, num_matrices);
+    }
+    f64 batch_q4_ns = (get_seconds() - start)*1e9 / ((f64)num_repeats*num_matrices);
+    f32 q4_error = matrix_error(scalar_m4[0].m, batch_m4[0].m, 16*num_matrices);
+    printf("  q4_to_m4         scalar %6.2f ns  batch %6.2f ns  max error %.1e\n", scalar_q4_ns, batch_q4_ns, q4_error);
+
+    // NOTE: the M34 batches of algebra.h are the SSE2 path of the build, not the pose kernel
+    start = get_seconds();
+    for(u32 repeat = 0; repeat < num_repeats; ++repeat) {
+        for(u32 i = 0; i < num_matrices; ++i) {
+            scalar_m34[i] = m34_mul(a34[i], b34[i]);
+        }
+    }
+    f64 scalar_m34_ns = (get_seconds() - start)*1e9 / ((f64)num_repeats*num_matrices);
+    start = get_seconds();
+    for(u32 repeat = 0; repeat < num_repeats; ++repeat) {
+        m34_mul_n(batch_m34, a34, b34, num_matrices);
+    }
+    f64 batch_m34_ns = (get_seconds() - start)*1e9 / ((f64)num_repeats*num_matrices);
+    f32 m34_error = matrix_error(scalar_m34[0].m, batch_m34[0].m, 12*num_matrices);
+    printf("  m34_mul          scalar %6.2f ns  batch %6.2f ns  max error %.1e\n", scalar_m34_ns, batch_m34_ns, m34_error);
+    passed = passed && m4_error <= max_error && q4_error <= max_error && m34_error <= max_error;
+
+    free(a);
+    free(b);
+    free(a34);
+    free(b34);
+    free(q);
+    free(scalar_m4);
+    free(batch_m4);
+    free(scalar_m34);
+    free(batch_m34);
+
+    // NOTE: every joint is dirty in every iteration, the root moves
+    u32 num_joints = 100;
+    u32 num_iterations = 20000;
+    Skeleton skeleton;
+    random_state = 9;
+    build_tree_skeleton(&skeleton, num_joints);
+    AnimationClip clip;
+    build_clip(&clip, &skeleton, 8, ANIMATION_CLIP_LAYOUT_AOS);
+    AnimationSet set;
+    set.initialize(&clip, 1);
+
+    JointPose *poses = (JointPose *)malloc(sizeof(JointPose)*num_joints);
+    M34 *inv_binds = (M34 *)malloc(sizeof(M34)*num_joints);
+    M34 *models = (M34 *)malloc(sizeof(M34)*num_joints);
+    M4 *palette = (M4 *)malloc(sizeof(M4)*num_joints);
+    u32 *depths = (u32 *)malloc(sizeof(u32)*num_joints);
+    u32 num_levels = 0;
+    for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+        s32 parent = skeleton.joints[joint_index].parent;
+        depths[joint_index] = parent == -1 ? 0 : depths[parent] + 1;
+        num_levels = MAX(num_levels, depths[joint_index] + 1);
+        poses[joint_index] = synthetic_pose(joint_index, 0.5f);
+        inv_binds[joint_index] = m34_from_m4(skeleton.joints[joint_index].inv_bind_transform);
+        set.set_local_pose({joint_index}, poses[joint_index]);
+    }
+
+    start = get_seconds();
+    for(u32 iteration = 0; iteration < num_iterations; ++iteration) {
+        poses[0].position.x = (f32)(iteration & 1);
+        for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+            JointPose *pose = poses + joint_index;
+            M34 local_transform = m34_from_trs(pose->position, pose->rotation, pose->scale);
+            s32 parent = skeleton.joints[joint_index].parent;
+            models[joint_index] = parent == -1 ? local_transform : m34_mul(models[parent], local_transform);
+            palette[joint_index] = m34_to_m4(m34_mul(models[joint_index], inv_binds[joint_index]));
+        }
+    }
+    f64 scalar_pass_us = (get_seconds() - start)*1e6 / num_iterations;
+
+    start = get_seconds();
+    for(u32 iteration = 0; iteration < num_iterations; ++iteration) {
+        poses[0].position.x = (f32)(iteration & 1);
+        set.set_local_pose({0}, poses[0]);
+        set.update_transforms();
+    }
+    f64 batch_pass_us = (get_seconds() - start)*1e6 / num_iterations;
+
+    f32 pass_error = matrix_error(palette[0].m, set.final_transform_matrices[0].m, 16*num_joints);
+    printf("  %d joints, %d levels: per joint %6.2f us  batched %6.2f us  max error %.1e\n",
+           num_joints, num_levels, scalar_pass_us, batch_pass_us, pass_error);
+    passed = passed && pass_error <= max_error;
+
+    set.terminate();
+    free(poses);
+    free(inv_binds);
+    free(models);
+    free(palette);
+    free(depths);
+    return passed;
+}
+
+/* -------------------------------------------- */
+/*        Main                                  */
+/* -------------------------------------------- */
+
+int main(int argc, char **argv) {
+
+    PoseKernelType kernel = pose_kernels_initialize(POSE_KERNEL_AVX2);
+    printf("pose kernel: %s\n", pose_kernel_name(kernel));
+
+    const char *name = argc > 1 ? argv[1] : "all";
+    bool all = strcmp(name, "all") == 0;
+    s32 result = 0;
+
+    if(all || strcmp(name, "layouts") == 0) {
+        benchmark_layouts();
+    }
+    if(all || strcmp(name, "onlerp") == 0) {
+        printf("onlerp:\n");
+        check_onlerp();
+    }
+    if(all || strcmp(name, "transforms") == 0) {
+        if(!benchmark_transforms(kernel)) {
+            result = 1;
+        }
+    }
+    if(all || strcmp(name, "kernels") == 0) {
+        printf("kernels:\n");
+        if(!check_pose_kernels(kernel)) {
+            result = 1;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,449 @@
+#include "blend_space.h"
+#include "common.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <string.h>
+
+#define BLEND_SPACE_EPSILON 1e-5f
+
+void BlendSpace::initialize(u32 max_samples_count, u32 dimensions_count) {
+    ASSERT(dimensions_count == 1 || dimensions_count == 2);
+    max_samples = max_samples_count;
+    dimensions = dimensions_count;
+    num_samples = 0;
+    samples = (BlendSpaceSample *)malloc(sizeof(BlendSpaceSample)*max_samples);
+
+    triangles = nullptr;
+    num_triangles = 0;
+    cell_first = nullptr;
+    cell_triangles = nullptr;
+    cell_fallback = nullptr;
+    grid_width = 0;
+    grid_height = 0;
+}
+
+void BlendSpace::terminate(void) {
+    free(samples);
+    free(triangles);
+    free(cell_first);
+    free(cell_triangles);
+    free(cell_fallback);
+}
+
+void BlendSpace::add_sample(AnimationHandle clip, f32 x, f32 y) {
+    ASSERT(num_samples < max_samples);
+    BlendSpaceSample *sample = samples + num_samples++;
+    sample->clip = clip;
+    sample->position = v2(x, dimensions == 2 ? y : 0);
+}
+
+/* -------------------------------------------- */
+/*        Build                                 */
+/* -------------------------------------------- */
+
+struct DelaunayTriangle {
+    u32 points[3];
+    V2 center;
+    f32 radius_sqr;
+};
+
+static f32 v2_distance_sqr(V2 a, V2 b) {
+    f32 dx = a.x - b.x;
+    f32 dy = a.y - b.y;
+    return dx*dx + dy*dy;
+}
+
+static DelaunayTriangle delaunay_triangle(V2 *points, u32 a, u32 b, u32 c) {
+    DelaunayTriangle triangle;
+    triangle.points[0] = a;
+    triangle.points[1] = b;
+    triangle.points[2] = c;
+
+    V2 pa = points[a];
+    V2 pb = points[b];
+    V2 pc = points[c];
+    f32 d = 2*(pa.x*(pb.y - pc.y) + pb.x*(pc.y - pa.y) + pc.x*(pa.y - pb.y));
+    if(fabsf(d) < 1e-12f) {
+        // NOTE: collinear points, the circumcircle contains everything so the triangle is always replaced
+        triangle.center = pa;
+        triangle.radius_sqr = 3.4e38f;
+        return triangle;
+    }
+    f32 sqr_a = pa.x*pa.x + pa.y*pa.y;
+    f32 sqr_b = pb.x*pb.x + pb.y*pb.y;
+    f32 sqr_c = pc.x*pc.x + pc.y*pc.y;
+    triangle.center.x = (sqr_a*(pb.y - pc.y) + sqr_b*(pc.y - pa.y) + sqr_c*(pa.y - pb.y)) / d;
+    triangle.center.y = (sqr_a*(pc.x - pb.x) + sqr_b*(pa.x - pc.x) + sqr_c*(pb.x - pa.x)) / d;
+    triangle.radius_sqr = v2_distance_sqr(triangle.center, pa);
+    return triangle;
+}
+
+// NOTE: Bowyer-Watson, every sample is inserted in the triangulation of the previous ones starting
+// with a triangle that contains all of them. Only done at build time, the cost is O(n^2)
+void BlendSpace::triangulate(void) {
+
+    u32 num_points = num_samples + 3;
+    V2 *points = (V2 *)malloc(sizeof(V2)*num_points);
+    V2 min = samples[0].position;
+    V2 max = samples[0].position;
+    for(u32 sample_index = 0; sample_index < num_samples; ++sample_index) {
+        V2 p = samples[sample_index].position;
+        points[sample_index] = p;
+        min = v2(MIN(min.x, p.x), MIN(min.y, p.y));
+        max = v2(MAX(max.x, p.x), MAX(max.y, p.y));
+    }
+    f32 size = MAX(max.x - min.x, max.y - min.y)*20 + 1;
+    V2 center = v2((min.x + max.x)*0.5f, (min.y + max.y)*0.5f);
+    points[num_samples + 0] = v2(center.x - size, center.y - size);
+    points[num_samples + 1] = v2(center.x + size, center.y - size);
+    points[num_samples + 2] = v2(center.x, center.y + size);
+
+    u32 max_triangles = 4*num_points + 8;
+    DelaunayTriangle *work = (DelaunayTriangle *)malloc(sizeof(DelaunayTriangle)*max_triangles);
+    bool *bad = (bool *)malloc(sizeof(bool)*max_triangles);
+    u32 *edges = (u32 *)malloc(sizeof(u32)*2*3*max_triangles);
+    u32 num_work = 0;
+    work[num_work++] = delaunay_triangle(points, num_samples, num_samples + 1, num_samples + 2);
+
+    for(u32 point_index = 0; point_index < num_samples; ++point_index) {
+        V2 p = points[point_index];
+
+        u32 num_edges = 0;
+        for(u32 triangle_index = 0; triangle_index < num_work; ++triangle_index) {
+            DelaunayTriangle *triangle = work + triangle_index;
+            bad[triangle_index] = v2_distance_sqr(p, triangle->center) < triangle->radius_sqr;
+            if(!bad[triangle_index]) continue;
+            for(u32 edge = 0; edge < 3; ++edge) {
+                edges[num_edges*2 + 0] = triangle->points[edge];
+                edges[num_edges*2 + 1] = triangle->points[(edge + 1) % 3];
+                ++num_edges;
+            }
+        }
+
+        u32 num_kept = 0;
+        for(u32 triangle_index = 0; triangle_index < num_work; ++triangle_index) {
+            if(!bad[triangle_index]) {
+                work[num_kept++] = work[triangle_index];
+            }
+        }
+        num_work = num_kept;
+
+        // NOTE: the edges shared by two removed triangles are inside the hole, the others form its boundary
+        for(u32 edge = 0; edge < num_edges; ++edge) {
+            u32 a = edges[edge*2 + 0];
+            u32 b = edges[edge*2 + 1];
+            bool shared = false;
+            for(u32 other = 0; other < num_edges && !shared; ++other) {
+                if(other == edge) continue;
+                u32 c = edges[other*2 + 0];
+                u32 d = edges[other*2 + 1];
+                shared = (a == c && b == d) || (a == d && b == c);
+            }
+            if(shared) continue;
+            ASSERT(num_work < max_triangles);
+            work[num_work++] = delaunay_triangle(points, a, b, point_index);
+        }
+    }
+
+    triangles = (BlendSpaceTriangle *)malloc(sizeof(BlendSpaceTriangle)*num_work);
+    num_triangles = 0;
+    for(u32 triangle_index = 0; triangle_index < num_work; ++triangle_index) {
+        DelaunayTriangle *triangle = work + triangle_index;
+        if(triangle->points[0] >= num_samples || triangle->points[1] >= num_samples || triangle->points[2] >= num_samples) continue;
+        BlendSpaceTriangle *result = triangles + num_triangles++;
+        result->samples[0] = triangle->points[0];
+        result->samples[1] = triangle->points[1];
+        result->samples[2] = triangle->points[2];
+    }
+
+    free(edges);
+    free(bad);
+    free(work);
+    free(points);
+}
+
+static V2 closest_point_on_segment(V2 p, V2 a, V2 b) {
+    V2 ab = v2(b.x - a.x, b.y - a.y);
+    f32 length_sqr = ab.x*ab.x + ab.y*ab.y;
+    f32 t = 0;
+    if(length_sqr > 0) {
+        t = ((p.x - a.x)*ab.x + (p.y - a.y)*ab.y) / length_sqr;
+        t = CLAMP(t, 0.0f, 1.0f);
+    }
+    return v2(a.x + ab.x*t, a.y + ab.y*t);
+}
+
+static f32 distance_sqr_to_segment(V2 p, V2 a, V2 b) {
+    return v2_distance_sqr(p, closest_point_on_segment(p, a, b));
+}
+
+// NOTE: distance and closest point of the edges, only used for the points outside of the triangle
+static f32 distance_sqr_to_edges(V2 p, V2 a, V2 b, V2 c) {
+    f32 distance = distance_sqr_to_segment(p, a, b);
+    distance = MIN(distance, distance_sqr_to_segment(p, b, c));
+    return MIN(distance, distance_sqr_to_segment(p, c, a));
+}
+
+static V2 closest_point_on_edges(V2 p, V2 a, V2 b, V2 c) {
+    V2 closest = closest_point_on_segment(p, a, b);
+    V2 candidates[2] = {closest_point_on_segment(p, b, c), closest_point_on_segment(p, c, a)};
+    for(u32 i = 0; i < 2; ++i) {
+        if(v2_distance_sqr(p, candidates[i]) < v2_distance_sqr(p, closest)) {
+            closest = candidates[i];
+        }
+    }
+    return closest;
+}
+
+void BlendSpace::build_grid(void) {
+
+    grid_min = samples[0].position;
+    grid_max = samples[0].position;
+    for(u32 sample_index = 1; sample_index < num_samples; ++sample_index) {
+        V2 p = samples[sample_index].position;
+        grid_min = v2(MIN(grid_min.x, p.x), MIN(grid_min.y, p.y));
+        grid_max = v2(MAX(grid_max.x, p.x), MAX(grid_max.y, p.y));
+    }
+
+    u32 side = (u32)ceilf(sqrtf((f32)num_triangles));
+    grid_width = grid_max.x > grid_min.x ? MAX(side, 1u) : 1;
+    grid_height = grid_max.y > grid_min.y ? MAX(side, 1u) : 1;
+    if(dimensions == 1) {
+        grid_width = grid_max.x > grid_min.x ? num_triangles : 1;
+    }
+    u32 num_cells = grid_width*grid_height;
+    f32 cell_width = (grid_max.x - grid_min.x) / grid_width;
+    f32 cell_height = (grid_max.y - grid_min.y) / grid_height;
+
+    cell_first = (u32 *)malloc(sizeof(u32)*(num_cells + 1));
+    cell_fallback = (u32 *)malloc(sizeof(u32)*num_cells);
+
+    // NOTE: two passes, count the triangles that overlap every cell and then store them
+    u32 num_cell_triangles = 0;
+    for(u32 pass = 0; pass < 2; ++pass) {
+        num_cell_triangles = 0;
+        for(u32 cell = 0; cell < num_cells; ++cell) {
+            f32 cell_min_x = grid_min.x + (cell % grid_width)*cell_width;
+            f32 cell_min_y = grid_min.y + (cell / grid_width)*cell_height;
+            f32 cell_max_x = cell_min_x + cell_width;
+            f32 cell_max_y = cell_min_y + cell_height;
+            V2 cell_center = v2((cell_min_x + cell_max_x)*0.5f, (cell_min_y + cell_max_y)*0.5f);
+
+            if(pass == 0) {
+                cell_first[cell] = num_cell_triangles;
+            }
+
+            f32 closest_distance = 3.4e38f;
+            for(u32 triangle_index = 0; triangle_index < num_triangles; ++triangle_index) {
+                BlendSpaceTriangle *triangle = triangles + triangle_index;
+                V2 a = samples[triangle->samples[0]].position;
+                V2 b = samples[triangle->samples[1]].position;
+                V2 c = samples[triangle->samples[2]].position;
+                f32 min_x = MIN3(a.x, b.x, c.x) - BLEND_SPACE_EPSILON;
+                f32 max_x = MAX3(a.x, b.x, c.x) + BLEND_SPACE_EPSILON;
+                f32 min_y = MIN3(a.y, b.y, c.y) - BLEND_SPACE_EPSILON;
+                f32 max_y = MAX3(a.y, b.y, c.y) + BLEND_SPACE_EPSILON;
+                if(min_x <= cell_max_x && max_x >= cell_min_x && min_y <= cell_max_y && max_y >= cell_min_y) {
+                    if(pass == 1) {
+                        cell_triangles[num_cell_triangles] = triangle_index;
+                    }
+                    ++num_cell_triangles;
+                }
+
+                if(pass == 0) {
+                    f32 weights[3];
+                    f32 distance = 0;
+                    if(!barycentric(triangle_index, cell_center, weights)) {
+                        distance = distance_sqr_to_edges(cell_center, a, b, c);
+                    }
+                    if(distance < closest_distance) {
+                        closest_distance = distance;
+                        cell_fallback[cell] = triangle_index;
+                    }
+                }
+            }
+        }
+        if(pass == 0) {
+            cell_first[num_cells] = num_cell_triangles;
+            cell_triangles = (u32 *)malloc(sizeof(u32)*MAX(num_cell_triangles, 1u));
+        }
+    }
+}
+
+void BlendSpace::build(void) {
+
+    ASSERT(num_samples > 0);
+    free(triangles);
+    free(cell_first);
+    free(cell_triangles);
+    free(cell_fallback);
+
+    if(num_samples == 1) {
+        triangles = (BlendSpaceTriangle *)malloc(sizeof(BlendSpaceTriangle));
+        triangles[0].samples[0] = triangles[0].samples[1] = triangles[0].samples[2] = 0;
+        num_triangles = 1;
+    } else if(dimensions == 1) {
+        // NOTE: sort the samples by position, one segment between every pair of neighbours
+        u32 *order = (u32 *)malloc(sizeof(u32)*num_samples);
+        for(u32 sample_index = 0; sample_index < num_samples; ++sample_index) {
+            u32 insert = sample_index;
+            while(insert > 0 && samples[order[insert - 1]].position.x > samples[sample_index].position.x) {
+                order[insert] = order[insert - 1];
+                --insert;
+            }
+            order[insert] = sample_index;
+        }
+        triangles = (BlendSpaceTriangle *)malloc(sizeof(BlendSpaceTriangle)*(num_samples - 1));
+        num_triangles = 0;
+        for(u32 sample_index = 0; sample_index + 1 < num_samples; ++sample_index) {
+            u32 a = order[sample_index];
+            u32 b = order[sample_index + 1];
+            if(samples[a].position.x == samples[b].position.x) continue;
+            BlendSpaceTriangle *segment = triangles + num_triangles++;
+            segment->samples[0] = a;
+            segment->samples[1] = b;
+            segment->samples[2] = b;
+        }
+        if(num_triangles == 0) {
+            triangles[0].samples[0] = triangles[0].samples[1] = triangles[0].samples[2] = order[0];
+            num_triangles = 1;
+        }
+        free(order);
+    } else {
+        triangulate();
+        // NOTE: all the samples on a line, the 2D space can not be triangulated
+        ASSERT(num_triangles > 0);
+    }
+
+    build_grid();
+}
+
+/* -------------------------------------------- */
+/*        Lookup                                */
+/* -------------------------------------------- */
+
+// NOTE: returns true when the point is inside the triangle (or segment), the weights are not clamped
+bool BlendSpace::barycentric(u32 triangle_index, V2 point, f32 *weights) {
+    BlendSpaceTriangle *triangle = triangles + triangle_index;
+    V2 a = samples[triangle->samples[0]].position;
+    V2 b = samples[triangle->samples[1]].position;
+    V2 c = samples[triangle->samples[2]].position;
+
+    if(triangle->samples[1] == triangle->samples[2]) {
+        f32 t = 0;
+        if(b.x != a.x) {
+            t = (point.x - a.x) / (b.x - a.x);
+        }
+        weights[0] = 1 - t;
+        weights[1] = t;
+        weights[2] = 0;
+        return t >= -BLEND_SPACE_EPSILON && t <= 1 + BLEND_SPACE_EPSILON;
+    }
+
+    V2 v0 = v2(b.x - a.x, b.y - a.y);
+    V2 v1 = v2(c.x - a.x, c.y - a.y);
+    V2 v2p = v2(point.x - a.x, point.y - a.y);
+    f32 d00 = v0.x*v0.x + v0.y*v0.y;
+    f32 d01 = v0.x*v1.x + v0.y*v1.y;
+    f32 d11 = v1.x*v1.x + v1.y*v1.y;
+    f32 d20 = v2p.x*v0.x + v2p.y*v0.y;
+    f32 d21 = v2p.x*v1.x + v2p.y*v1.y;
+    f32 denominator = d00*d11 - d01*d01;
+    if(denominator == 0) {
+        weights[0] = 1;
+        weights[1] = 0;
+        weights[2] = 0;
+        return false;
+    }
+    weights[1] = (d11*d20 - d01*d21) / denominator;
+    weights[2] = (d00*d21 - d01*d20) / denominator;
+    weights[0] = 1 - weights[1] - weights[2];
+    return weights[0] >= -BLEND_SPACE_EPSILON && weights[1] >= -BLEND_SPACE_EPSILON && weights[2] >= -BLEND_SPACE_EPSILON;
+}
+
+u32 BlendSpace::find_clips(f32 x, f32 y, AnimationHandle *clips, f32 *weights) {
+
+    ASSERT(num_triangles > 0);
+    V2 point = v2(CLAMP(x, grid_min.x, grid_max.x), dimensions == 2 ? CLAMP(y, grid_min.y, grid_max.y) : 0);
+
+    u32 cell_x = 0;
+    u32 cell_y = 0;
+    if(grid_max.x > grid_min.x) {
+        cell_x = MIN((u32)((point.x - grid_min.x) / (grid_max.x - grid_min.x) * grid_width), grid_width - 1);
+    }
+    if(grid_max.y > grid_min.y) {
+        cell_y = MIN((u32)((point.y - grid_min.y) / (grid_max.y - grid_min.y) * grid_height), grid_height - 1);
+    }
+    u32 cell = cell_y*grid_width + cell_x;
+
+    f32 triangle_weights[3];
+    u32 triangle_index = cell_fallback[cell];
+    bool inside = false;
+    for(u32 candidate = cell_first[cell]; candidate < cell_first[cell + 1] && !inside; ++candidate) {
+        if(barycentric(cell_triangles[candidate], point, triangle_weights)) {
+            triangle_index = cell_triangles[candidate];
+            inside = true;
+        }
+    }
+
+    if(!inside) {
+        // NOTE: outside of the samples, use the closest point of the triangle closest to the point. The
+        // fallback of the cell is closest to its center, it only wins when no candidate is closer.
+        // The weights are clamped for the precision of the points on the edges
+        f32 closest_distance = 3.4e38f;
+        for(u32 candidate = cell_first[cell]; candidate <= cell_first[cell + 1]; ++candidate) {
+            u32 candidate_triangle = candidate < cell_first[cell + 1] ? cell_triangles[candidate] : cell_fallback[cell];
+            BlendSpaceTriangle *triangle = triangles + candidate_triangle;
+            f32 distance = distance_sqr_to_edges(point, samples[triangle->samples[0]].position, samples[triangle->samples[1]].position, samples[triangle->samples[2]].position);
+            if(distance < closest_distance) {
+                closest_distance = distance;
+                triangle_index = candidate_triangle;
+            }
+        }
+        BlendSpaceTriangle *closest = triangles + triangle_index;
+        V2 closest_point = closest_point_on_edges(point, samples[closest->samples[0]].position, samples[closest->samples[1]].position, samples[closest->samples[2]].position);
+        barycentric(triangle_index, closest_point, triangle_weights);
+        f32 sum = 0;
+        for(u32 i = 0; i < 3; ++i) {
+            triangle_weights[i] = MAX(triangle_weights[i], 0.0f);
+            sum += triangle_weights[i];
+        }
+        if(sum <= 0) {
+            triangle_weights[0] = 1;
+            triangle_weights[1] = triangle_weights[2] = 0;
+            sum = 1;
+        }
+        for(u32 i = 0; i < 3; ++i) {
+            triangle_weights[i] /= sum;
+        }
+    }
+
+    // NOTE: drop the samples without weight and merge the repeated ones (segments and single samples)
+    BlendSpaceTriangle *triangle = triangles + triangle_index;
+    u32 num_clips = 0;
+    u32 sample_indices[BLEND_SPACE_MAX_CLIPS];
+    for(u32 i = 0; i < 3; ++i) {
+        f32 weight = CLAMP(triangle_weights[i], 0.0f, 1.0f);
+        if(weight <= 0) continue;
+        u32 sample_index = triangle->samples[i];
+        bool merged = false;
+        for(u32 clip_index = 0; clip_index < num_clips; ++clip_index) {
+            if(sample_indices[clip_index] == sample_index) {
+                weights[clip_index] += weight;
+                merged = true;
+            }
+        }
+        if(merged) continue;
+        sample_indices[num_clips] = sample_index;
+        clips[num_clips] = samples[sample_index].clip;
+        weights[num_clips] = weight;
+        ++num_clips;
+    }
+    if(num_clips == 0) {
+        clips[0] = samples[triangle->samples[0]].clip;
+        weights[0] = 1;
+        num_clips = 1;
+    }
+    return num_clips;
+}
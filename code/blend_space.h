@@ -0,0 +1,63 @@
+#ifndef _BLEND_SPACE_H_
+#define _BLEND_SPACE_H_
+
+#include "common.h"
+#include "algebra.h"
+#include "animation.h"
+
+// NOTE: Clips placed at points of a 1D or 2D parameter space (speed, direction, ...). build() sorts
+// (1D) or Delaunay triangulates (2D) the samples and puts the segments/triangles in a uniform grid,
+// a lookup tests the few triangles of one cell so it does not depend on the number of clips.
+// A lookup returns at most 3 clips with barycentric weights, the points outside the samples are
+// clamped to the closest triangle of the cell
+
+#define BLEND_SPACE_MAX_CLIPS 3
+
+struct BlendSpaceSample {
+    AnimationHandle clip;
+    V2 position;
+};
+
+// NOTE: 1D spaces use segments, the third sample is the same as the second
+struct BlendSpaceTriangle {
+    u32 samples[3];
+};
+
+struct BlendSpace {
+    BlendSpaceSample *samples;
+    u32 num_samples;
+    u32 max_samples;
+    u32 dimensions;
+
+    BlendSpaceTriangle *triangles;
+    u32 num_triangles;
+
+    // NOTE: the candidates of cell i are cell_triangles[cell_first[i] .. cell_first[i + 1]), cell_fallback
+    // is the triangle closest to the center of the cell. The points outside the samples use the closest
+    // of the candidates and the fallback
+    V2 grid_min;
+    V2 grid_max;
+    u32 grid_width;
+    u32 grid_height;
+    u32 *cell_first;
+    u32 *cell_triangles;
+    u32 *cell_fallback;
+
+    void initialize(u32 max_samples_count, u32 dimensions_count);
+    void terminate(void);
+
+    // NOTE: y is ignored by 1D spaces
+    void add_sample(AnimationHandle clip, f32 x, f32 y);
+    void build(void);
+
+    // NOTE: returns the number of clips (1 to BLEND_SPACE_MAX_CLIPS), the weights add up to 1
+    u32 find_clips(f32 x, f32 y, AnimationHandle *clips, f32 *weights);
+
+private:
+
+    void triangulate(void);
+    void build_grid(void);
+    bool barycentric(u32 triangle_index, V2 point, f32 *weights);
+};
+
+#endif // _BLEND_SPACE_H_
@@ -0,0 +1,356 @@
+#include "blend_tree.h"
+#include "pose_kernels.h"
+#include "algebra.h"
+#include "common.h"
+
+#include <cstdlib>
+#include <string.h>
+
+/* -------------------------------------------- */
+/*        Description                           */
+/* -------------------------------------------- */
+
+void BlendTree::initialize(u32 max_nodes_count, u32 max_parameters_count) {
+    max_nodes = max_nodes_count;
+    max_parameters = max_parameters_count;
+    num_nodes = 0;
+    num_parameters = 0;
+    nodes = (BlendNode *)malloc(sizeof(BlendNode)*max_nodes);
+    parameters = (f32 *)malloc(sizeof(f32)*max_parameters);
+
+    program = nullptr;
+    num_instructions = 0;
+    pose_stack = nullptr;
+    changed = nullptr;
+    slot_weights = nullptr;
+    scratch_pose = nullptr;
+    set = nullptr;
+    memset(&stats, 0, sizeof(stats));
+}
+
+void BlendTree::terminate(void) {
+    free(nodes);
+    free(parameters);
+    free(program);
+    free(pose_stack);
+    free(changed);
+    free(slot_weights);
+    free(scratch_pose);
+}
+
+u32 BlendTree::add_parameter(f32 value) {
+    ASSERT(num_parameters < max_parameters);
+    parameters[num_parameters] = value;
+    return num_parameters++;
+}
+
+void BlendTree::set_parameter(u32 parameter, f32 value) {
+    ASSERT(parameter < num_parameters);
+    parameters[parameter] = value;
+}
+
+u32 BlendTree::add_node(BlendNodeType type, u32 a, u32 b, u32 parameter) {
+    ASSERT(num_nodes < max_nodes);
+    // NOTE: every node but the clips reads a parameter, the lerp, additive and mask nodes read two inputs
+    bool has_inputs = type == BLEND_NODE_LERP || type == BLEND_NODE_ADDITIVE || type == BLEND_NODE_MASK;
+    ASSERT(has_inputs ? a < num_nodes : a == BLEND_TREE_INVALID_NODE);
+    ASSERT(has_inputs ? b < num_nodes : b == BLEND_TREE_INVALID_NODE);
+    ASSERT(type == BLEND_NODE_CLIP ? parameter == BLEND_TREE_INVALID_NODE : parameter < num_parameters);
+    (void)has_inputs;
+    BlendNode *node = nodes + num_nodes;
+    node->type = type;
+    node->inputs[0] = a;
+    node->inputs[1] = b;
+    node->parameter = parameter;
+    node->clip.index = 0;
+    node->mask_root.index = 0;
+    node->space = nullptr;
+    node->parameter_y = BLEND_TREE_INVALID_NODE;
+    return num_nodes++;
+}
+
+u32 BlendTree::add_clip(AnimationHandle clip) {
+    u32 node_index = add_node(BLEND_NODE_CLIP, BLEND_TREE_INVALID_NODE, BLEND_TREE_INVALID_NODE, BLEND_TREE_INVALID_NODE);
+    nodes[node_index].clip = clip;
+    return node_index;
+}
+
+u32 BlendTree::add_lerp(u32 a, u32 b, u32 parameter) {
+    return add_node(BLEND_NODE_LERP, a, b, parameter);
+}
+
+u32 BlendTree::add_additive(u32 base, u32 additive, u32 parameter) {
+    return add_node(BLEND_NODE_ADDITIVE, base, additive, parameter);
+}
+
+u32 BlendTree::add_mask(u32 base, u32 masked, JointHandle mask_root, u32 parameter) {
+    u32 node_index = add_node(BLEND_NODE_MASK, base, masked, parameter);
+    nodes[node_index].mask_root = mask_root;
+    return node_index;
+}
+
+u32 BlendTree::add_blend_space(BlendSpace *space, u32 parameter_x, u32 parameter_y) {
+    ASSERT(space->num_triangles > 0);
+    ASSERT(space->dimensions == 1 || parameter_y < num_parameters);
+    u32 node_index = add_node(BLEND_NODE_BLEND_SPACE, BLEND_TREE_INVALID_NODE, BLEND_TREE_INVALID_NODE, parameter_x);
+    nodes[node_index].space = space;
+    nodes[node_index].parameter_y = parameter_y;
+    return node_index;
+}
+
+/* -------------------------------------------- */
+/*        Compilation                           */
+/* -------------------------------------------- */
+
+// NOTE: post order, the inputs of an instruction are always before it in the program. A node used
+// by more than one parent is compiled once
+u32 BlendTree::compile_node(u32 node_index, u32 *node_slots) {
+
+    if(node_slots[node_index] != BLEND_TREE_INVALID_NODE) {
+        return node_slots[node_index];
+    }
+
+    BlendNode *node = nodes + node_index;
+    u32 a = BLEND_TREE_INVALID_NODE;
+    u32 b = BLEND_TREE_INVALID_NODE;
+    if(node->type != BLEND_NODE_CLIP && node->type != BLEND_NODE_BLEND_SPACE) {
+        a = compile_node(node->inputs[0], node_slots);
+        b = compile_node(node->inputs[1], node_slots);
+    }
+
+    u32 slot = num_instructions++;
+    BlendInstruction *instruction = program + slot;
+    memset(instruction, 0, sizeof(BlendInstruction));
+    instruction->a = a;
+    instruction->b = b;
+    instruction->parameter = node->parameter;
+    instruction->valid = false;
+
+    switch(node->type) {
+        case BLEND_NODE_CLIP: {
+            ASSERT(node->clip.index < set->num_states);
+            instruction->op = BLEND_OP_SAMPLE;
+            instruction->state = node->clip.index;
+        } break;
+        case BLEND_NODE_LERP: {
+            instruction->op = BLEND_OP_LERP;
+        } break;
+        case BLEND_NODE_ADDITIVE: {
+            BlendNode *additive = nodes + node->inputs[1];
+            instruction->op = BLEND_OP_ADDITIVE;
+            instruction->delta = additive->type == BLEND_NODE_CLIP &&
+                (set->states[additive->clip.index].animation->flags & ANIMATION_CLIP_ADDITIVE);
+        } break;
+        case BLEND_NODE_MASK: {
+            ASSERT(node->mask_root.index < set->skeleton->num_joints);
+            instruction->op = BLEND_OP_MASK;
+            instruction->mask_first_joint = node->mask_root.index;
+            instruction->mask_num_joints = set->skeleton->get_hierarchy_end(node->mask_root.index) - node->mask_root.index;
+        } break;
+        case BLEND_NODE_BLEND_SPACE: {
+            for(u32 sample_index = 0; sample_index < node->space->num_samples; ++sample_index) {
+                ASSERT(node->space->samples[sample_index].clip.index < set->num_states);
+            }
+            instruction->op = BLEND_OP_BLEND_SPACE;
+            instruction->space = node->space;
+            instruction->parameter_y = node->parameter_y;
+        } break;
+    }
+
+    node_slots[node_index] = slot;
+    return slot;
+}
+
+void BlendTree::compile(AnimationSet *animation_set, u32 root) {
+
+    ASSERT(root < num_nodes);
+    set = animation_set;
+
+    free(program);
+    free(pose_stack);
+    free(changed);
+    free(slot_weights);
+    free(scratch_pose);
+
+    // NOTE: at most one instruction per node
+    program = (BlendInstruction *)malloc(sizeof(BlendInstruction)*num_nodes);
+    num_instructions = 0;
+
+    u32 *node_slots = (u32 *)malloc(sizeof(u32)*num_nodes);
+    for(u32 node_index = 0; node_index < num_nodes; ++node_index) {
+        node_slots[node_index] = BLEND_TREE_INVALID_NODE;
+    }
+    compile_node(root, node_slots);
+    free(node_slots);
+
+    pose_stack = (JointPose *)malloc(sizeof(JointPose)*set->skeleton->num_joints*num_instructions);
+    changed = (bool *)malloc(sizeof(bool)*num_instructions);
+    slot_weights = (f32 *)malloc(sizeof(f32)*num_instructions);
+    scratch_pose = (JointPose *)malloc(sizeof(JointPose)*set->skeleton->num_joints);
+}
+
+/* -------------------------------------------- */
+/*        Evaluation                            */
+/* -------------------------------------------- */
+
+JointPose *BlendTree::get_slot(u32 slot) {
+    return pose_stack + (u64)set->skeleton->num_joints*slot;
+}
+
+// NOTE: dst = pose - bind, the pose as a delta of an ANIMATION_CLIP_ADDITIVE clip for pose_add. The rotation
+// difference is in the local space of the joint
+static void pose_delta(JointPose *dst, JointPose *pose, JointPose *bind, u32 count) {
+    for(u32 joint_index = 0; joint_index < count; ++joint_index) {
+        JointPose *b = bind + joint_index;
+        JointPose *p = pose + joint_index;
+        JointPose *d = dst + joint_index;
+        d->position = v3_sub(p->position, b->position);
+        d->rotation = q4_mul(q4_conjugate(b->rotation), p->rotation);
+        d->scale.x = b->scale.x != 0 ? p->scale.x / b->scale.x : 1;
+        d->scale.y = b->scale.y != 0 ? p->scale.y / b->scale.y : 1;
+        d->scale.z = b->scale.z != 0 ? p->scale.z / b->scale.z : 1;
+    }
+}
+
+void BlendTree::evaluate(JointPose *result) {
+
+    ASSERT(num_instructions > 0);
+    Skeleton *skeleton = set->skeleton;
+    u32 num_joints = skeleton->num_joints;
+    RotationInterpolation interpolation = set->rotation_interpolation;
+
+    stats.evaluated_instructions = 0;
+    stats.reused_instructions = 0;
+
+    for(u32 slot = 0; slot < num_instructions; ++slot) {
+        BlendInstruction *instruction = program + slot;
+        JointPose *dst = get_slot(slot);
+
+        bool dirty = !instruction->valid;
+        f32 parameter = 0;
+        u32 num_clips = 0;
+        AnimationHandle clips[BLEND_SPACE_MAX_CLIPS];
+        f32 weights[BLEND_SPACE_MAX_CLIPS];
+        if(instruction->op == BLEND_OP_SAMPLE) {
+            AnimationState *state = set->states + instruction->state;
+            dirty = dirty || state->time != instruction->cached_time;
+            instruction->cached_time = state->time;
+        } else if(instruction->op == BLEND_OP_BLEND_SPACE) {
+            f32 x = parameters[instruction->parameter];
+            f32 y = instruction->space->dimensions == 2 ? parameters[instruction->parameter_y] : 0;
+            dirty = dirty || x != instruction->cached_parameter || y != instruction->cached_parameter_y;
+            instruction->cached_parameter = x;
+            instruction->cached_parameter_y = y;
+
+            // NOTE: the lookup is needed anyway to know if the clocks of the clips changed
+            num_clips = instruction->space->find_clips(x, y, clips, weights);
+            dirty = dirty || num_clips != instruction->num_cached_clips;
+            for(u32 clip_index = 0; clip_index < num_clips; ++clip_index) {
+                f32 time = set->states[clips[clip_index].index].time;
+                dirty = dirty || clips[clip_index].index != instruction->cached_clips[clip_index].index ||
+                    time != instruction->cached_clip_times[clip_index];
+                instruction->cached_clips[clip_index] = clips[clip_index];
+                instruction->cached_clip_times[clip_index] = time;
+            }
+            instruction->num_cached_clips = num_clips;
+        } else {
+            parameter = CLAMP(parameters[instruction->parameter], 0.0f, 1.0f);
+            dirty = dirty || changed[instruction->a] || changed[instruction->b] || parameter != instruction->cached_parameter;
+            instruction->cached_parameter = parameter;
+        }
+
+        changed[slot] = dirty;
+        instruction->valid = true;
+        if(!dirty) {
+            ++stats.reused_instructions;
+            continue;
+        }
+        ++stats.evaluated_instructions;
+
+        switch(instruction->op) {
+            case BLEND_OP_SAMPLE: {
+                set->states[instruction->state].sample_animation_pose(dst, interpolation);
+            } break;
+            case BLEND_OP_LERP: {
+                pose_mix(dst, get_slot(instruction->a), get_slot(instruction->b), parameter, num_joints, interpolation);
+            } break;
+            case BLEND_OP_ADDITIVE: {
+                JointPose *delta = get_slot(instruction->b);
+                if(!instruction->delta) {
+                    pose_delta(scratch_pose, delta, skeleton->bind_local_poses, num_joints);
+                    delta = scratch_pose;
+                }
+                pose_add(dst, get_slot(instruction->a), delta, parameter, num_joints);
+            } break;
+            case BLEND_OP_MASK: {
+                u32 first_joint = instruction->mask_first_joint;
+                memcpy(dst, get_slot(instruction->a), sizeof(JointPose)*num_joints);
+                pose_mix(dst + first_joint, dst + first_joint, get_slot(instruction->b) + first_joint, parameter, instruction->mask_num_joints, interpolation);
+            } break;
+            case BLEND_OP_BLEND_SPACE: {
+                // NOTE: mix(mix(c0, c1, w1/(w0 + w1)), c2, w2), same weights as the barycentric blend
+                set->states[clips[0].index].sample_animation_pose(dst, interpolation);
+                f32 total_weight = weights[0];
+                for(u32 clip_index = 1; clip_index < num_clips; ++clip_index) {
+                    total_weight += weights[clip_index];
+                    set->states[clips[clip_index].index].sample_animation_pose(scratch_pose, interpolation);
+                    pose_mix(dst, dst, scratch_pose, weights[clip_index] / total_weight, num_joints, interpolation);
+                }
+            } break;
+        }
+    }
+
+    memcpy(result, get_slot(num_instructions - 1), sizeof(JointPose)*num_joints);
+}
+
+// NOTE: the inputs of an instruction are in lower slots, walking the program backwards pushes the weight
+// of every slot down to its inputs before they are visited
+void BlendTree::calculate_state_weights(u32 joint, f32 *state_weights) {
+
+    ASSERT(num_instructions > 0);
+    memset(state_weights, 0, sizeof(f32)*set->num_states);
+    memset(slot_weights, 0, sizeof(f32)*num_instructions);
+    slot_weights[num_instructions - 1] = 1;
+
+    for(u32 slot = num_instructions; slot-- > 0;) {
+        BlendInstruction *instruction = program + slot;
+        f32 weight = slot_weights[slot];
+        if(weight <= 0) continue;
+
+        switch(instruction->op) {
+            case BLEND_OP_SAMPLE: {
+                state_weights[instruction->state] += weight;
+            } break;
+            case BLEND_OP_LERP: {
+                f32 parameter = CLAMP(parameters[instruction->parameter], 0.0f, 1.0f);
+                slot_weights[instruction->a] += weight*(1 - parameter);
+                slot_weights[instruction->b] += weight*parameter;
+            } break;
+            case BLEND_OP_ADDITIVE: {
+                slot_weights[instruction->a] += weight;
+            } break;
+            case BLEND_OP_MASK: {
+                bool masked = joint >= instruction->mask_first_joint &&
+                    joint < instruction->mask_first_joint + instruction->mask_num_joints;
+                f32 parameter = masked ? CLAMP(parameters[instruction->parameter], 0.0f, 1.0f) : 0;
+                slot_weights[instruction->a] += weight*(1 - parameter);
+                slot_weights[instruction->b] += weight*parameter;
+            } break;
+            case BLEND_OP_BLEND_SPACE: {
+                f32 x = parameters[instruction->parameter];
+                f32 y = instruction->space->dimensions == 2 ? parameters[instruction->parameter_y] : 0;
+                AnimationHandle clips[BLEND_SPACE_MAX_CLIPS];
+                f32 weights[BLEND_SPACE_MAX_CLIPS];
+                u32 num_clips = instruction->space->find_clips(x, y, clips, weights);
+                f32 total_weight = 0;
+                for(u32 clip_index = 0; clip_index < num_clips; ++clip_index) {
+                    total_weight += weights[clip_index];
+                }
+                if(total_weight <= 0) break;
+                for(u32 clip_index = 0; clip_index < num_clips; ++clip_index) {
+                    state_weights[clips[clip_index].index] += weight*weights[clip_index] / total_weight;
+                }
+            } break;
+        }
+    }
+}
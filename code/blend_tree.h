@@ -0,0 +1,133 @@
+#ifndef _BLEND_TREE_H_
+#define _BLEND_TREE_H_
+
+#include "common.h"
+#include "animation.h"
+#include "blend_space.h"
+
+// NOTE: A blend tree is described with nodes and compiled into a linear program. Every instruction
+// writes the pose of one node into its own slot of the pose stack, the slots keep the result of the
+// last frame so the nodes whose inputs did not change are not evaluated again.
+// The clip nodes sample the states of the AnimationSet, their clocks advance with AnimationSet::update
+// (the states must be playing)
+
+#define BLEND_TREE_INVALID_NODE 0xFFFFFFFF
+
+enum BlendNodeType {
+    BLEND_NODE_CLIP,
+    // NOTE: mix(a, b, parameter)
+    BLEND_NODE_LERP,
+    // NOTE: a + parameter*(b - bind pose), b is a full pose played on top of a. When b is the clip node of
+    // an ANIMATION_CLIP_ADDITIVE clip its poses are already deltas, a + parameter*b
+    BLEND_NODE_ADDITIVE,
+    // NOTE: mix(a, b, parameter) only for the hierarchy of mask_root
+    BLEND_NODE_MASK,
+    // NOTE: the (at most 3) clips of the triangle of the blend space that contains (parameter, parameter_y)
+    BLEND_NODE_BLEND_SPACE,
+};
+
+struct BlendNode {
+    BlendNodeType type;
+    u32 inputs[2];
+    u32 parameter;
+    AnimationHandle clip;
+    JointHandle mask_root;
+    BlendSpace *space;
+    u32 parameter_y;
+};
+
+enum BlendOp {
+    BLEND_OP_SAMPLE,
+    BLEND_OP_LERP,
+    BLEND_OP_ADDITIVE,
+    BLEND_OP_MASK,
+    BLEND_OP_BLEND_SPACE,
+};
+
+// NOTE: a and b are slots of the pose stack, the destination slot is the index of the instruction
+struct BlendInstruction {
+    BlendOp op;
+    u32 a;
+    u32 b;
+    u32 parameter;
+    u32 state;
+    // NOTE: hierarchy of the mask root, it is a contiguous range of joints
+    u32 mask_first_joint;
+    u32 mask_num_joints;
+    // NOTE: BLEND_OP_ADDITIVE, b is a delta pose
+    bool delta;
+    BlendSpace *space;
+    u32 parameter_y;
+
+    // NOTE: inputs of the last evaluation, the slot is valid until one of them changes
+    bool valid;
+    f32 cached_time;
+    f32 cached_parameter;
+    f32 cached_parameter_y;
+    // NOTE: clips of the blend space and their clocks at the last evaluation
+    u32 num_cached_clips;
+    AnimationHandle cached_clips[BLEND_SPACE_MAX_CLIPS];
+    f32 cached_clip_times[BLEND_SPACE_MAX_CLIPS];
+};
+
+struct BlendTreeStats {
+    u32 evaluated_instructions;
+    u32 reused_instructions;
+};
+
+struct BlendTree {
+
+    // NOTE: description
+    BlendNode *nodes;
+    u32 num_nodes;
+    u32 max_nodes;
+
+    f32 *parameters;
+    u32 num_parameters;
+    u32 max_parameters;
+
+    // NOTE: compiled program
+    BlendInstruction *program;
+    u32 num_instructions;
+    // NOTE: the slots are JointPose arrays, not PoseLanes. The samplers, the additive and mask ops and
+    // the result work per joint, so every LERP, MASK and BLEND_SPACE op pays the transposes of pose_mix,
+    // about 10-20 ns per joint on top of the kernel (benchmark kernels, pose_mix against pose_lanes_mix)
+    JointPose *pose_stack;
+    bool *changed;
+    // NOTE: weight of every slot in the result, used by calculate_state_weights
+    f32 *slot_weights;
+    // NOTE: one pose used to sample the clips of the blend spaces and for the deltas of the additive ops
+    JointPose *scratch_pose;
+
+    AnimationSet *set;
+    BlendTreeStats stats;
+
+    void initialize(u32 max_nodes, u32 max_parameters);
+    void terminate(void);
+
+    u32 add_parameter(f32 value);
+    void set_parameter(u32 parameter, f32 value);
+
+    u32 add_clip(AnimationHandle clip);
+    u32 add_lerp(u32 a, u32 b, u32 parameter);
+    u32 add_additive(u32 base, u32 additive, u32 parameter);
+    u32 add_mask(u32 base, u32 masked, JointHandle mask_root, u32 parameter);
+    // NOTE: the space must be built, parameter_y is ignored by 1D spaces
+    u32 add_blend_space(BlendSpace *space, u32 parameter_x, u32 parameter_y);
+
+    // NOTE: only the nodes reachable from root are compiled, all the memory used by evaluate is allocated here
+    void compile(AnimationSet *animation_set, u32 root);
+    void evaluate(JointPose *result);
+    // NOTE: weight of every state of the set in the result of the tree at joint, with the current parameters.
+    // The additive inputs add no weight, the weights of the clips sum to one
+    void calculate_state_weights(u32 joint, f32 *state_weights);
+
+private:
+
+    u32 add_node(BlendNodeType type, u32 a, u32 b, u32 parameter);
+    u32 compile_node(u32 node_index, u32 *node_slots);
+    JointPose *get_slot(u32 slot);
+
+};
+
+#endif // _BLEND_TREE_H_
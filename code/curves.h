@@ -0,0 +1,23 @@
+#ifndef _CURVES_H_
+#define _CURVES_H_
+
+#include "common.h"
+
+/* NOTE: weights of the cubic curves shared by the runtime (v3_cubic and q4_cubic in algebra.h)
+   and the exporter, which checks the error of the curves the runtime will evaluate. Plain C++,
+   the exporter also builds with msvc */
+
+static inline void hermite_weights(f32 t, f32 *h00, f32 *h10, f32 *h01, f32 *h11) {
+    f32 t2 = t*t;
+    f32 t3 = t2*t;
+    *h00 = 2*t3 - 3*t2 + 1;
+    *h10 = t3 - 2*t2 + t;
+    *h01 = -2*t3 + 3*t2;
+    *h11 = t3 - t2;
+}
+
+static inline f32 catmull_rom_tangent_scale(f32 d0, f32 d1) {
+    return (d0 + d1) > 0 ? d1 / (d0 + d1) : 0;
+}
+
+#endif // _CURVES_H_
@@ -1,10 +1,13 @@
 #include "common.h"
+#include "curves.h"
 #include <assimp/anim.h>
 #include <assimp/matrix4x4.h>
 #include <assimp/types.h>
 #include <cstring>
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -18,6 +21,23 @@
 #define TWEEN_MODEL      (1 << 0)
 #define TWEEN_SKELETON   (1 << 1)
 #define TWEEN_ANIMATIONS (1 << 2)
+// NOTE: the model file ends with the skinning palette, the bone ids of the vertices are palette slots
+#define TWEEN_SKINNING_PALETTE (1 << 3)
+// NOTE: MAX_BONES of the vertex shaders
+#define MAX_PALETTE_SLOTS 100
+
+#define TWEEN_CLIP_UNIFORM   (1 << 0)
+#define TWEEN_CLIP_QUANTIZED (1 << 1)
+#define TWEEN_CLIP_SPARSE    (1 << 2)
+#define TWEEN_CLIP_CUBIC     (1 << 3)
+#define TWEEN_CLIP_ADDITIVE  (1 << 4)
+#define TWEEN_CLIP_MARKERS   (1 << 5)
+#define TWEEN_CLIP_ROOT_MOTION (1 << 6)
+
+#define TWEEN_MAX_QUANTIZE_BITS 16
+#define TWEEN_CONSTANT_EPSILON 1e-5f
+/* NOTE: a foot is in contact when its height is in the lowest 10% of its range */
+#define TWEEN_CONTACT_THRESHOLD 0.1f
 
 static void write_key_frame(unsigned int id, aiVectorKey position_key, aiQuatKey rotation_key, aiVectorKey scaling_key, FILE* file) {
     assert(position_key.mTime == rotation_key.mTime && position_key.mTime == rotation_key.mTime);
@@ -42,6 +62,99 @@ static void write_key_frame(unsigned int id, aiVectorKey position_key, aiQuatKey
 
 }
 
+/* -------------------------------------------------------------------------- */
+/*                            Quantized key frames                            */
+/* -------------------------------------------------------------------------- */
+
+struct BitWriter {
+    unsigned long long bits;
+    unsigned int num_bits;
+    unsigned int bytes_written;
+    FILE *file;
+};
+
+static void bit_writer_write(BitWriter *writer, unsigned int value, unsigned int num_bits) {
+    assert(num_bits <= 32);
+    writer->bits |= ((unsigned long long)value) << writer->num_bits;
+    writer->num_bits += num_bits;
+    while(writer->num_bits >= 8) {
+        unsigned char byte = (unsigned char)(writer->bits & 0xff);
+        fwrite(&byte, sizeof(unsigned char), 1, writer->file);
+        writer->bits >>= 8;
+        writer->num_bits -= 8;
+        ++writer->bytes_written;
+    }
+}
+
+/* NOTE: every key frame starts byte aligned */
+static void bit_writer_flush(BitWriter *writer) {
+    if(writer->num_bits > 0) {
+        bit_writer_write(writer, 0, 8 - writer->num_bits);
+    }
+}
+
+static unsigned int quantize_unorm(float value, unsigned int num_bits) {
+    unsigned int max_value = (1u << num_bits) - 1;
+    float clamped = value < 0 ? 0 : (value > 1 ? 1 : value);
+    return (unsigned int)(clamped*max_value + 0.5f);
+}
+
+/* NOTE: smallest three encoding, the largest component is dropped (and made positive) and
+   the other three are in the range [-1/sqrt(2), 1/sqrt(2)] */
+static void write_quantized_rotation(BitWriter *writer, aiQuaternion q, unsigned int num_bits) {
+    float components[4] = {q.w, q.x, q.y, q.z};
+    float length = sqrtf(q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z);
+    unsigned int largest_index = 0;
+    for(unsigned int i = 0; i < 4; ++i) {
+        components[i] /= length;
+        if(fabsf(components[i]) > fabsf(components[largest_index])) {
+            largest_index = i;
+        }
+    }
+    float sign = components[largest_index] < 0 ? -1.0f : 1.0f;
+    
+    bit_writer_write(writer, largest_index, 2);
+    for(unsigned int i = 0; i < 4; ++i) {
+        if(i == largest_index) continue;
+        float value = (components[i]*sign + (float)M_SQRT1_2) / (float)M_SQRT2;
+        bit_writer_write(writer, quantize_unorm(value, num_bits), num_bits);
+    }
+}
+
+struct TrackRange {
+    aiVector3D position_min;
+    aiVector3D position_extent;
+    aiVector3D scale_min;
+    aiVector3D scale_extent;
+};
+
+static void write_quantized_v3(BitWriter *writer, aiVector3D value, aiVector3D min, aiVector3D extent, unsigned int num_bits) {
+    bit_writer_write(writer, quantize_unorm(extent.x > 0 ? (value.x - min.x) / extent.x : 0, num_bits), num_bits);
+    bit_writer_write(writer, quantize_unorm(extent.y > 0 ? (value.y - min.y) / extent.y : 0, num_bits), num_bits);
+    bit_writer_write(writer, quantize_unorm(extent.z > 0 ? (value.z - min.z) / extent.z : 0, num_bits), num_bits);
+}
+
+static void calculate_vector_range(aiVectorKey *keys, unsigned int num_keys, aiVector3D *min, aiVector3D *extent) {
+    aiVector3D max = keys[0].mValue;
+    *min = keys[0].mValue;
+    for(unsigned int key_index = 1; key_index < num_keys; ++key_index) {
+        aiVector3D value = keys[key_index].mValue;
+        min->x = value.x < min->x ? value.x : min->x;
+        min->y = value.y < min->y ? value.y : min->y;
+        min->z = value.z < min->z ? value.z : min->z;
+        max.x = value.x > max.x ? value.x : max.x;
+        max.y = value.y > max.y ? value.y : max.y;
+        max.z = value.z > max.z ? value.z : max.z;
+    }
+    *extent = max - *min;
+}
+
+static void write_vector3(aiVector3D vector, FILE *file) {
+    fwrite(&vector.x, sizeof(float), 1, file);
+    fwrite(&vector.y, sizeof(float), 1, file);
+    fwrite(&vector.z, sizeof(float), 1, file);
+}
+
 static void write_string(aiString string, FILE *file) {
     fwrite(&string.length, sizeof(unsigned int), 1, file);
     fwrite(string.data, sizeof(char), string.length, file);
@@ -250,7 +363,749 @@ static unsigned int calculate_alctual_number_of_channels(aiNode *root_node, aiAn
     return num_of_channels_counter;
 }
 
-void write_animation(const aiScene *scene, FILE *file, const char *animation_name) {
+static bool is_uniformly_sampled(aiAnimation *animation, unsigned int num_keyframes, float *key_delta) {
+    
+    *key_delta = 0;
+    if(num_keyframes < 2) return false;
+
+    float delta = (animation->mChannels[0]->mPositionKeys[1].mTime - animation->mChannels[0]->mPositionKeys[0].mTime) / 1000.0f;
+    if(delta <= 0) return false;
+
+    /* NOTE: every key of every channel must be at first_time + key_index * delta */
+    float epsilon = delta * 0.001f;
+    for(unsigned int channel_index = 0; channel_index < animation->mNumChannels; ++channel_index) {
+        aiNodeAnim *node = animation->mChannels[channel_index];
+        float first_time = node->mPositionKeys[0].mTime / 1000.0f;
+        for(unsigned int keyframe_index = 0; keyframe_index < num_keyframes; ++keyframe_index) {
+            float time = node->mPositionKeys[keyframe_index].mTime / 1000.0f;
+            float expected = first_time + keyframe_index * delta;
+            if(fabsf(time - expected) > epsilon) return false;
+        }
+    }
+
+    *key_delta = delta;
+    return true;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            Key frame reduction                             */
+/* -------------------------------------------------------------------------- */
+
+/* NOTE: max bind pose distance from the node to any of its descendants */
+static float calculate_node_reach(aiNode *node) {
+    float reach = 0;
+    for(unsigned int i = 0; i < node->mNumChildren; ++i) {
+        aiNode *child = node->mChildren[i];
+        aiMatrix4x4 m = child->mTransformation;
+        float length = sqrtf(m.a4*m.a4 + m.b4*m.b4 + m.c4*m.c4);
+        float child_reach = length + calculate_node_reach(child);
+        reach = child_reach > reach ? child_reach : reach;
+    }
+    return reach;
+}
+
+static unsigned int calculate_node_depth(aiNode *node) {
+    unsigned int depth = 0;
+    for(unsigned int i = 0; i < node->mNumChildren; ++i) {
+        unsigned int child_depth = calculate_node_depth(node->mChildren[i]);
+        depth = child_depth > depth ? child_depth : depth;
+    }
+    return depth + 1;
+}
+
+static float rotation_angle_between(aiQuaternion a, aiQuaternion b) {
+    /* NOTE: angle of conjugate(a)*b, atan2 keeps the precision for small angles */
+    aiQuaternion delta = a.Conjugate() * b;
+    float vector_length = sqrtf(delta.x*delta.x + delta.y*delta.y + delta.z*delta.z);
+    return 2.0f*atan2f(vector_length, fabsf(delta.w));
+}
+
+/* NOTE: greedy reduction, a key is dropped while the lerp between the last kept key and the
+   candidate key reproduce all the keys in between. error_scale converts the difference in
+   the key value to a displacement of the virtual vertex */
+static unsigned int reduce_vector_keys(aiVectorKey *keys, unsigned int num_keys, float tolerance, float error_scale, bool *keep) {
+    
+    for(unsigned int key_index = 0; key_index < num_keys; ++key_index) {
+        keep[key_index] = false;
+    }
+    keep[0] = true;
+    keep[num_keys - 1] = true;
+    
+    unsigned int start = 0;
+    for(unsigned int end = 2; end < num_keys; ++end) {
+        for(unsigned int key_index = start + 1; key_index < end; ++key_index) {
+            float t = (float)((keys[key_index].mTime - keys[start].mTime) / (keys[end].mTime - keys[start].mTime));
+            aiVector3D value = keys[start].mValue*(1 - t) + keys[end].mValue*t;
+            if((value - keys[key_index].mValue).Length()*error_scale > tolerance) {
+                keep[end - 1] = true;
+                start = end - 1;
+                break;
+            }
+        }
+    }
+
+    unsigned int num_kept = 0;
+    for(unsigned int key_index = 0; key_index < num_keys; ++key_index) {
+        num_kept += keep[key_index] ? 1 : 0;
+    }
+    return num_kept;
+}
+
+static unsigned int reduce_quat_keys(aiQuatKey *keys, unsigned int num_keys, float tolerance, float reach, bool *keep) {
+    
+    for(unsigned int key_index = 0; key_index < num_keys; ++key_index) {
+        keep[key_index] = false;
+    }
+    keep[0] = true;
+    keep[num_keys - 1] = true;
+    
+    unsigned int start = 0;
+    for(unsigned int end = 2; end < num_keys; ++end) {
+        for(unsigned int key_index = start + 1; key_index < end; ++key_index) {
+            float t = (float)((keys[key_index].mTime - keys[start].mTime) / (keys[end].mTime - keys[start].mTime));
+            aiQuaternion value;
+            aiQuaternion::Interpolate(value, keys[start].mValue, keys[end].mValue, t);
+            /* NOTE: a rotation error of angle a moves a vertex at distance r by 2*r*sin(a/2) */
+            float angle = rotation_angle_between(value, keys[key_index].mValue);
+            if(2.0f*reach*sinf(angle*0.5f) > tolerance) {
+                keep[end - 1] = true;
+                start = end - 1;
+                break;
+            }
+        }
+    }
+
+    unsigned int num_kept = 0;
+    for(unsigned int key_index = 0; key_index < num_keys; ++key_index) {
+        num_kept += keep[key_index] ? 1 : 0;
+    }
+    return num_kept;
+}
+
+/* NOTE: a component is constant when every key is within TWEEN_CONSTANT_EPSILON of the first one,
+   constant components are stored with a single key, and with none if the key is the bind pose */
+static bool vector_keys_are_constant(aiVectorKey *keys, unsigned int num_keys) {
+    for(unsigned int key_index = 1; key_index < num_keys; ++key_index) {
+        if((keys[key_index].mValue - keys[0].mValue).Length() > TWEEN_CONSTANT_EPSILON) return false;
+    }
+    return true;
+}
+
+static bool quat_keys_are_constant(aiQuatKey *keys, unsigned int num_keys) {
+    for(unsigned int key_index = 1; key_index < num_keys; ++key_index) {
+        if(rotation_angle_between(keys[0].mValue, keys[key_index].mValue) > TWEEN_CONSTANT_EPSILON) return false;
+    }
+    return true;
+}
+
+static unsigned int keep_single_key(bool *keep, unsigned int num_keys, bool is_bind_pose) {
+    for(unsigned int key_index = 0; key_index < num_keys; ++key_index) {
+        keep[key_index] = false;
+    }
+    if(is_bind_pose) return 0;
+    keep[0] = true;
+    return 1;
+}
+
+static unsigned int keep_all_keys(bool *keep, unsigned int num_keys) {
+    for(unsigned int key_index = 0; key_index < num_keys; ++key_index) {
+        keep[key_index] = true;
+    }
+    return num_keys;
+}
+
+static void write_sparse_vector_keys(aiVectorKey *keys, bool *keep, unsigned int num_keys, unsigned int num_kept, FILE *file) {
+    fwrite(&num_kept, sizeof(unsigned int), 1, file);
+    for(unsigned int key_index = 0; key_index < num_keys; ++key_index) {
+        if(!keep[key_index]) continue;
+        float time = keys[key_index].mTime / 1000.0f;
+        fwrite(&time, sizeof(float), 1, file);
+        write_vector3(keys[key_index].mValue, file);
+    }
+}
+
+static void write_sparse_quat_keys(aiQuatKey *keys, bool *keep, unsigned int num_keys, unsigned int num_kept, FILE *file) {
+    fwrite(&num_kept, sizeof(unsigned int), 1, file);
+    for(unsigned int key_index = 0; key_index < num_keys; ++key_index) {
+        if(!keep[key_index]) continue;
+        float time = keys[key_index].mTime / 1000.0f;
+        fwrite(&time, sizeof(float), 1, file);
+        fwrite(&keys[key_index].mValue.w, sizeof(float), 1, file);
+        fwrite(&keys[key_index].mValue.x, sizeof(float), 1, file);
+        fwrite(&keys[key_index].mValue.y, sizeof(float), 1, file);
+        fwrite(&keys[key_index].mValue.z, sizeof(float), 1, file);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            Cubic decimation                                */
+/* -------------------------------------------------------------------------- */
+
+/* NOTE: same curves as v3_cubic and q4_cubic in algebra.h, with the weights of curves.h. The
+   runtime must reconstruct exactly what the error check measured */
+static aiVector3D cubic_vector(aiVector3D p0, aiVector3D p1, aiVector3D p2, aiVector3D p3, float d0, float d1, float d2, float t) {
+    aiVector3D m1 = (p2 - p0)*catmull_rom_tangent_scale(d0, d1);
+    aiVector3D m2 = (p3 - p1)*catmull_rom_tangent_scale(d2, d1);
+    float h00, h10, h01, h11;
+    hermite_weights(t, &h00, &h10, &h01, &h11);
+    return p1*h00 + m1*h10 + p2*h01 + m2*h11;
+}
+
+static aiQuaternion align_quat(aiQuaternion q, aiQuaternion reference) {
+    float cos_omega = q.w*reference.w + q.x*reference.x + q.y*reference.y + q.z*reference.z;
+    if(cos_omega < 0) {
+        q.w = -q.w;
+        q.x = -q.x;
+        q.y = -q.y;
+        q.z = -q.z;
+    }
+    return q;
+}
+
+static aiQuaternion cubic_quat(aiQuaternion q0, aiQuaternion q1, aiQuaternion q2, aiQuaternion q3, float d0, float d1, float d2, float t) {
+    q0 = align_quat(q0, q1);
+    q2 = align_quat(q2, q1);
+    q3 = align_quat(q3, q2);
+    float s1 = catmull_rom_tangent_scale(d0, d1);
+    float s2 = catmull_rom_tangent_scale(d2, d1);
+    float h00, h10, h01, h11;
+    hermite_weights(t, &h00, &h10, &h01, &h11);
+    aiQuaternion result;
+    result.w = q1.w*h00 + (q2.w - q0.w)*s1*h10 + q2.w*h01 + (q3.w - q1.w)*s2*h11;
+    result.x = q1.x*h00 + (q2.x - q0.x)*s1*h10 + q2.x*h01 + (q3.x - q1.x)*s2*h11;
+    result.y = q1.y*h00 + (q2.y - q0.y)*s1*h10 + q2.y*h01 + (q3.y - q1.y)*s2*h11;
+    result.z = q1.z*h00 + (q2.z - q0.z)*s1*h10 + q2.z*h01 + (q3.z - q1.z)*s2*h11;
+    return result.Normalize();
+}
+
+/* NOTE: keep every step-th key and the last one */
+static unsigned int select_decimated_keys(unsigned int num_keyframes, unsigned int step, unsigned int *key_indices) {
+    unsigned int num_keys = 0;
+    for(unsigned int keyframe_index = 0; keyframe_index < num_keyframes; keyframe_index += step) {
+        key_indices[num_keys++] = keyframe_index;
+    }
+    if(num_keys > 0 && key_indices[num_keys - 1] != num_keyframes - 1) {
+        key_indices[num_keys++] = num_keyframes - 1;
+    }
+    return num_keys;
+}
+
+/* NOTE: check that the cubic curves through the selected keys reproduce every source key,
+   with the same virtual vertex error as the key reduction */
+static bool decimated_keys_within_tolerance(aiNode *root_node, aiAnimation *animation, unsigned int *key_indices, unsigned int num_keys, float joint_tolerance, float vertex_distance) {
+    
+    for(unsigned int bone_index = 0; bone_index < animation->mNumChannels; ++bone_index) {
+
+        aiNodeAnim *node = animation->mChannels[bone_index];
+        int id = find_bone_id(root_node, node->mNodeName);
+        if(id == -1) continue;
+
+        aiNode *bone = find_bone(root_node, node->mNodeName);
+        float reach = vertex_distance + calculate_node_reach(bone);
+
+        for(unsigned int key_index = 0; key_index + 1 < num_keys; ++key_index) {
+            unsigned int k0 = key_indices[key_index > 0 ? key_index - 1 : key_index];
+            unsigned int k1 = key_indices[key_index];
+            unsigned int k2 = key_indices[key_index + 1];
+            unsigned int k3 = key_indices[key_index + 2 < num_keys ? key_index + 2 : key_index + 1];
+
+            float t0 = (float)node->mPositionKeys[k0].mTime;
+            float t1 = (float)node->mPositionKeys[k1].mTime;
+            float t2 = (float)node->mPositionKeys[k2].mTime;
+            float t3 = (float)node->mPositionKeys[k3].mTime;
+
+            for(unsigned int source_index = k1 + 1; source_index < k2; ++source_index) {
+                float t = ((float)node->mPositionKeys[source_index].mTime - t1) / (t2 - t1);
+
+                aiVector3D position = cubic_vector(node->mPositionKeys[k0].mValue, node->mPositionKeys[k1].mValue, node->mPositionKeys[k2].mValue, node->mPositionKeys[k3].mValue, t1 - t0, t2 - t1, t3 - t2, t);
+                if((position - node->mPositionKeys[source_index].mValue).Length() > joint_tolerance) return false;
+
+                aiQuaternion rotation = cubic_quat(node->mRotationKeys[k0].mValue, node->mRotationKeys[k1].mValue, node->mRotationKeys[k2].mValue, node->mRotationKeys[k3].mValue, t1 - t0, t2 - t1, t3 - t2, t);
+                float angle = rotation_angle_between(rotation, node->mRotationKeys[source_index].mValue);
+                if(2.0f*reach*sinf(angle*0.5f) > joint_tolerance) return false;
+
+                /* NOTE: the scales stay linear at runtime */
+                aiVector3D scale = node->mScalingKeys[k1].mValue*(1 - t) + node->mScalingKeys[k2].mValue*t;
+                if((scale - node->mScalingKeys[source_index].mValue).Length()*reach > joint_tolerance) return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* NOTE: find the largest key step that stays within the tolerance, return the number of keys kept */
+static unsigned int decimate_key_frames(aiNode *root_node, aiAnimation *animation, unsigned int num_keyframes, float tolerance, float vertex_distance, unsigned int *key_indices, unsigned int *step) {
+
+    unsigned int depth = calculate_node_depth(root_node);
+    float joint_tolerance = tolerance / (float)depth;
+    
+    unsigned int *candidate = (unsigned int *)malloc(sizeof(unsigned int)*num_keyframes);
+    unsigned int num_keys = select_decimated_keys(num_keyframes, 1, key_indices);
+    *step = 1;
+
+    for(unsigned int candidate_step = 2; candidate_step < num_keyframes; ++candidate_step) {
+        unsigned int num_candidate_keys = select_decimated_keys(num_keyframes, candidate_step, candidate);
+        if(!decimated_keys_within_tolerance(root_node, animation, candidate, num_candidate_keys, joint_tolerance, vertex_distance)) break;
+        memcpy(key_indices, candidate, sizeof(unsigned int)*num_candidate_keys);
+        num_keys = num_candidate_keys;
+        *step = candidate_step;
+    }
+
+    free(candidate);
+    printf("Cubic decimation tolerance: %f, step: %d, %d of %d key frames kept\n", tolerance, *step, num_keys, num_keyframes);
+    return num_keys;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            Sync markers                                    */
+/* -------------------------------------------------------------------------- */
+
+static aiNodeAnim *find_channel(aiAnimation *animation, aiString name) {
+    for(unsigned int channel_index = 0; channel_index < animation->mNumChannels; ++channel_index) {
+        if(animation->mChannels[channel_index]->mNodeName == name) {
+            return animation->mChannels[channel_index];
+        }
+    }
+    return nullptr;
+}
+
+/* NOTE: local transform of the node at a key frame, the nodes without channel keep their transformation */
+static aiMatrix4x4 key_transform(aiNode *node, aiAnimation *animation, unsigned int key_index) {
+    aiNodeAnim *channel = find_channel(animation, node->mName);
+    if(channel == nullptr || channel->mNumPositionKeys == 0 || channel->mNumRotationKeys == 0 || channel->mNumScalingKeys == 0) {
+        return node->mTransformation;
+    }
+    aiVector3D position = channel->mPositionKeys[key_index < channel->mNumPositionKeys ? key_index : channel->mNumPositionKeys - 1].mValue;
+    aiQuaternion rotation = channel->mRotationKeys[key_index < channel->mNumRotationKeys ? key_index : channel->mNumRotationKeys - 1].mValue;
+    aiVector3D scale = channel->mScalingKeys[key_index < channel->mNumScalingKeys ? key_index : channel->mNumScalingKeys - 1].mValue;
+    return aiMatrix4x4(scale, rotation, position);
+}
+
+/* NOTE: height (y) of the joint in the space of the parent of the root node */
+static float joint_height(aiNode *root_node, aiNode *joint, aiAnimation *animation, unsigned int key_index) {
+    aiMatrix4x4 transform;
+    for(aiNode *node = joint; node != nullptr; node = node->mParent) {
+        transform = key_transform(node, animation, key_index) * transform;
+        if(node == root_node) break;
+    }
+    return transform.b4;
+}
+
+/* NOTE: a contact starts at the key where the height of the joint goes below the threshold, the clip
+   is a loop so the key before the first one is the one before the last (the last key repeats the first) */
+static unsigned int find_contact_markers(aiNode *root_node, aiNode *joint, aiAnimation *animation, unsigned int num_keyframes, float *markers) {
+    
+    if(num_keyframes < 3) return 0;
+
+    float *heights = (float *)malloc(sizeof(float)*num_keyframes);
+    float min_height = 0;
+    float max_height = 0;
+    for(unsigned int key_index = 0; key_index < num_keyframes; ++key_index) {
+        heights[key_index] = joint_height(root_node, joint, animation, key_index);
+        min_height = key_index == 0 || heights[key_index] < min_height ? heights[key_index] : min_height;
+        max_height = key_index == 0 || heights[key_index] > max_height ? heights[key_index] : max_height;
+    }
+    float threshold = min_height + (max_height - min_height)*TWEEN_CONTACT_THRESHOLD;
+
+    unsigned int num_markers = 0;
+    if(max_height - min_height > TWEEN_CONSTANT_EPSILON) {
+        for(unsigned int key_index = 0; key_index < num_keyframes - 1; ++key_index) {
+            float prev_height = heights[key_index > 0 ? key_index - 1 : num_keyframes - 2];
+            if(heights[key_index] <= threshold && prev_height > threshold) {
+                markers[num_markers++] = animation->mChannels[0]->mPositionKeys[key_index].mTime / 1000.0f;
+            }
+        }
+    }
+
+    free(heights);
+    return num_markers;
+}
+
+static unsigned int find_sync_markers(aiNode *root_node, aiAnimation *animation, unsigned int num_keyframes, const char **joint_names, unsigned int num_joints, float *markers) {
+    
+    unsigned int num_markers = 0;
+    for(unsigned int joint_index = 0; joint_index < num_joints; ++joint_index) {
+        aiNode *joint = find_bone(root_node, aiString(joint_names[joint_index]));
+        if(joint == nullptr) {
+            printf("Marker joint not found: %s\n", joint_names[joint_index]);
+            continue;
+        }
+        num_markers += find_contact_markers(root_node, joint, animation, num_keyframes, markers + num_markers);
+    }
+
+    /* NOTE: the markers of all the joints sorted by time */
+    for(unsigned int marker_index = 1; marker_index < num_markers; ++marker_index) {
+        float marker = markers[marker_index];
+        unsigned int insert_index = marker_index;
+        while(insert_index > 0 && markers[insert_index - 1] > marker) {
+            markers[insert_index] = markers[insert_index - 1];
+            --insert_index;
+        }
+        markers[insert_index] = marker;
+    }
+    return num_markers;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            Root motion                                     */
+/* -------------------------------------------------------------------------- */
+
+struct RootMotionKey {
+    float time;
+    aiVector3D translation;
+    float yaw;
+};
+
+/* NOTE: linear interpolation of the keys at time, next is the first key after time. Clamped to the
+   first and the last key */
+static aiVector3D sample_vector_keys(aiVectorKey *keys, unsigned int num_keys, unsigned int next, double time) {
+    if(next == 0) return keys[0].mValue;
+    if(next == num_keys) return keys[num_keys - 1].mValue;
+    aiVectorKey *a = keys + next - 1;
+    aiVectorKey *b = keys + next;
+    float t = (float)((time - a->mTime) / (b->mTime - a->mTime));
+    return a->mValue + (b->mValue - a->mValue)*t;
+}
+
+static float sample_yaw_keys(aiQuatKey *keys, float *yaws, unsigned int num_keys, unsigned int next, double time) {
+    if(next == 0) return yaws[0];
+    if(next == num_keys) return yaws[num_keys - 1];
+    float t = (float)((time - keys[next - 1].mTime) / (keys[next].mTime - keys[next - 1].mTime));
+    return yaws[next - 1] + (yaws[next] - yaws[next - 1])*t;
+}
+
+/* NOTE: move the horizontal translation (x, z) and the yaw of the joint relative to the first key into
+   a separate track, the channel keeps the height and the rest of the rotation. Every position and rotation
+   key is stripped, the channels can have different numbers of keys. The track has a key at every time
+   of either channel, the other channel is interpolated there. keys must hold the keys of both channels.
+   Return the number of keys */
+static unsigned int extract_root_motion(aiNodeAnim *node, RootMotionKey *keys) {
+    
+    unsigned int num_positions = node->mNumPositionKeys;
+    unsigned int num_rotations = node->mNumRotationKeys;
+    if(num_positions == 0 || num_rotations == 0) return 0;
+    aiVectorKey *positions = node->mPositionKeys;
+    aiQuatKey *rotations = node->mRotationKeys;
+
+    aiVector3D start_position = positions[0].mValue;
+    aiQuaternion inv_start_rotation = rotations[0].mValue;
+    inv_start_rotation.Conjugate();
+
+    /* NOTE: yaw of the rotation from the first key, from the direction of the rotated z axis.
+       The difference with the last key is wrapped to [-pi, pi] so the track is continuous */
+    float *raw_yaws = (float *)malloc(sizeof(float)*num_rotations);
+    float *yaws = (float *)malloc(sizeof(float)*num_rotations);
+    float prev_raw_yaw = 0;
+    float yaw = 0;
+    for(unsigned int key_index = 0; key_index < num_rotations; ++key_index) {
+        aiQuaternion delta = rotations[key_index].mValue * inv_start_rotation;
+        aiVector3D forward = delta.Rotate(aiVector3D(0, 0, 1));
+        float raw_yaw = atan2f(forward.x, forward.z);
+        float step = raw_yaw - prev_raw_yaw;
+        while(step > (float)M_PI) step -= 2*(float)M_PI;
+        while(step < -(float)M_PI) step += 2*(float)M_PI;
+        yaw += step;
+        prev_raw_yaw = raw_yaw;
+        raw_yaws[key_index] = raw_yaw;
+        yaws[key_index] = yaw;
+    }
+
+    /* NOTE: merge the key times of both channels */
+    unsigned int num_keys = 0;
+    unsigned int position_index = 0;
+    unsigned int rotation_index = 0;
+    while(position_index < num_positions || rotation_index < num_rotations) {
+        double time;
+        if(rotation_index == num_rotations ||
+           (position_index < num_positions && positions[position_index].mTime <= rotations[rotation_index].mTime)) {
+            time = positions[position_index].mTime;
+        } else {
+            time = rotations[rotation_index].mTime;
+        }
+        while(position_index < num_positions && positions[position_index].mTime <= time) ++position_index;
+        while(rotation_index < num_rotations && rotations[rotation_index].mTime <= time) ++rotation_index;
+
+        aiVector3D position = sample_vector_keys(positions, num_positions, position_index, time);
+        RootMotionKey *key = keys + num_keys++;
+        key->time = (float)time / 1000.0f;
+        key->translation = aiVector3D(position.x - start_position.x, 0, position.z - start_position.z);
+        key->yaw = sample_yaw_keys(rotations, yaws, num_rotations, rotation_index, time);
+    }
+
+    for(unsigned int key_index = 0; key_index < num_positions; ++key_index) {
+        positions[key_index].mValue.x = start_position.x;
+        positions[key_index].mValue.z = start_position.z;
+    }
+    for(unsigned int key_index = 0; key_index < num_rotations; ++key_index) {
+        aiQuaternion *rotation = &rotations[key_index].mValue;
+        *rotation = aiQuaternion(aiVector3D(0, 1, 0), -raw_yaws[key_index]) * *rotation;
+        rotation->Normalize();
+    }
+
+    free(raw_yaws);
+    free(yaws);
+    return num_keys;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            Additive clips                                  */
+/* -------------------------------------------------------------------------- */
+
+/* NOTE: replace the keys of every channel with the difference from the first key of the channel:
+   position offset, rotation in the local space of the reference (conjugate(reference)*rotation) and
+   scale ratio. The runtime applies them on top of any pose, so they are computed once here.
+   Everything after this (quantize, reduce, strip, decimate) works on the deltas */
+static void bake_additive_keys(aiAnimation *animation) {
+
+    for(unsigned int bone_index = 0; bone_index < animation->mNumChannels; ++bone_index) {
+
+        aiNodeAnim *node = animation->mChannels[bone_index];
+
+        if(node->mNumPositionKeys > 0) {
+            aiVector3D reference = node->mPositionKeys[0].mValue;
+            for(unsigned int key_index = 0; key_index < node->mNumPositionKeys; ++key_index) {
+                node->mPositionKeys[key_index].mValue -= reference;
+            }
+        }
+
+        if(node->mNumRotationKeys > 0) {
+            aiQuaternion inv_reference = node->mRotationKeys[0].mValue;
+            inv_reference.Conjugate();
+            aiQuaternion previous = aiQuaternion();
+            for(unsigned int key_index = 0; key_index < node->mNumRotationKeys; ++key_index) {
+                aiQuaternion delta = inv_reference * node->mRotationKeys[key_index].mValue;
+                /* NOTE: keep consecutive deltas in the same hemisphere so the curves do not flip */
+                node->mRotationKeys[key_index].mValue = align_quat(delta.Normalize(), previous);
+                previous = node->mRotationKeys[key_index].mValue;
+            }
+        }
+
+        if(node->mNumScalingKeys > 0) {
+            aiVector3D reference = node->mScalingKeys[0].mValue;
+            for(unsigned int key_index = 0; key_index < node->mNumScalingKeys; ++key_index) {
+                aiVector3D *scale = &node->mScalingKeys[key_index].mValue;
+                scale->x = reference.x != 0 ? scale->x / reference.x : 1;
+                scale->y = reference.y != 0 ? scale->y / reference.y : 1;
+                scale->z = reference.z != 0 ? scale->z / reference.z : 1;
+            }
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            Animations                                      */
+/* -------------------------------------------------------------------------- */
+
+struct AnimationExportOptions {
+    /* NOTE: 0 writes raw floats */
+    unsigned int quantize_bits;
+    /* NOTE: max displacement of a virtual vertex placed reduce_vertex_distance away from
+       every joint (and from its descendants), 0 disables the key reduction */
+    float reduce_tolerance;
+    float reduce_vertex_distance;
+    /* NOTE: store the constant components once and drop the ones equal to the bind pose */
+    bool strip_constant_tracks;
+    /* NOTE: keep one key every n source keys, with the largest n that the cubic curves reproduce
+       within decimate_tolerance (measured like reduce_tolerance), 0 disables the decimation */
+    float decimate_tolerance;
+    /* NOTE: store the difference from the first key instead of the pose, set per clip */
+    bool additive;
+    /* NOTE: joints (feet) used to find the contact markers of the clips, none when num_marker_joints is 0 */
+    const char *marker_joints[2];
+    unsigned int num_marker_joints;
+    /* NOTE: joint whose horizontal motion and yaw are extracted, nullptr keeps the motion in the joint */
+    const char *root_motion_joint;
+};
+
+/* NOTE: key_indices are the source keys written, all of them or the decimated ones */
+static unsigned int write_dense_key_frames(aiNode *root_node, aiAnimation *animation, unsigned int *key_indices, unsigned int num_keyframes, unsigned int num_channels, FILE *file) {
+    
+    for(unsigned int key_index = 0; key_index < num_keyframes; ++key_index) {
+
+        unsigned int keyframe_index = key_indices[key_index];
+
+        fwrite(&num_channels, sizeof(unsigned int), 1, file);
+
+        for(unsigned int bone_index = 0; bone_index < animation->mNumChannels; ++bone_index) {
+
+            aiNodeAnim *node = animation->mChannels[bone_index];
+            int id = find_bone_id(root_node, node->mNodeName);
+            if(id == -1) continue;
+            write_key_frame(id, node->mPositionKeys[keyframe_index], node->mRotationKeys[keyframe_index], node->mScalingKeys[keyframe_index], file);
+        }
+    }
+
+    return num_keyframes*(sizeof(unsigned int) + num_channels*12*sizeof(float));
+}
+
+/* NOTE: quantized clips store the track table once, with the range of every track,
+   followed by one bit packed record per key frame */
+static unsigned int write_quantized_key_frames(aiNode *root_node, aiAnimation *animation, unsigned int *key_indices, unsigned int num_keyframes, unsigned int num_channels, unsigned int quantize_bits, FILE *file) {
+
+    fwrite(&quantize_bits, sizeof(unsigned int), 1, file);
+    fwrite(&num_channels, sizeof(unsigned int), 1, file);
+    unsigned int size = 2*sizeof(unsigned int);
+
+    TrackRange *ranges = (TrackRange *)malloc(sizeof(TrackRange)*animation->mNumChannels);
+    for(unsigned int bone_index = 0; bone_index < animation->mNumChannels; ++bone_index) {
+        
+        aiNodeAnim *node = animation->mChannels[bone_index];
+        int id = find_bone_id(root_node, node->mNodeName);
+        if(id == -1) continue;
+
+        TrackRange *range = ranges + bone_index;
+        calculate_vector_range(node->mPositionKeys, node->mNumPositionKeys, &range->position_min, &range->position_extent);
+        calculate_vector_range(node->mScalingKeys, node->mNumScalingKeys, &range->scale_min, &range->scale_extent);
+
+        fwrite(&id, sizeof(unsigned int), 1, file);
+        write_vector3(range->position_min, file);
+        write_vector3(range->position_extent, file);
+        write_vector3(range->scale_min, file);
+        write_vector3(range->scale_extent, file);
+        size += sizeof(unsigned int) + 12*sizeof(float);
+    }
+
+    BitWriter writer = {};
+    writer.file = file;
+
+    for(unsigned int key_index = 0; key_index < num_keyframes; ++key_index) {
+        
+        unsigned int keyframe_index = key_indices[key_index];
+        float time = animation->mChannels[0]->mPositionKeys[keyframe_index].mTime / 1000.0f;
+        fwrite(&time, sizeof(float), 1, file);
+        size += sizeof(float);
+
+        for(unsigned int bone_index = 0; bone_index < animation->mNumChannels; ++bone_index) {
+
+            aiNodeAnim *node = animation->mChannels[bone_index];
+            int id = find_bone_id(root_node, node->mNodeName);
+            if(id == -1) continue;
+
+            TrackRange *range = ranges + bone_index;
+            write_quantized_rotation(&writer, node->mRotationKeys[keyframe_index].mValue, quantize_bits);
+            write_quantized_v3(&writer, node->mPositionKeys[keyframe_index].mValue, range->position_min, range->position_extent, quantize_bits);
+            write_quantized_v3(&writer, node->mScalingKeys[keyframe_index].mValue, range->scale_min, range->scale_extent, quantize_bits);
+        }
+
+        bit_writer_flush(&writer);
+    }
+
+    free(ranges);
+    return size + writer.bytes_written;
+}
+
+/* NOTE: sparse clips store every track with its own keys, for each component:
+   number of keys followed by (time, value) pairs. The tracks without keys are not written,
+   the runtime use the bind pose (the identity for additive clips) for the joints without track */
+static unsigned int write_sparse_tracks(aiNode *root_node, aiAnimation *animation, AnimationExportOptions *options, FILE *file) {
+    
+    /* NOTE: every joint in a chain adds its own error to the joints below it, the budget of
+       each joint is the tolerance divided by the depth of the hierarchy */
+    unsigned int depth = calculate_node_depth(root_node);
+    float joint_tolerance = options->reduce_tolerance / (float)depth;
+    if(options->reduce_tolerance > 0) {
+        printf("Key reduction tolerance: %f, vertex distance: %f, hierarchy depth: %d\n", options->reduce_tolerance, options->reduce_vertex_distance, depth);
+    }
+
+    /* NOTE: the number of tracks is patched once all the tracks are written */
+    long num_tracks_offset = ftell(file);
+    unsigned int num_tracks = 0;
+    fwrite(&num_tracks, sizeof(unsigned int), 1, file);
+    unsigned int size = sizeof(unsigned int);
+
+    unsigned int total_keys = 0;
+    unsigned int total_kept = 0;
+    unsigned int num_constant = 0;
+
+    for(unsigned int bone_index = 0; bone_index < animation->mNumChannels; ++bone_index) {
+
+        aiNodeAnim *node = animation->mChannels[bone_index];
+        int id = find_bone_id(root_node, node->mNodeName);
+        if(id == -1) continue;
+        
+        aiNode *bone = find_bone(root_node, node->mNodeName);
+        float reach = options->reduce_vertex_distance + calculate_node_reach(bone);
+
+        aiVector3D bind_scale;
+        aiQuaternion bind_rotation;
+        aiVector3D bind_position;
+        bone->mTransformation.Decompose(bind_scale, bind_rotation, bind_position);
+        /* NOTE: the additive tracks equal to the identity are the ones that do not change the pose */
+        if(options->additive) {
+            bind_scale = aiVector3D(1, 1, 1);
+            bind_rotation = aiQuaternion();
+            bind_position = aiVector3D(0, 0, 0);
+        }
+
+        bool *keep_position = (bool *)malloc(sizeof(bool)*node->mNumPositionKeys);
+        bool *keep_rotation = (bool *)malloc(sizeof(bool)*node->mNumRotationKeys);
+        bool *keep_scale = (bool *)malloc(sizeof(bool)*node->mNumScalingKeys);
+        unsigned int num_position_kept = 0;
+        unsigned int num_rotation_kept = 0;
+        unsigned int num_scale_kept = 0;
+
+        if(options->strip_constant_tracks && vector_keys_are_constant(node->mPositionKeys, node->mNumPositionKeys)) {
+            bool is_bind_pose = (node->mPositionKeys[0].mValue - bind_position).Length() <= TWEEN_CONSTANT_EPSILON;
+            num_position_kept = keep_single_key(keep_position, node->mNumPositionKeys, is_bind_pose);
+            ++num_constant;
+        } else if(options->reduce_tolerance > 0) {
+            num_position_kept = reduce_vector_keys(node->mPositionKeys, node->mNumPositionKeys, joint_tolerance, 1.0f, keep_position);
+        } else {
+            num_position_kept = keep_all_keys(keep_position, node->mNumPositionKeys);
+        }
+
+        if(options->strip_constant_tracks && quat_keys_are_constant(node->mRotationKeys, node->mNumRotationKeys)) {
+            bool is_bind_pose = rotation_angle_between(node->mRotationKeys[0].mValue, bind_rotation) <= TWEEN_CONSTANT_EPSILON;
+            num_rotation_kept = keep_single_key(keep_rotation, node->mNumRotationKeys, is_bind_pose);
+            ++num_constant;
+        } else if(options->reduce_tolerance > 0) {
+            num_rotation_kept = reduce_quat_keys(node->mRotationKeys, node->mNumRotationKeys, joint_tolerance, reach, keep_rotation);
+        } else {
+            num_rotation_kept = keep_all_keys(keep_rotation, node->mNumRotationKeys);
+        }
+
+        if(options->strip_constant_tracks && vector_keys_are_constant(node->mScalingKeys, node->mNumScalingKeys)) {
+            bool is_bind_pose = (node->mScalingKeys[0].mValue - bind_scale).Length() <= TWEEN_CONSTANT_EPSILON;
+            num_scale_kept = keep_single_key(keep_scale, node->mNumScalingKeys, is_bind_pose);
+            ++num_constant;
+        } else if(options->reduce_tolerance > 0) {
+            num_scale_kept = reduce_vector_keys(node->mScalingKeys, node->mNumScalingKeys, joint_tolerance, reach, keep_scale);
+        } else {
+            num_scale_kept = keep_all_keys(keep_scale, node->mNumScalingKeys);
+        }
+
+        total_keys += node->mNumPositionKeys + node->mNumRotationKeys + node->mNumScalingKeys;
+        total_kept += num_position_kept + num_rotation_kept + num_scale_kept;
+        
+        if(num_position_kept + num_rotation_kept + num_scale_kept > 0) {
+            fwrite(&id, sizeof(unsigned int), 1, file);
+            size += sizeof(unsigned int);
+
+            write_sparse_vector_keys(node->mPositionKeys, keep_position, node->mNumPositionKeys, num_position_kept, file);
+            size += sizeof(unsigned int) + num_position_kept*4*sizeof(float);
+            write_sparse_quat_keys(node->mRotationKeys, keep_rotation, node->mNumRotationKeys, num_rotation_kept, file);
+            size += sizeof(unsigned int) + num_rotation_kept*5*sizeof(float);
+            write_sparse_vector_keys(node->mScalingKeys, keep_scale, node->mNumScalingKeys, num_scale_kept, file);
+            size += sizeof(unsigned int) + num_scale_kept*4*sizeof(float);
+            ++num_tracks;
+        }
+
+        free(keep_position);
+        free(keep_rotation);
+        free(keep_scale);
+    }
+
+    long end_offset = ftell(file);
+    fseek(file, num_tracks_offset, SEEK_SET);
+    fwrite(&num_tracks, sizeof(unsigned int), 1, file);
+    fseek(file, end_offset, SEEK_SET);
+
+    printf("Sparse tracks: %d, constant components: %d, %d of %d keys kept\n", num_tracks, num_constant, total_kept, total_keys);
+    return size;
+}
+
+/* NOTE: return the number of bytes written for the key frames and the number of bytes the raw format uses */
+void write_animation(const aiScene *scene, FILE *file, const char *animation_name, AnimationExportOptions *options, unsigned int *size, unsigned int *raw_size) {
 
     assert(scene->mNumAnimations > 0);
     aiAnimation *animation = scene->mAnimations[0];
@@ -260,28 +1115,128 @@ void write_animation(const aiScene *scene, FILE *file, const char *animation_nam
     unsigned int num_keyframes = animation->mChannels[0]->mNumPositionKeys; 
     assert(num_keyframes == animation->mChannels[0]->mNumRotationKeys);
 
+    aiNode *root_node = find_root_node(scene);
+    unsigned int animation_num_channels = calculate_alctual_number_of_channels(root_node, animation);
+
+    float key_delta = 0;
+    unsigned int animation_flags = 0;
+    if(is_uniformly_sampled(animation, num_keyframes, &key_delta)) {
+        animation_flags |= TWEEN_CLIP_UNIFORM;
+    }
+    /* NOTE: the contacts are found in the pose, before the additive clips are baked */
+    float *markers = (float *)malloc(sizeof(float)*(num_keyframes*options->num_marker_joints + 1));
+    unsigned int num_markers = find_sync_markers(root_node, animation, num_keyframes, options->marker_joints, options->num_marker_joints, markers);
+    if(num_markers > 0) {
+        animation_flags |= TWEEN_CLIP_MARKERS;
+    }
+
+    RootMotionKey *root_motion_keys = nullptr;
+    unsigned int num_root_motion_keys = 0;
+    int root_motion_joint = -1;
+    if(options->root_motion_joint) {
+        aiNodeAnim *root_motion_node = find_channel(animation, aiString(options->root_motion_joint));
+        root_motion_joint = find_bone_id(root_node, aiString(options->root_motion_joint));
+        if(root_motion_node && root_motion_joint != -1) {
+            root_motion_keys = (RootMotionKey *)malloc(sizeof(RootMotionKey)*(root_motion_node->mNumPositionKeys + root_motion_node->mNumRotationKeys));
+            num_root_motion_keys = extract_root_motion(root_motion_node, root_motion_keys);
+        } else {
+            printf("Root motion joint not animated: %s\n", options->root_motion_joint);
+        }
+    }
+    if(num_root_motion_keys > 0) {
+        animation_flags |= TWEEN_CLIP_ROOT_MOTION;
+    }
+
+    if(options->additive) {
+        bake_additive_keys(animation);
+        animation_flags |= TWEEN_CLIP_ADDITIVE;
+    }
+    if(options->reduce_tolerance > 0 || options->strip_constant_tracks) {
+        animation_flags |= TWEEN_CLIP_SPARSE;
+    } else if(options->quantize_bits > 0) {
+        animation_flags |= TWEEN_CLIP_QUANTIZED;
+    }
+
+    unsigned int *key_indices = (unsigned int *)malloc(sizeof(unsigned int)*num_keyframes);
+    unsigned int num_keys = select_decimated_keys(num_keyframes, 1, key_indices);
+    if(options->decimate_tolerance > 0 && !(animation_flags & TWEEN_CLIP_SPARSE)) {
+        unsigned int step = 1;
+        num_keys = decimate_key_frames(root_node, animation, num_keyframes, options->decimate_tolerance, options->reduce_vertex_distance, key_indices, &step);
+        animation_flags |= TWEEN_CLIP_CUBIC;
+        /* NOTE: the clip stays uniform only if the last key is on the new grid */
+        if((num_keyframes - 1) % step == 0) {
+            key_delta *= step;
+        } else {
+            animation_flags &= ~TWEEN_CLIP_UNIFORM;
+            key_delta = 0;
+        }
+    }
+
     float duration = animation->mDuration/1000.0f;
     printf("Animation name: %s, duration: %f\n", animation_name, duration);
     write_string_cstr(animation_name, file);
     fwrite(&duration, sizeof(float), 1, file);
-    fwrite(&num_keyframes, sizeof(unsigned int), 1, file);
-    
-    aiNode *root_node = find_root_node(scene);
+    fwrite(&num_keys, sizeof(unsigned int), 1, file);
 
-    for(unsigned int keyframe_index = 0; keyframe_index < num_keyframes; ++keyframe_index) {
-        
-        unsigned int animation_num_channels = calculate_alctual_number_of_channels(root_node, animation);
+    printf("Animation flags: %d, key delta: %f\n", animation_flags, key_delta);
+    fwrite(&animation_flags, sizeof(unsigned int), 1, file);
+    fwrite(&key_delta, sizeof(float), 1, file);
 
-        fwrite(&animation_num_channels, sizeof(unsigned int), 1, file);
+    if(animation_flags & TWEEN_CLIP_MARKERS) {
+        printf("Sync markers: %d\n", num_markers);
+        fwrite(&num_markers, sizeof(unsigned int), 1, file);
+        fwrite(markers, sizeof(float), num_markers, file);
+    }
+    free(markers);
+
+    if(animation_flags & TWEEN_CLIP_ROOT_MOTION) {
+        printf("Root motion joint: %d, keys: %d\n", root_motion_joint, num_root_motion_keys);
+        fwrite(&root_motion_joint, sizeof(unsigned int), 1, file);
+        fwrite(&num_root_motion_keys, sizeof(unsigned int), 1, file);
+        for(unsigned int key_index = 0; key_index < num_root_motion_keys; ++key_index) {
+            RootMotionKey *key = root_motion_keys + key_index;
+            fwrite(&key->time, sizeof(float), 1, file);
+            write_vector3(key->translation, file);
+            fwrite(&key->yaw, sizeof(float), 1, file);
+        }
+    }
+    free(root_motion_keys);
 
-        for(unsigned int bone_index = 0; bone_index < animation->mNumChannels; ++bone_index) {
+    *raw_size = num_keyframes*(sizeof(unsigned int) + animation_num_channels*12*sizeof(float));
 
-            aiNodeAnim *node = animation->mChannels[bone_index];
-            int id = find_bone_id(root_node, node->mNodeName);
-            if(id == -1) continue;
-            write_key_frame(id, node->mPositionKeys[keyframe_index], node->mRotationKeys[keyframe_index], node->mScalingKeys[keyframe_index], file);
+    if(animation_flags & TWEEN_CLIP_SPARSE) {
+        *size = write_sparse_tracks(root_node, animation, options, file);
+    } else if(animation_flags & TWEEN_CLIP_QUANTIZED) {
+        *size = write_quantized_key_frames(root_node, animation, key_indices, num_keys, animation_num_channels, options->quantize_bits, file);
+    } else {
+        *size = write_dense_key_frames(root_node, animation, key_indices, num_keys, animation_num_channels, file);
+    }
+
+    free(key_indices);
+}
+
+// NOTE: the palette only has the joints that carry vertex weights, helper and end effector nodes get no
+// slot. The slots are sorted by joint index so they keep the depth first order of the skeleton
+static unsigned int build_skinning_palette(const aiScene *scene, aiNode *root_node, unsigned int num_joints, int *joint_slots, unsigned int *palette_joints) {
+    for(unsigned int joint_index = 0; joint_index < num_joints; ++joint_index) {
+        joint_slots[joint_index] = -1;
+    }
+    for(unsigned int i = 0; i < scene->mNumMeshes; ++i) {
+        aiMesh *mesh = scene->mMeshes[i];
+        for(unsigned int j = 0; j < mesh->mNumBones; ++j) {
+            aiBone *bone = mesh->mBones[j];
+            int id = find_bone_id(root_node, bone->mName);
+            if(id == -1 || bone->mNumWeights == 0) continue;
+            joint_slots[id] = 0;
         }
     }
+    unsigned int num_slots = 0;
+    for(unsigned int joint_index = 0; joint_index < num_joints; ++joint_index) {
+        if(joint_slots[joint_index] == -1) continue;
+        joint_slots[joint_index] = num_slots;
+        palette_joints[num_slots++] = joint_index;
+    }
+    return num_slots;
 }
 
 void write_model(const aiScene *scene, FILE *file) {
@@ -292,6 +1247,7 @@ void write_model(const aiScene *scene, FILE *file) {
     }
     if(scene->HasAnimations()) {
         flags |= TWEEN_SKELETON;
+        flags |= TWEEN_SKINNING_PALETTE;
     }
     printf("Flags: %d\n", flags);
     fwrite(&flags, sizeof(unsigned int), 1, file);
@@ -359,20 +1315,36 @@ void write_model(const aiScene *scene, FILE *file) {
         printf("Skeleton name: %s, total bones: %d\n", root_node->mName.C_Str(), total_bones);
         write_string(root_node->mName, file);
         fwrite(&total_bones, sizeof(unsigned int), 1, file);
+
+        int *joint_slots = (int *)malloc(sizeof(int)*total_bones);
+        unsigned int *palette_joints = (unsigned int *)malloc(sizeof(unsigned int)*total_bones);
+        unsigned int num_slots = build_skinning_palette(scene, root_node, total_bones, joint_slots, palette_joints);
+        printf("Skinning palette: %d slots of %d joints\n", num_slots, total_bones);
+        if(num_slots > MAX_PALETTE_SLOTS) {
+            printf("[WARNING] the skinning palette has more than %d slots\n", MAX_PALETTE_SLOTS);
+        }
         
         unsigned int last_num_bones = 0;
         for (unsigned int i = 0; i < scene->mNumMeshes; ++i) {
             aiMesh *mesh = scene->mMeshes[i];
-            printf("Mesh: %s, bones: %d\n", mesh->mName.C_Str(), mesh->mNumBones);
-            fwrite(&mesh->mNumBones, sizeof(unsigned int), 1, file);
+            // NOTE: only the bones with a palette slot are written
+            unsigned int num_written_bones = 0;
+            for(unsigned int j = 0; j < mesh->mNumBones; ++j) {
+                int id = find_bone_id(root_node, mesh->mBones[j]->mName);
+                if(id != -1 && joint_slots[id] != -1) {
+                    ++num_written_bones;
+                }
+            }
+            printf("Mesh: %s, bones: %d\n", mesh->mName.C_Str(), num_written_bones);
+            fwrite(&num_written_bones, sizeof(unsigned int), 1, file);
             
             for(unsigned int j = 0; j < mesh->mNumBones; ++j) {
                 
                 aiBone *bone = mesh->mBones[j];
                 int id = find_bone_id(root_node, bone->mName);
-                if(id == -1) continue;
+                if(id == -1 || joint_slots[id] == -1) continue;
 
-                fwrite(&id, sizeof(unsigned int), 1, file);
+                fwrite(&joint_slots[id], sizeof(unsigned int), 1, file);
                 fwrite(&bone->mNumWeights, sizeof(unsigned int), 1, file);
 
                 printf("current_bone id: %d, num_weights: %d\n", id, bone->mNumWeights);
@@ -388,6 +1360,11 @@ void write_model(const aiScene *scene, FILE *file) {
             }
             last_num_bones += mesh->mNumBones;
         }
+
+        fwrite(&num_slots, sizeof(unsigned int), 1, file);
+        fwrite(palette_joints, sizeof(unsigned int), num_slots, file);
+        free(joint_slots);
+        free(palette_joints);
     }
     
     printf("Model file write perfectly\n");
@@ -404,11 +1381,32 @@ char *ext_anim  = ".twa";
 char *command_model = "model";
 char *command_anim  = "anim";
 char *command_add   = "add";
+char *command_additive = "additive";
+char *command_quantize = "quantize";
+char *command_reduce   = "reduce";
+char *command_strip    = "strip";
+char *command_decimate = "decimate";
+char *command_markers  = "markers";
+char *command_root_motion = "root_motion";
 
 void output_usage_message_and_exit(void) {
     printf("[USAGE]:\n");
     printf("    - model: exporter model (ouput_name) (path)\n");
-    printf("    - anim:  exporter anim (ouput_name) add (path) add (path) ... \n");
+    printf("    - anim:  exporter anim (ouput_name) [options] add (path) additive (path) ... \n");
+    printf("             additive (path): store the clip as the difference from its first key, it is\n");
+    printf("                 played on top of the other clips\n");
+    printf("             quantize (bits): store the clips with (bits) per component, from 4 to %d\n", TWEEN_MAX_QUANTIZE_BITS);
+    printf("             reduce (tolerance) (distance): drop the keys that can be interpolated within (tolerance)\n");
+    printf("                 units of a vertex (distance) units away from every joint, can not be used with quantize\n");
+    printf("             strip: store the constant tracks once and drop the ones equal to the bind pose,\n");
+    printf("                 can not be used with quantize\n");
+    printf("             decimate (tolerance) (distance): keep one key every n source keys, with the largest n that the\n");
+    printf("                 cubic curves reproduce within (tolerance), measured like reduce. The clip stays uniform at 1/n\n");
+    printf("                 of the source rate, can not be used with reduce or strip\n");
+    printf("             markers (joint) (joint): write the times where the joints (feet) touch the ground, the\n");
+    printf("                 sync groups use them to align the clips\n");
+    printf("             root_motion (joint): move the horizontal translation and the yaw of (joint) to a root\n");
+    printf("                 motion track, the runtime returns the motion of every update\n");
     exit(0);
 }
 
@@ -502,7 +1500,48 @@ int main(int argc, char **argv) {
         ASSERT(argc >= 5);
 
         char *anim_name = argv[2];
-        unsigned int anim_count = (argc - 3) / 2;
+        unsigned int current_cmd = 3;
+        
+        AnimationExportOptions options = {};
+        while(current_cmd < (unsigned int)argc && strcmp(argv[current_cmd], command_add) != 0 && strcmp(argv[current_cmd], command_additive) != 0) {
+            char *option = argv[current_cmd++];
+            if(strcmp(option, command_quantize) == 0 && current_cmd < (unsigned int)argc) {
+                options.quantize_bits = (unsigned int)atoi(argv[current_cmd++]);
+                if(options.quantize_bits < 4 || options.quantize_bits > TWEEN_MAX_QUANTIZE_BITS) {
+                    output_usage_message_and_exit();
+                }
+            } else if(strcmp(option, command_decimate) == 0 && current_cmd + 1 < (unsigned int)argc) {
+                options.decimate_tolerance = (float)atof(argv[current_cmd++]);
+                options.reduce_vertex_distance = (float)atof(argv[current_cmd++]);
+                if(options.decimate_tolerance <= 0 || options.reduce_vertex_distance < 0) {
+                    output_usage_message_and_exit();
+                }
+            } else if(strcmp(option, command_markers) == 0 && current_cmd + 1 < (unsigned int)argc) {
+                options.marker_joints[0] = argv[current_cmd++];
+                options.marker_joints[1] = argv[current_cmd++];
+                options.num_marker_joints = 2;
+            } else if(strcmp(option, command_root_motion) == 0 && current_cmd < (unsigned int)argc) {
+                options.root_motion_joint = argv[current_cmd++];
+            } else if(strcmp(option, command_strip) == 0) {
+                options.strip_constant_tracks = true;
+            } else if(strcmp(option, command_reduce) == 0 && current_cmd + 1 < (unsigned int)argc) {
+                options.reduce_tolerance = (float)atof(argv[current_cmd++]);
+                options.reduce_vertex_distance = (float)atof(argv[current_cmd++]);
+                if(options.reduce_tolerance <= 0 || options.reduce_vertex_distance < 0) {
+                    output_usage_message_and_exit();
+                }
+            } else {
+                output_usage_message_and_exit();
+            }
+        }
+        if(options.quantize_bits > 0 && (options.reduce_tolerance > 0 || options.strip_constant_tracks)) {
+            output_usage_message_and_exit();
+        }
+        if(options.decimate_tolerance > 0 && (options.reduce_tolerance > 0 || options.strip_constant_tracks)) {
+            output_usage_message_and_exit();
+        }
+
+        unsigned int anim_count = (argc - current_cmd) / 2;
 
         char output_name[256];
         add_ext(output_name, 256, anim_name, ext_anim);
@@ -520,11 +1559,14 @@ int main(int argc, char **argv) {
         printf("Magic Number: %d\n", magic);
         fwrite(&magic, sizeof(unsigned int), 1, animation_file);
         
+        unsigned int total_size = 0;
+        unsigned int total_raw_size = 0;
+
         bool skeleton_written = false;
-        unsigned int current_cmd = 3;
         while(current_cmd <= argc - 2) {
             char *add = argv[current_cmd++];
-            ASSERT(strcmp(add, command_add) == 0);
+            ASSERT(strcmp(add, command_add) == 0 || strcmp(add, command_additive) == 0);
+            options.additive = strcmp(add, command_additive) == 0;
             char *path = argv[current_cmd++];
             char name[256];
             remove_ext(name, 256, path);
@@ -555,10 +1597,21 @@ int main(int argc, char **argv) {
             printf("     Animation name: %s\n", name);
             printf("------------------------------------------------------------------\n");
 
-            write_animation(anim, animation_file, name);
+            unsigned int size = 0;
+            unsigned int raw_size = 0;
+            write_animation(anim, animation_file, name, &options, &size, &raw_size);
+            printf("Key frames size: %d bytes, raw size: %d bytes, compression ratio: %.2f\n", size, raw_size, (float)raw_size / (float)size);
+
+            total_size += size;
+            total_raw_size += raw_size;
         
         }
 
+        printf("------------------------------------------------------------------\n");
+        printf("     Total key frames size: %d bytes, raw size: %d bytes\n", total_size, total_raw_size);
+        printf("     Compression ratio: %.2f\n", total_size > 0 ? (float)total_raw_size / (float)total_size : 0.0f);
+        printf("------------------------------------------------------------------\n");
+
     } else {
         output_usage_message_and_exit();
     }
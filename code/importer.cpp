@@ -9,12 +9,23 @@
 #include "common.h"
 #include "gpu.h"
 #include "animation.h"
+#include "pose_kernels.h"
+#include "state_machine.h"
 
 #define TWEEN_MAGIC ((unsigned int)('E'<<24)|('E'<<16)|('W'<<8)|'T')
 
 #define TWEEN_MODEL      (1 << 0)
 #define TWEEN_SKELETON   (1 << 1)
 #define TWEEN_ANIMATIONS (1 << 2)
+#define TWEEN_SKINNING_PALETTE (1 << 3)
+
+#define TWEEN_CLIP_UNIFORM   (1 << 0)
+#define TWEEN_CLIP_QUANTIZED (1 << 1)
+#define TWEEN_CLIP_SPARSE    (1 << 2)
+#define TWEEN_CLIP_CUBIC     (1 << 3)
+#define TWEEN_CLIP_ADDITIVE  (1 << 4)
+#define TWEEN_CLIP_MARKERS   (1 << 5)
+#define TWEEN_CLIP_ROOT_MOTION (1 << 6)
 
 #define READ_U64(buffer) *((u64 *)buffer); buffer += 8
 #define READ_U32(buffer) *((u32 *)buffer); buffer += 4
@@ -146,6 +157,9 @@ static void read_tween_model_file(Model *model, u8 *file) {
     
     ASSERT((flags & TWEEN_SKELETON) && (flags & TWEEN_MODEL));
 
+    model->palette_joints = nullptr;
+    model->num_palette_joints = 0;
+
     model->num_meshes = READ_U32(file);
     model->meshes = (Mesh *)malloc(sizeof(Mesh)*model->num_meshes);
     printf("Number of meshes: %d\n", model->num_meshes);
@@ -211,6 +225,16 @@ static void read_tween_model_file(Model *model, u8 *file) {
             }
         }
 
+        if(flags & TWEEN_SKINNING_PALETTE) {
+            model->num_palette_joints = READ_U32(file);
+            model->palette_joints = (u32 *)malloc(sizeof(u32)*MAX(model->num_palette_joints, 1u));
+            for(u32 slot = 0; slot < model->num_palette_joints; ++slot) {
+                model->palette_joints[slot] = READ_U32(file);
+                ASSERT(model->palette_joints[slot] < total_number_of_bones);
+            }
+            printf("Skinning palette: %d slots of %d joints\n", model->num_palette_joints, total_number_of_bones);
+        }
+
         printf("All vertices ready for animation!\n");
     }
 }
@@ -226,36 +250,231 @@ static void read_joint(u8 **file, Joint *joint) {
 }
 
 
-static void read_sample(u8 **file, AnimationSample *sample, u32 num_joints) {
+// NOTE: the joints that are not animated by the clip stay in the bind pose, the additive clips do
+// not change them
+static void set_default_poses(JointPose *poses, Skeleton *skeleton, bool additive) {
+    if(!additive) {
+        memcpy(poses, skeleton->bind_local_poses, sizeof(JointPose)*skeleton->num_joints);
+        return;
+    }
+    for(u32 joint_index = 0; joint_index < skeleton->num_joints; ++joint_index) {
+        poses[joint_index].position = v3(0, 0, 0);
+        poses[joint_index].rotation = q4(1, 0, 0, 0);
+        poses[joint_index].scale = v3(1, 1, 1);
+    }
+}
+
+static f32 read_key_frame(u8 **file, JointPose *poses) {
     
     u32 num_animated_bones = READ_U32(*file);
-    sample->local_poses = (JointPose *)malloc(sizeof(JointPose)*num_joints);
-
-    for(u32 pose_index = 0; pose_index < num_joints; ++pose_index) {
-        JointPose *pose = sample->local_poses + pose_index;
-        pose->position = v3(0, 0, 1);
-        pose->rotation = q4(1, 0, 0, 0);
-        pose->scale = v3(1, 1, 1);
-    }
     
+    f32 sample_time_stamp = 0;
     bool time_stamp_initialize = false;
 
     for(u32 animated_bone_index = 0; animated_bone_index < num_animated_bones; ++animated_bone_index) {
         u32 bone_index = READ_U32(*file);
         f32 time_stamp = READ_F32(*file);
-        read_v3(file, &sample->local_poses[bone_index].position);
-        read_q4(file, &sample->local_poses[bone_index].rotation);
-        read_v3(file, &sample->local_poses[bone_index].scale);
+        read_v3(file, &poses[bone_index].position);
+        read_q4(file, &poses[bone_index].rotation);
+        read_v3(file, &poses[bone_index].scale);
         
         if(time_stamp_initialize == false) {
-            sample->time_stamp = time_stamp;
+            sample_time_stamp = time_stamp;
             time_stamp_initialize = true;
         }
     }
 
+    return sample_time_stamp;
+}
+
+struct BitReader {
+    u8 *data;
+    u64 bits;
+    u32 num_bits;
+};
+
+static u32 bit_reader_read(BitReader *reader, u32 num_bits) {
+    while(reader->num_bits < num_bits) {
+        reader->bits |= ((u64)*reader->data++) << reader->num_bits;
+        reader->num_bits += 8;
+    }
+    u32 value = (u32)(reader->bits & ((1ull << num_bits) - 1));
+    reader->bits >>= num_bits;
+    reader->num_bits -= num_bits;
+    return value;
+}
+
+static f32 read_unorm(BitReader *reader, u32 num_bits) {
+    u32 max_value = (1u << num_bits) - 1;
+    return (f32)bit_reader_read(reader, num_bits) / (f32)max_value;
+}
+
+static void read_quantized_v3(BitReader *reader, u32 num_bits, V3 min, V3 extent, V3 *vector) {
+    vector->x = min.x + read_unorm(reader, num_bits)*extent.x;
+    vector->y = min.y + read_unorm(reader, num_bits)*extent.y;
+    vector->z = min.z + read_unorm(reader, num_bits)*extent.z;
+}
+
+// NOTE: smallest three, the dropped component is the largest one and it is always positive
+static void read_quantized_q4(BitReader *reader, u32 num_bits, Q4 *quat) {
+    u32 largest_index = bit_reader_read(reader, 2);
+    f32 components[4];
+    f32 length_sqr = 0;
+    for(u32 i = 0; i < 4; ++i) {
+        if(i == largest_index) continue;
+        components[i] = read_unorm(reader, num_bits)*(f32)M_SQRT2 - (f32)M_SQRT1_2;
+        length_sqr += components[i]*components[i];
+    }
+    components[largest_index] = sqrtf(MAX(0.0f, 1.0f - length_sqr));
+    *quat = q4(components[0], components[1], components[2], components[3]);
 }
 
-static void read_tween_skeleton_file(Skeleton *skeleton, AnimationClip **animations, u32 *num_animations, u8 *file) {
+// NOTE: range of the quantized positions and scales of one joint for the whole clip
+struct QuantizedTrack {
+    u32 joint;
+    V3 position_min;
+    V3 position_extent;
+    V3 scale_min;
+    V3 scale_extent;
+};
+
+static f32 read_quantized_key_frame(u8 **file, QuantizedTrack *tracks, u32 num_tracks, u32 num_bits, JointPose *poses) {
+    
+    f32 time_stamp = READ_F32(*file);
+    
+    BitReader reader = {};
+    reader.data = *file;
+
+    for(u32 track_index = 0; track_index < num_tracks; ++track_index) {
+        QuantizedTrack *track = tracks + track_index;
+        JointPose *pose = poses + track->joint;
+        read_quantized_q4(&reader, num_bits, &pose->rotation);
+        read_quantized_v3(&reader, num_bits, track->position_min, track->position_extent, &pose->position);
+        read_quantized_v3(&reader, num_bits, track->scale_min, track->scale_extent, &pose->scale);
+    }
+
+    // NOTE: the key frames are byte aligned, the padding bits are already consumed
+    *file = reader.data;
+    return time_stamp;
+}
+
+static void allocate_animation_tracks(AnimationClip *animation, u32 num_joints) {
+    
+    // NOTE: all the streams are allocated in one block, track by track
+    u32 num_samples = animation->num_samples;
+    // NOTE: the tracks are rounded to 16 bytes and start with the rotations, every Q4 stream is aligned
+    u64 track_size = ((sizeof(Q4) + sizeof(V3) + sizeof(V3))*num_samples + 15) & ~15;
+    u8 *memory = (u8 *)malloc(sizeof(AnimationTrack)*num_joints + track_size*num_joints);
+    
+    animation->tracks = (AnimationTrack *)memory;
+    u8 *streams = memory + sizeof(AnimationTrack)*num_joints;
+
+    for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+        AnimationTrack *track = animation->tracks + joint_index;
+        track->rotations = (Q4 *)streams;
+        streams += sizeof(Q4)*num_samples;
+        track->positions = (V3 *)streams;
+        streams += sizeof(V3)*num_samples;
+        track->scales = (V3 *)streams;
+        streams += sizeof(V3)*num_samples;
+
+        track->num_rotation_keys = num_samples;
+        track->num_position_keys = num_samples;
+        track->num_scale_keys = num_samples;
+        track->rotation_times = animation->time_stamps;
+        track->position_times = animation->time_stamps;
+        track->scale_times = animation->time_stamps;
+    }
+}
+
+// NOTE: sparse tracks have (time, value) pairs, the times and the values are split in two streams
+static u8 *read_sparse_v3_keys(u8 **file, u8 *streams, u32 *num_keys, f32 **times, V3 **values) {
+    *num_keys = READ_U32(*file);
+    *times = (f32 *)streams;
+    streams += sizeof(f32)*(*num_keys);
+    *values = (V3 *)streams;
+    streams += sizeof(V3)*(*num_keys);
+    for(u32 key_index = 0; key_index < *num_keys; ++key_index) {
+        (*times)[key_index] = READ_F32(*file);
+        read_v3(file, (*values) + key_index);
+    }
+    return streams;
+}
+
+static u8 *read_sparse_q4_keys(u8 **file, u8 *streams, u32 *num_keys, f32 **times, Q4 **values) {
+    *num_keys = READ_U32(*file);
+    *times = (f32 *)streams;
+    streams += sizeof(f32)*(*num_keys);
+    // NOTE: the quaternions are aligned to 16 bytes after the times, read_sparse_tracks counts the padding
+    streams = (u8 *)(((u64)streams + 15) & ~(u64)15);
+    *values = (Q4 *)streams;
+    streams += sizeof(Q4)*(*num_keys);
+    for(u32 key_index = 0; key_index < *num_keys; ++key_index) {
+        (*times)[key_index] = READ_F32(*file);
+        read_q4(file, (*values) + key_index);
+    }
+    return streams;
+}
+
+static void read_sparse_tracks(u8 **file, AnimationClip *animation, u32 num_joints) {
+
+    u32 num_animated_tracks = READ_U32(*file);
+    
+    // NOTE: walk the data once to find the size of all the streams, they are allocated in one block
+    u8 *cursor = *file;
+    u64 streams_size = 0;
+    for(u32 track_index = 0; track_index < num_animated_tracks; ++track_index) {
+        (void)READ_U32(cursor);
+        u32 num_position_keys = READ_U32(cursor);
+        cursor += num_position_keys*4*sizeof(f32);
+        u32 num_rotation_keys = READ_U32(cursor);
+        cursor += num_rotation_keys*5*sizeof(f32);
+        u32 num_scale_keys = READ_U32(cursor);
+        cursor += num_scale_keys*4*sizeof(f32);
+        streams_size += (sizeof(f32) + sizeof(V3))*num_position_keys;
+        streams_size += (sizeof(f32) + sizeof(Q4))*num_rotation_keys + 15;
+        streams_size += (sizeof(f32) + sizeof(V3))*num_scale_keys;
+    }
+
+    u8 *memory = (u8 *)malloc(sizeof(AnimationTrack)*num_joints + streams_size);
+    animation->tracks = (AnimationTrack *)memory;
+    memset(animation->tracks, 0, sizeof(AnimationTrack)*num_joints);
+    u8 *streams = memory + sizeof(AnimationTrack)*num_joints;
+    
+    u32 num_keys = 0;
+    for(u32 track_index = 0; track_index < num_animated_tracks; ++track_index) {
+        u32 joint_index = READ_U32(*file);
+        ASSERT(joint_index < num_joints);
+        AnimationTrack *track = animation->tracks + joint_index;
+        streams = read_sparse_v3_keys(file, streams, &track->num_position_keys, &track->position_times, &track->positions);
+        streams = read_sparse_q4_keys(file, streams, &track->num_rotation_keys, &track->rotation_times, &track->rotations);
+        streams = read_sparse_v3_keys(file, streams, &track->num_scale_keys, &track->scale_times, &track->scales);
+        num_keys += track->num_position_keys + track->num_rotation_keys + track->num_scale_keys;
+    }
+
+    printf("Sparse animation, tracks: %d, keys: %d\n", num_animated_tracks, num_keys);
+}
+
+static void store_sample(AnimationClip *animation, u32 sample_index, f32 time_stamp, JointPose *poses, u32 num_joints) {
+    
+    animation->time_stamps[sample_index] = time_stamp;
+
+    if(animation->layout == ANIMATION_CLIP_LAYOUT_SOA) {
+        for(u32 joint_index = 0; joint_index < num_joints; ++joint_index) {
+            AnimationTrack *track = animation->tracks + joint_index;
+            track->positions[sample_index] = poses[joint_index].position;
+            track->rotations[sample_index] = poses[joint_index].rotation;
+            track->scales[sample_index] = poses[joint_index].scale;
+        }
+    } else {
+        AnimationSample *sample = animation->samples + sample_index;
+        sample->time_stamp = time_stamp;
+        sample->local_poses = (JointPose *)malloc(sizeof(JointPose)*num_joints);
+        memcpy(sample->local_poses, poses, sizeof(JointPose)*num_joints);
+    }
+}
+
+static void read_tween_skeleton_file(Skeleton *skeleton, AnimationClip **animations, u32 *num_animations, u8 *file, AnimationClipLayout layout) {
 
     u32 magic = READ_U32(file);
     ASSERT(magic == TWEEN_MAGIC);
@@ -277,6 +496,8 @@ static void read_tween_skeleton_file(Skeleton *skeleton, AnimationClip **animati
         Joint *joint = skeleton->joints + joint_index;
         read_joint(&file, joint);
     }
+    skeleton->initialize_bind_local_poses();
+    skeleton->initialize_joint_names();
     
     u32 animations_array_size = READ_U32(file);
     AnimationClip *animations_array = (AnimationClip *)malloc(sizeof(AnimationClip)*animations_array_size);
@@ -290,11 +511,115 @@ static void read_tween_skeleton_file(Skeleton *skeleton, AnimationClip **animati
         read_string(&file, animation->name);
         animation->duration = READ_F32(file);
         animation->num_samples = READ_U32(file);
-        animation->samples = (AnimationSample *)malloc(sizeof(AnimationSample)*animation->num_samples);
+
+        u32 animation_flags = READ_U32(file);
+        f32 key_delta = READ_F32(file);
+        animation->flags = 0;
+        animation->inv_sample_delta = 0;
+        if((animation_flags & TWEEN_CLIP_UNIFORM) && key_delta > 0) {
+            animation->flags |= ANIMATION_CLIP_UNIFORM;
+            animation->inv_sample_delta = 1.0f / key_delta;
+        }
+        if(animation_flags & TWEEN_CLIP_CUBIC) {
+            animation->flags |= ANIMATION_CLIP_CUBIC;
+        }
+        if(animation_flags & TWEEN_CLIP_ADDITIVE) {
+            animation->flags |= ANIMATION_CLIP_ADDITIVE;
+        }
+
+        // NOTE: the foot contact markers follow the header of the clip
+        animation->sync_markers = nullptr;
+        animation->num_sync_markers = 0;
+        if(animation_flags & TWEEN_CLIP_MARKERS) {
+            animation->num_sync_markers = READ_U32(file);
+            animation->sync_markers = (f32 *)malloc(sizeof(f32)*animation->num_sync_markers);
+            for(u32 marker_index = 0; marker_index < animation->num_sync_markers; ++marker_index) {
+                animation->sync_markers[marker_index] = READ_F32(file);
+            }
+            printf("Sync markers: %d\n", animation->num_sync_markers);
+        }
+
+        // NOTE: the root motion track follows the markers
+        animation->root_motion_keys = nullptr;
+        animation->num_root_motion_keys = 0;
+        animation->root_motion_joint = 0;
+        if(animation_flags & TWEEN_CLIP_ROOT_MOTION) {
+            animation->root_motion_joint = READ_U32(file);
+            animation->num_root_motion_keys = READ_U32(file);
+            ASSERT(animation->root_motion_joint < skeleton->num_joints);
+            animation->root_motion_keys = (RootMotionKey *)malloc(sizeof(RootMotionKey)*animation->num_root_motion_keys);
+            for(u32 key_index = 0; key_index < animation->num_root_motion_keys; ++key_index) {
+                RootMotionKey *key = animation->root_motion_keys + key_index;
+                key->time = READ_F32(file);
+                read_v3(&file, &key->translation);
+                key->yaw = READ_F32(file);
+            }
+            printf("Root motion joint: %d, keys: %d\n", animation->root_motion_joint, animation->num_root_motion_keys);
+        }
+
+        animation->samples = nullptr;
+        animation->tracks = nullptr;
+        animation->time_stamps = nullptr;
+        animation->segments = nullptr;
+        animation->segment_times = nullptr;
+        animation->num_segments = 0;
+
+        // NOTE: sparse clips are always loaded with the sparse layout, they do not have samples
+        if(animation_flags & TWEEN_CLIP_SPARSE) {
+            animation->layout = ANIMATION_CLIP_LAYOUT_SPARSE;
+            animation->flags &= ~ANIMATION_CLIP_UNIFORM;
+            read_sparse_tracks(&file, animation, skeleton->num_joints);
+            printf("Animation name: %s, duration: %f\n", animation->name, animation->duration);
+            continue;
+        }
+
+        // NOTE: segmented clips are loaded as SOA tracks and split in segments at the end
+        animation->time_stamps = (f32 *)malloc(sizeof(f32)*animation->num_samples);
+        animation->layout = layout == ANIMATION_CLIP_LAYOUT_SEGMENTED ? ANIMATION_CLIP_LAYOUT_SOA : layout;
         
+        if(animation->layout == ANIMATION_CLIP_LAYOUT_SOA) {
+            allocate_animation_tracks(animation, skeleton->num_joints);
+        } else {
+            animation->samples = (AnimationSample *)malloc(sizeof(AnimationSample)*animation->num_samples);
+        }
+
+        // NOTE: quantized clips are decoded at load time
+        u32 quantize_bits = 0;
+        u32 num_quantized_tracks = 0;
+        QuantizedTrack *quantized_tracks = nullptr;
+        if(animation_flags & TWEEN_CLIP_QUANTIZED) {
+            quantize_bits = READ_U32(file);
+            num_quantized_tracks = READ_U32(file);
+            quantized_tracks = (QuantizedTrack *)malloc(sizeof(QuantizedTrack)*num_quantized_tracks);
+            for(u32 track_index = 0; track_index < num_quantized_tracks; ++track_index) {
+                QuantizedTrack *track = quantized_tracks + track_index;
+                track->joint = READ_U32(file);
+                read_v3(&file, &track->position_min);
+                read_v3(&file, &track->position_extent);
+                read_v3(&file, &track->scale_min);
+                read_v3(&file, &track->scale_extent);
+                ASSERT(track->joint < skeleton->num_joints);
+            }
+            printf("Quantized animation, bits per component: %d\n", quantize_bits);
+        }
+
+        JointPose *key_poses = (JointPose *)malloc(sizeof(JointPose)*skeleton->num_joints);
         for(u32 sample_index = 0; sample_index < animation->num_samples; ++sample_index) {
-            AnimationSample *sample = animation->samples + sample_index;
-            read_sample(&file, sample, skeleton->num_joints);
+            set_default_poses(key_poses, skeleton, (animation->flags & ANIMATION_CLIP_ADDITIVE) != 0);
+            f32 time_stamp = 0;
+            if(quantized_tracks) {
+                time_stamp = read_quantized_key_frame(&file, quantized_tracks, num_quantized_tracks, quantize_bits, key_poses);
+            } else {
+                time_stamp = read_key_frame(&file, key_poses);
+            }
+            store_sample(animation, sample_index, time_stamp, key_poses, skeleton->num_joints);
+        }
+        free(key_poses);
+        free(quantized_tracks);
+
+        if(layout == ANIMATION_CLIP_LAYOUT_SEGMENTED) {
+            animation->build_segments(ANIMATION_SEGMENT_SAMPLES);
+            printf("Segmented animation, segments: %d, segment size: %d\n", animation->num_segments, animation->segment_size);
         }
 
         printf("Animation name: %s, duration: %f, keyframes: %d\n", animation->name, animation->duration, animation->num_samples);
@@ -311,6 +636,9 @@ int main(void) {
 
     os_initialize();
 
+    PoseKernelType pose_kernel = pose_kernels_initialize(POSE_KERNEL_AVX2);
+    printf("Pose kernel: %s\n", pose_kernel_name(pose_kernel));
+
     u8 *model_file = read_entire_file("./data/model.twm", nullptr);
     Model model;
     read_tween_model_file(&model, model_file);
@@ -323,7 +651,7 @@ int main(void) {
     Skeleton skeleton;
     AnimationClip *animations = nullptr;
     u32 num_animations = 0;
-    read_tween_skeleton_file(&skeleton, &animations, &num_animations, animation_file);
+    read_tween_skeleton_file(&skeleton, &animations, &num_animations, animation_file, ANIMATION_CLIP_LAYOUT_AOS);
 
     u32 window_w = 1280;
     u32 window_h = 720;
@@ -349,7 +677,9 @@ int main(void) {
     }
 
     // NOTE: Create GPU shaders
-    u32 program = gpu_create_prorgam((char *)"./shaders/vert.glsl", (char *)"./shaders/frag.glsl");
+    u32 linear_program = gpu_create_prorgam((char *)"./shaders/vert.glsl", (char *)"./shaders/frag.glsl");
+    u32 dual_quaternion_program = gpu_create_prorgam((char *)"./shaders/vert_dq.glsl", (char *)"./shaders/frag.glsl");
+    u32 program = linear_program;
     glUseProgram(program);
     
     glEnable(GL_DEPTH_TEST);
@@ -363,12 +693,54 @@ int main(void) {
 
     AnimationSet set;
     set.initialize(animations, num_animations);
-    set.set_root_joint("punch", "mixamorig1_Spine");
-
-    set.play("idle", 1, true);
-    set.play("walking", 1, true);
+    AnimationHandle idle = set.get_animation("idle");
+    AnimationHandle walking = set.get_animation("walking");
+    AnimationHandle punch = set.get_animation("punch");
+    if(model.palette_joints) {
+        set.set_skinning_palette(model.palette_joints, model.num_palette_joints);
+    }
+    ASSERT(set.num_palette_joints <= MAX_FINAL_BONE_MATRICES);
+    set.set_sync_group(idle, 0);
+    set.set_sync_group(walking, 0);
+
+    // NOTE: the locomotion blends idle and walking with the speed (a 1D blend space). The punch is a layer
+    // masked to the spine, the upper body machine starts it from its rest state with the '1' key and fades
+    // it out when it is almost over, the legs keep the locomotion
+    set.set_root_joint(punch, set.get_joint("mixamorig1_Spine"));
+    set.set_layer(punch, true);
+
+    BlendSpace locomotion_space;
+    locomotion_space.initialize(2, 1);
+    locomotion_space.add_sample(idle, 0, 0);
+    locomotion_space.add_sample(walking, 1, 0);
+    locomotion_space.build();
+
+    StateMachine locomotion_machine;
+    locomotion_machine.initialize(1, 1, 1, 1);
+    u32 speed_parameter = locomotion_machine.add_parameter(0, false);
+    locomotion_machine.add_blend_space_state(&locomotion_space, speed_parameter, STATE_MACHINE_INVALID, true);
+    locomotion_machine.compile();
+
+    StateMachine upper_body_machine;
+    upper_body_machine.initialize(2, 2, 2, 1);
+    u32 punch_parameter = upper_body_machine.add_parameter(0, true);
+    u32 rest_state = upper_body_machine.add_state({ANIMATION_INVALID_HANDLE}, false);
+    u32 punch_state = upper_body_machine.add_state(punch, false);
+    u32 transition = upper_body_machine.add_transition(rest_state, punch_state, 0.2f);
+    upper_body_machine.add_condition(transition, punch_parameter, STATE_CONDITION_GREATER, 0);
+    transition = upper_body_machine.add_transition(punch_state, rest_state, 0.3f);
+    upper_body_machine.add_exit_time_condition(transition, 0.8f);
+    upper_body_machine.compile();
+
+    StateMachineInstance locomotion;
+    locomotion.initialize(&locomotion_machine, &set);
+    StateMachineInstance upper_body;
+    upper_body.initialize(&upper_body_machine, &set);
 
     f32 player_speed = 0;
+    // NOTE: position and yaw accumulated from the root motion of the clips, in model space
+    V3 character_position = v3(0, 0, 0);
+    f32 character_yaw = 0;
     
     while(!window->should_close) {
 
@@ -380,16 +752,35 @@ int main(void) {
             player_speed = CLAMP(player_speed - seconds_per_frame, 0, 1);
         }
 
+        locomotion.set_parameter(speed_parameter, player_speed);
         if(os_keyboard[(u32)'1']) {
-            if(set.animation_finish("punch") == true) {
-                printf("punch!\n");
-                set.play_smooth("punch", 0.5);
-            }
+            upper_body.set_trigger(punch_parameter);
         }
-        
-        set.update_weight("walking", player_speed);
 
+        // NOTE: the palette of the new mode is computed by the update of this frame
+        if(os_keyboard[(u32)'l']) {
+            set.set_skinning_mode(SKINNING_MODE_LINEAR);
+            program = linear_program;
+        }
+        if(os_keyboard[(u32)'q']) {
+            set.set_skinning_mode(SKINNING_MODE_DUAL_QUATERNION);
+            program = dual_quaternion_program;
+        }
+        
+        locomotion.update(seconds_per_frame);
+        upper_body.update(seconds_per_frame);
         set.update(seconds_per_frame);
+
+        // NOTE: the translation of the update is in the space of the character before the update
+        M4 character_rotation = m4_rotate_y(character_yaw);
+        V3 step = set.root_motion_translation;
+        character_position.x += character_rotation.m[0]*step.x + character_rotation.m[2]*step.z;
+        character_position.z += character_rotation.m[8]*step.x + character_rotation.m[10]*step.z;
+        character_yaw += set.root_motion_yaw;
+        if(os_keyboard[(u32)'r']) {
+            character_position = v3(0, 0, 0);
+            character_yaw = 0;
+        }
         
         window_w = window_width(window);
         window_h = window_height(window);
@@ -405,14 +796,19 @@ int main(void) {
         M4 p = m4_perspective2(to_rad(80), aspect, 0.1f, 1000.0f);
         glUniformMatrix4fv(glGetUniformLocation(program, "projection"), 1, true, p.m);
 
-        for(u32 i = 0;  i < set.skeleton->num_joints; ++i) {
-            char bone_matrix_name[1024];
-            sprintf(bone_matrix_name, "bone_matrix[%d]", i);
-            M4 bone_matrix = set.final_transform_matrices[i];
-            glUniformMatrix4fv(glGetUniformLocation(program, bone_matrix_name), 1, true, bone_matrix.m);
+        if(set.skinning_mode == SKINNING_MODE_DUAL_QUATERNION) {
+            glUniform4fv(glGetUniformLocation(program, "bone_dual_quaternions"), 2*set.num_palette_joints, (f32 *)set.final_dual_quaternions);
+        } else {
+            for(u32 i = 0;  i < set.num_palette_joints; ++i) {
+                char bone_matrix_name[1024];
+                sprintf(bone_matrix_name, "bone_matrix[%d]", i);
+                M4 bone_matrix = set.final_transform_matrices[i];
+                glUniformMatrix4fv(glGetUniformLocation(program, bone_matrix_name), 1, true, bone_matrix.m);
+            }
         }
         static f32 angle = 0;
         M4 m = m4_mul(m4_translate(v3(0, -1, -2)), m4_mul(m4_rotate_y(to_rad(angle)), m4_scale(.012f)));
+        m = m4_mul(m, m4_mul(m4_translate(character_position), m4_rotate_y(character_yaw)));
         glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, true, m.m);
 
         angle += (14 * seconds_per_frame);
@@ -448,6 +844,11 @@ int main(void) {
         //printf("ms: %f, fps: %f\n", (f32)delta_time, ((f32)1/delta_time) * 1000);
     }
     
+    upper_body.terminate();
+    locomotion.terminate();
+    upper_body_machine.terminate();
+    locomotion_machine.terminate();
+    locomotion_space.terminate();
     set.terminate();
 
     os_gl_destroy_context(window);
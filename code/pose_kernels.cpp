@@ -0,0 +1,550 @@
+#include "pose_kernels.h"
+#include "algebra.h"
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define POSE_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define TARGET_AVX2
+#endif
+
+/* -------------------------------------------- */
+/*        Scalar                                */
+/* -------------------------------------------- */
+
+// NOTE: Eberly polynomial coefficients, "A Fast and Accurate Algorithm for Computing SLERP"
+// u[i] = 1/((i+1)*(2i+3)), v[i] = (i+1)/(2i+3), the last term is scaled by (1 + mu)
+#define SLERP_ONE_PLUS_MU 1.85298109240830f
+static const f32 slerp_u[8] = {
+    1.0f/(1*3), 1.0f/(2*5), 1.0f/(3*7), 1.0f/(4*9), 1.0f/(5*11), 1.0f/(6*13), 1.0f/(7*15), SLERP_ONE_PLUS_MU/(8*17)
+};
+static const f32 slerp_v[8] = {
+    1.0f/3, 2.0f/5, 3.0f/7, 4.0f/9, 5.0f/11, 6.0f/13, 7.0f/15, SLERP_ONE_PLUS_MU*8/17
+};
+
+static void slerp_weights(f32 cos_omega, f32 t, f32 *k0, f32 *k1) {
+    f32 sign = 1;
+    if(cos_omega < 0) {
+        cos_omega = -cos_omega;
+        sign = -1;
+    }
+    f32 xm1 = cos_omega - 1;
+    f32 d = 1 - t;
+    f32 sqr_t = t*t;
+    f32 sqr_d = d*d;
+    f32 ct = 1;
+    f32 cd = 1;
+    for(s32 i = 7; i >= 0; --i) {
+        ct = 1 + (slerp_u[i]*sqr_t - slerp_v[i])*xm1*ct;
+        cd = 1 + (slerp_u[i]*sqr_d - slerp_v[i])*xm1*cd;
+    }
+    *k0 = cd*d;
+    *k1 = ct*t*sign;
+}
+
+// NOTE: same approximation as the SIMD kernels, used for the lanes that do not fill a full register
+static void rotation_lanes_tail(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 start, u32 count, RotationInterpolation interpolation) {
+    for(u32 lane = start; lane < count; ++lane) {
+        Q4 qa = pose_lanes_get_rotation(a, lane);
+        Q4 qb = pose_lanes_get_rotation(b, lane);
+        if(interpolation == ROTATION_INTERPOLATION_ONLERP) {
+            pose_lanes_set_rotation(dst, lane, q4_onlerp(qa, qb, t[lane]));
+        } else {
+            f32 k0, k1;
+            slerp_weights(qa.w*qb.w + qa.x*qb.x + qa.y*qb.y + qa.z*qb.z, t[lane], &k0, &k1);
+            pose_lanes_set_rotation(dst, lane, q4_add(q4_scale(qa, k0), q4_scale(qb, k1)));
+        }
+    }
+}
+
+static void vector_lanes_tail(f32 (*dst)[POSE_LANES], f32 (*a)[POSE_LANES], f32 (*b)[POSE_LANES], f32 *t, u32 start, u32 count) {
+    for(u32 c = 0; c < 3; ++c) {
+        for(u32 lane = start; lane < count; ++lane) {
+            dst[c][lane] = lerp(a[c][lane], b[c][lane], t[lane]);
+        }
+    }
+}
+
+static void rotation_lanes_scalar(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 count, RotationInterpolation interpolation) {
+    for(u32 lane = 0; lane < count; ++lane) {
+        Q4 qa = pose_lanes_get_rotation(a, lane);
+        Q4 qb = pose_lanes_get_rotation(b, lane);
+        if(interpolation == ROTATION_INTERPOLATION_ONLERP) {
+            pose_lanes_set_rotation(dst, lane, q4_onlerp(qa, qb, t[lane]));
+        } else {
+            pose_lanes_set_rotation(dst, lane, q4_slerp(qa, qb, t[lane]));
+        }
+    }
+}
+
+static void vector_lanes_scalar(f32 (*dst)[POSE_LANES], f32 (*a)[POSE_LANES], f32 (*b)[POSE_LANES], f32 *t, u32 count) {
+    vector_lanes_tail(dst, a, b, t, 0, count);
+}
+
+// NOTE: the accumulation is one multiply-add per float, simple enough for the compiler to vectorize
+static void m4_mul_scalar(M4 *result, M4 *a, M4 *b, u32 count) {
+    for(u32 i = 0; i < count; ++i) {
+        result[i] = m4_mul(a[i], b[i]);
+    }
+}
+
+static void q4_to_m4_scalar(M4 *result, Q4 *q, u32 count) {
+    for(u32 i = 0; i < count; ++i) {
+        result[i] = q4_to_m4(q[i]);
+    }
+}
+
+void pose_accumulate(JointPose *dst, f32 *weights, JointPose *src, JointPose *reference, f32 weight, u32 count) {
+    for(u32 joint_index = 0; joint_index < count; ++joint_index) {
+        Q4 q = src[joint_index].rotation;
+        Q4 r = reference[joint_index].rotation;
+        f32 rotation_weight = (q.w*r.w + q.x*r.x + q.y*r.y + q.z*r.z) < 0.0f ? -weight : weight;
+        
+        JointPose *pose = dst + joint_index;
+        pose->position.x += src[joint_index].position.x*weight;
+        pose->position.y += src[joint_index].position.y*weight;
+        pose->position.z += src[joint_index].position.z*weight;
+        pose->rotation.w += q.w*rotation_weight;
+        pose->rotation.x += q.x*rotation_weight;
+        pose->rotation.y += q.y*rotation_weight;
+        pose->rotation.z += q.z*rotation_weight;
+        pose->scale.x += src[joint_index].scale.x*weight;
+        pose->scale.y += src[joint_index].scale.y*weight;
+        pose->scale.z += src[joint_index].scale.z*weight;
+        weights[joint_index] += weight;
+    }
+}
+
+void pose_add(JointPose *dst, JointPose *base, JointPose *delta, f32 weight, u32 count) {
+    weight = CLAMP(weight, 0.0f, 1.0f);
+    Q4 identity = q4(1, 0, 0, 0);
+    for(u32 joint_index = 0; joint_index < count; ++joint_index) {
+        JointPose *d = delta + joint_index;
+        Q4 delta_rotation = d->rotation;
+        V3 delta_scale = d->scale;
+        if(weight < 1.0f) {
+            delta_rotation = q4_slerp(identity, delta_rotation, weight);
+            delta_scale = v3_lerp(v3(1, 1, 1), delta_scale, weight);
+        }
+
+        JointPose *pose = dst + joint_index;
+        JointPose *b = base + joint_index;
+        pose->position = v3_add(b->position, v3_scale(d->position, weight));
+        pose->rotation = q4_normalize(q4_mul(b->rotation, delta_rotation));
+        pose->scale = v3(b->scale.x*delta_scale.x, b->scale.y*delta_scale.y, b->scale.z*delta_scale.z);
+    }
+}
+
+void pose_normalize(JointPose *dst, f32 *weights, JointPose *fallback, u32 count) {
+    for(u32 joint_index = 0; joint_index < count; ++joint_index) {
+        JointPose *pose = dst + joint_index;
+        Q4 q = pose->rotation;
+        f32 length_sqr = q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z;
+        if(weights[joint_index] <= 0.0f || length_sqr <= 0.0f) {
+            *pose = fallback[joint_index];
+            continue;
+        }
+        f32 inv_weight = 1.0f / weights[joint_index];
+        pose->position = v3_scale(pose->position, inv_weight);
+        pose->rotation = q4_scale(q, 1.0f / sqrtf(length_sqr));
+        pose->scale = v3_scale(pose->scale, inv_weight);
+    }
+}
+
+#if POSE_KERNELS_X86
+
+/* -------------------------------------------- */
+/*        SSE2 (4 joints)                       */
+/* -------------------------------------------- */
+
+static void vector_lanes_sse2(f32 (*dst)[POSE_LANES], f32 (*a)[POSE_LANES], f32 (*b)[POSE_LANES], f32 *t, u32 count) {
+    __m128 one = _mm_set1_ps(1);
+    u32 lane = 0;
+    for(; lane + 4 <= count; lane += 4) {
+        __m128 t4 = _mm_loadu_ps(t + lane);
+        __m128 d4 = _mm_sub_ps(one, t4);
+        for(u32 c = 0; c < 3; ++c) {
+            __m128 va = _mm_load_ps(a[c] + lane);
+            __m128 vb = _mm_load_ps(b[c] + lane);
+            _mm_store_ps(dst[c] + lane, _mm_add_ps(_mm_mul_ps(va, d4), _mm_mul_ps(vb, t4)));
+        }
+    }
+    vector_lanes_tail(dst, a, b, t, lane, count);
+}
+
+static void rotation_lanes_sse2(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 count, RotationInterpolation interpolation) {
+
+    __m128 one = _mm_set1_ps(1);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 sign_mask = _mm_set1_ps(-0.0f);
+
+    u32 lane = 0;
+    for(; lane + 4 <= count; lane += 4) {
+        __m128 t4 = _mm_loadu_ps(t + lane);
+        __m128 d4 = _mm_sub_ps(one, t4);
+
+        __m128 qa[4], qb[4];
+        __m128 cos_omega = _mm_setzero_ps();
+        for(u32 c = 0; c < 4; ++c) {
+            qa[c] = _mm_load_ps(a->rotation[c] + lane);
+            qb[c] = _mm_load_ps(b->rotation[c] + lane);
+            cos_omega = _mm_add_ps(cos_omega, _mm_mul_ps(qa[c], qb[c]));
+        }
+        __m128 sign = _mm_and_ps(cos_omega, sign_mask);
+        __m128 abs_cos_omega = _mm_xor_ps(cos_omega, sign);
+
+        __m128 k0, k1;
+        if(interpolation == ROTATION_INTERPOLATION_ONLERP) {
+            // NOTE: the t dependent part of the onlerp correction
+            __m128 centered_t = _mm_sub_ps(t4, half);
+            __m128 half_t = _mm_mul_ps(centered_t, centered_t);
+            __m128 ramp_t = _mm_mul_ps(_mm_mul_ps(t4, centered_t), _mm_sub_ps(t4, one));
+            __m128 d = abs_cos_omega;
+            __m128 ka = _mm_add_ps(_mm_set1_ps(3.55645f), _mm_mul_ps(d, _mm_set1_ps(-1.43519f)));
+            ka = _mm_add_ps(_mm_set1_ps(-3.2452f), _mm_mul_ps(d, ka));
+            ka = _mm_add_ps(_mm_set1_ps(1.0904f), _mm_mul_ps(d, ka));
+            __m128 kb = _mm_add_ps(_mm_set1_ps(-1.06021f), _mm_mul_ps(d, _mm_set1_ps(0.215638f)));
+            kb = _mm_add_ps(_mm_set1_ps(0.848013f), _mm_mul_ps(d, kb));
+            __m128 k = _mm_add_ps(_mm_mul_ps(ka, half_t), kb);
+            __m128 adjusted_t = _mm_add_ps(t4, _mm_mul_ps(ramp_t, k));
+            k0 = _mm_sub_ps(one, adjusted_t);
+            k1 = _mm_xor_ps(adjusted_t, sign);
+        } else {
+            __m128 sqr_t = _mm_mul_ps(t4, t4);
+            __m128 sqr_d = _mm_mul_ps(d4, d4);
+            __m128 xm1 = _mm_sub_ps(abs_cos_omega, one);
+            __m128 ct = one;
+            __m128 cd = one;
+            for(s32 i = 7; i >= 0; --i) {
+                __m128 u = _mm_set1_ps(slerp_u[i]);
+                __m128 v = _mm_set1_ps(slerp_v[i]);
+                __m128 bt = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(u, sqr_t), v), xm1);
+                __m128 bd = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(u, sqr_d), v), xm1);
+                ct = _mm_add_ps(one, _mm_mul_ps(bt, ct));
+                cd = _mm_add_ps(one, _mm_mul_ps(bd, cd));
+            }
+            k0 = _mm_mul_ps(cd, d4);
+            k1 = _mm_xor_ps(_mm_mul_ps(ct, t4), sign);
+        }
+
+        __m128 result[4];
+        __m128 length_sqr = _mm_setzero_ps();
+        for(u32 c = 0; c < 4; ++c) {
+            result[c] = _mm_add_ps(_mm_mul_ps(qa[c], k0), _mm_mul_ps(qb[c], k1));
+            length_sqr = _mm_add_ps(length_sqr, _mm_mul_ps(result[c], result[c]));
+        }
+
+        if(interpolation == ROTATION_INTERPOLATION_ONLERP) {
+            // NOTE: zero length quaternions are left as they are, like q4_onlerp
+            __m128 non_zero = _mm_cmpgt_ps(length_sqr, _mm_setzero_ps());
+            __m128 inv_length = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(length_sqr, _mm_set1_ps(1e-30f))));
+            inv_length = _mm_or_ps(_mm_and_ps(non_zero, inv_length), _mm_andnot_ps(non_zero, one));
+            for(u32 c = 0; c < 4; ++c) {
+                result[c] = _mm_mul_ps(result[c], inv_length);
+            }
+        }
+
+        for(u32 c = 0; c < 4; ++c) {
+            _mm_store_ps(dst->rotation[c] + lane, result[c]);
+        }
+    }
+
+    rotation_lanes_tail(dst, a, b, t, lane, count, interpolation);
+}
+
+/* -------------------------------------------- */
+/*        AVX2 (8 joints)                       */
+/* -------------------------------------------- */
+
+TARGET_AVX2 static void vector_lanes_avx2(f32 (*dst)[POSE_LANES], f32 (*a)[POSE_LANES], f32 (*b)[POSE_LANES], f32 *t, u32 count) {
+    __m256 one = _mm256_set1_ps(1);
+    u32 lane = 0;
+    for(; lane + 8 <= count; lane += 8) {
+        __m256 t8 = _mm256_loadu_ps(t + lane);
+        __m256 d8 = _mm256_sub_ps(one, t8);
+        // NOTE: (1-t)*a + t*b without fma, like the scalar lerp
+        for(u32 c = 0; c < 3; ++c) {
+            __m256 va = _mm256_load_ps(a[c] + lane);
+            __m256 vb = _mm256_load_ps(b[c] + lane);
+            _mm256_store_ps(dst[c] + lane, _mm256_add_ps(_mm256_mul_ps(va, d8), _mm256_mul_ps(vb, t8)));
+        }
+    }
+    vector_lanes_tail(dst, a, b, t, lane, count);
+}
+
+TARGET_AVX2 static void rotation_lanes_avx2(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 count, RotationInterpolation interpolation) {
+
+    __m256 one = _mm256_set1_ps(1);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 sign_mask = _mm256_set1_ps(-0.0f);
+
+    u32 lane = 0;
+    for(; lane + 8 <= count; lane += 8) {
+        __m256 t8 = _mm256_loadu_ps(t + lane);
+        __m256 d8 = _mm256_sub_ps(one, t8);
+
+        __m256 qa[4], qb[4];
+        __m256 cos_omega = _mm256_setzero_ps();
+        for(u32 c = 0; c < 4; ++c) {
+            qa[c] = _mm256_load_ps(a->rotation[c] + lane);
+            qb[c] = _mm256_load_ps(b->rotation[c] + lane);
+            cos_omega = _mm256_fmadd_ps(qa[c], qb[c], cos_omega);
+        }
+        __m256 sign = _mm256_and_ps(cos_omega, sign_mask);
+        __m256 abs_cos_omega = _mm256_xor_ps(cos_omega, sign);
+
+        __m256 k0, k1;
+        if(interpolation == ROTATION_INTERPOLATION_ONLERP) {
+            __m256 centered_t = _mm256_sub_ps(t8, half);
+            __m256 half_t = _mm256_mul_ps(centered_t, centered_t);
+            __m256 ramp_t = _mm256_mul_ps(_mm256_mul_ps(t8, centered_t), _mm256_sub_ps(t8, one));
+            __m256 d = abs_cos_omega;
+            __m256 ka = _mm256_fmadd_ps(d, _mm256_set1_ps(-1.43519f), _mm256_set1_ps(3.55645f));
+            ka = _mm256_fmadd_ps(d, ka, _mm256_set1_ps(-3.2452f));
+            ka = _mm256_fmadd_ps(d, ka, _mm256_set1_ps(1.0904f));
+            __m256 kb = _mm256_fmadd_ps(d, _mm256_set1_ps(0.215638f), _mm256_set1_ps(-1.06021f));
+            kb = _mm256_fmadd_ps(d, kb, _mm256_set1_ps(0.848013f));
+            __m256 k = _mm256_fmadd_ps(ka, half_t, kb);
+            __m256 adjusted_t = _mm256_fmadd_ps(ramp_t, k, t8);
+            k0 = _mm256_sub_ps(one, adjusted_t);
+            k1 = _mm256_xor_ps(adjusted_t, sign);
+        } else {
+            __m256 sqr_t = _mm256_mul_ps(t8, t8);
+            __m256 sqr_d = _mm256_mul_ps(d8, d8);
+            __m256 xm1 = _mm256_sub_ps(abs_cos_omega, one);
+            __m256 ct = one;
+            __m256 cd = one;
+            for(s32 i = 7; i >= 0; --i) {
+                __m256 u = _mm256_set1_ps(slerp_u[i]);
+                __m256 v = _mm256_set1_ps(slerp_v[i]);
+                __m256 bt = _mm256_mul_ps(_mm256_fmsub_ps(u, sqr_t, v), xm1);
+                __m256 bd = _mm256_mul_ps(_mm256_fmsub_ps(u, sqr_d, v), xm1);
+                ct = _mm256_fmadd_ps(bt, ct, one);
+                cd = _mm256_fmadd_ps(bd, cd, one);
+            }
+            k0 = _mm256_mul_ps(cd, d8);
+            k1 = _mm256_xor_ps(_mm256_mul_ps(ct, t8), sign);
+        }
+
+        __m256 result[4];
+        __m256 length_sqr = _mm256_setzero_ps();
+        for(u32 c = 0; c < 4; ++c) {
+            result[c] = _mm256_fmadd_ps(qa[c], k0, _mm256_mul_ps(qb[c], k1));
+            length_sqr = _mm256_fmadd_ps(result[c], result[c], length_sqr);
+        }
+
+        if(interpolation == ROTATION_INTERPOLATION_ONLERP) {
+            __m256 non_zero = _mm256_cmp_ps(length_sqr, _mm256_setzero_ps(), _CMP_GT_OQ);
+            __m256 inv_length = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_max_ps(length_sqr, _mm256_set1_ps(1e-30f))));
+            inv_length = _mm256_blendv_ps(one, inv_length, non_zero);
+            for(u32 c = 0; c < 4; ++c) {
+                result[c] = _mm256_mul_ps(result[c], inv_length);
+            }
+        }
+
+        for(u32 c = 0; c < 4; ++c) {
+            _mm256_store_ps(dst->rotation[c] + lane, result[c]);
+        }
+    }
+
+    rotation_lanes_tail(dst, a, b, t, lane, count, interpolation);
+}
+
+// NOTE: two rows of a in one register, _mm256_permute_ps broadcasts an element inside each 128 bit half
+// and the rows of b are repeated in both halves. M4 is only 16 byte aligned, the 256 bit loads and
+// stores are unaligned
+TARGET_AVX2 static void m4_mul_avx2(M4 *result, M4 *a, M4 *b, u32 count) {
+    for(u32 i = 0; i < count; ++i) {
+        __m256 b0 = _mm256_broadcast_ps((__m128 *)(b[i].m + 0));
+        __m256 b1 = _mm256_broadcast_ps((__m128 *)(b[i].m + 4));
+        __m256 b2 = _mm256_broadcast_ps((__m128 *)(b[i].m + 8));
+        __m256 b3 = _mm256_broadcast_ps((__m128 *)(b[i].m + 12));
+        for(u32 r = 0; r < 4; r += 2) {
+            __m256 rows = _mm256_loadu_ps(a[i].m + (r<<2));
+            __m256 sum = _mm256_mul_ps(_mm256_permute_ps(rows, 0x00), b0);
+            sum = _mm256_fmadd_ps(_mm256_permute_ps(rows, 0x55), b1, sum);
+            sum = _mm256_fmadd_ps(_mm256_permute_ps(rows, 0xAA), b2, sum);
+            sum = _mm256_fmadd_ps(_mm256_permute_ps(rows, 0xFF), b3, sum);
+            _mm256_storeu_ps(result[i].m + (r<<2), sum);
+        }
+    }
+}
+
+// NOTE: the 4x4 transpose of _MM_TRANSPOSE4_PS in both 128 bit halves
+#define TRANSPOSE4_AVX(r0, r1, r2, r3) do { \
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1); \
+    __m256 t1 = _mm256_unpacklo_ps(r2, r3); \
+    __m256 t2 = _mm256_unpackhi_ps(r0, r1); \
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3); \
+    r0 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0)); \
+    r1 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2)); \
+    r2 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0)); \
+    r3 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2)); \
+} while(0)
+
+// NOTE: eight quaternions at a time, the low halves of the registers hold the quaternions 0, 2, 4, 6
+// and the high halves 1, 3, 5, 7. Q4 is 16 byte aligned, two quaternions are an unaligned 256 bit load
+TARGET_AVX2 static void q4_to_m4_avx2(M4 *result, Q4 *q, u32 count) {
+    u32 i = 0;
+    __m256 one = _mm256_set1_ps(1);
+    __m256 two = _mm256_set1_ps(2);
+    __m128 last_row = _mm_set_ps(1, 0, 0, 0);
+    for(; i + 8 <= count; i += 8) {
+        __m256 w = _mm256_loadu_ps(&q[i + 0].w);
+        __m256 x = _mm256_loadu_ps(&q[i + 2].w);
+        __m256 y = _mm256_loadu_ps(&q[i + 4].w);
+        __m256 z = _mm256_loadu_ps(&q[i + 6].w);
+        TRANSPOSE4_AVX(w, x, y, z);
+
+        __m256 xx = _mm256_mul_ps(x, x), yy = _mm256_mul_ps(y, y), zz = _mm256_mul_ps(z, z);
+        __m256 xy = _mm256_mul_ps(x, y), xz = _mm256_mul_ps(x, z), yz = _mm256_mul_ps(y, z);
+        __m256 wx = _mm256_mul_ps(w, x), wy = _mm256_mul_ps(w, y), wz = _mm256_mul_ps(w, z);
+
+        __m256 rows[3][4];
+        rows[0][0] = _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz)));
+        rows[0][1] = _mm256_mul_ps(two, _mm256_sub_ps(xy, wz));
+        rows[0][2] = _mm256_mul_ps(two, _mm256_add_ps(xz, wy));
+        rows[1][0] = _mm256_mul_ps(two, _mm256_add_ps(xy, wz));
+        rows[1][1] = _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz)));
+        rows[1][2] = _mm256_mul_ps(two, _mm256_sub_ps(yz, wx));
+        rows[2][0] = _mm256_mul_ps(two, _mm256_sub_ps(xz, wy));
+        rows[2][1] = _mm256_mul_ps(two, _mm256_add_ps(yz, wx));
+        rows[2][2] = _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy)));
+
+        for(u32 r = 0; r < 3; ++r) {
+            rows[r][3] = _mm256_setzero_ps();
+            TRANSPOSE4_AVX(rows[r][0], rows[r][1], rows[r][2], rows[r][3]);
+            for(u32 k = 0; k < 4; ++k) {
+                _mm_store_ps(result[i + 2*k].m + (r<<2), _mm256_castps256_ps128(rows[r][k]));
+                _mm_store_ps(result[i + 2*k + 1].m + (r<<2), _mm256_extractf128_ps(rows[r][k], 1));
+            }
+        }
+        for(u32 k = 0; k < 8; ++k) {
+            _mm_store_ps(result[i + k].m + 12, last_row);
+        }
+    }
+    q4_to_m4_n(result + i, q + i, count - i);
+}
+
+#endif // POSE_KERNELS_X86
+
+/* -------------------------------------------- */
+/*        Runtime selection                     */
+/* -------------------------------------------- */
+
+typedef void (*VectorLanesFunc)(f32 (*dst)[POSE_LANES], f32 (*a)[POSE_LANES], f32 (*b)[POSE_LANES], f32 *t, u32 count);
+typedef void (*RotationLanesFunc)(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 count, RotationInterpolation interpolation);
+
+typedef void (*M4MulFunc)(M4 *result, M4 *a, M4 *b, u32 count);
+typedef void (*Q4ToM4Func)(M4 *result, Q4 *q, u32 count);
+
+static VectorLanesFunc vector_lanes = vector_lanes_scalar;
+static RotationLanesFunc rotation_lanes = rotation_lanes_scalar;
+static M4MulFunc m4_mul_kernel = m4_mul_scalar;
+static Q4ToM4Func q4_to_m4_kernel = q4_to_m4_scalar;
+
+void transforms_m4_mul_n(M4 *result, M4 *a, M4 *b, u32 count) {
+    m4_mul_kernel(result, a, b, count);
+}
+
+void transforms_q4_to_m4_n(M4 *result, Q4 *q, u32 count) {
+    q4_to_m4_kernel(result, q, count);
+}
+
+void pose_lanes_mix(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 count, RotationInterpolation interpolation) {
+    ASSERT(count <= POSE_LANES);
+    vector_lanes(dst->position, a->position, b->position, t, count);
+    rotation_lanes(dst, a, b, t, count, interpolation);
+    vector_lanes(dst->scale, a->scale, b->scale, t, count);
+}
+
+void pose_lanes_mix_rotations(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 count, RotationInterpolation interpolation) {
+    ASSERT(count <= POSE_LANES);
+    rotation_lanes(dst, a, b, t, count, interpolation);
+}
+
+void pose_mix(JointPose *dst, JointPose *a, JointPose *b, f32 t, u32 count, RotationInterpolation interpolation) {
+    PoseLanes lanes_a;
+    PoseLanes lanes_b;
+    f32 lanes_t[POSE_LANES];
+    for(u32 lane = 0; lane < POSE_LANES; ++lane) {
+        lanes_t[lane] = t;
+    }
+    for(u32 first_joint = 0; first_joint < count; first_joint += POSE_LANES) {
+        u32 num_lanes = MIN(count - first_joint, POSE_LANES);
+        for(u32 lane = 0; lane < num_lanes; ++lane) {
+            JointPose *pose_a = a + first_joint + lane;
+            JointPose *pose_b = b + first_joint + lane;
+            pose_lanes_set(&lanes_a, lane, pose_a->position, pose_a->rotation, pose_a->scale);
+            pose_lanes_set(&lanes_b, lane, pose_b->position, pose_b->rotation, pose_b->scale);
+        }
+        pose_lanes_mix(&lanes_a, &lanes_a, &lanes_b, lanes_t, num_lanes, interpolation);
+        for(u32 lane = 0; lane < num_lanes; ++lane) {
+            pose_lanes_get(&lanes_a, lane, dst + first_joint + lane);
+        }
+    }
+}
+
+PoseKernelType pose_kernels_initialize(PoseKernelType max_type) {
+
+    PoseKernelType type = POSE_KERNEL_SCALAR;
+
+#if POSE_KERNELS_X86
+    // NOTE: SSE2 is part of the x86_64 baseline
+    type = POSE_KERNEL_SSE2;
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        type = POSE_KERNEL_AVX2;
+    }
+#endif
+#endif
+
+    type = (PoseKernelType)MIN(type, max_type);
+
+    switch(type) {
+        case POSE_KERNEL_SCALAR:
+            vector_lanes = vector_lanes_scalar;
+            rotation_lanes = rotation_lanes_scalar;
+            m4_mul_kernel = m4_mul_scalar;
+            q4_to_m4_kernel = q4_to_m4_scalar;
+            break;
+#if POSE_KERNELS_X86
+        case POSE_KERNEL_SSE2:
+            vector_lanes = vector_lanes_sse2;
+            rotation_lanes = rotation_lanes_sse2;
+            m4_mul_kernel = m4_mul_n;
+            q4_to_m4_kernel = q4_to_m4_n;
+            break;
+        case POSE_KERNEL_AVX2:
+            vector_lanes = vector_lanes_avx2;
+            rotation_lanes = rotation_lanes_avx2;
+            m4_mul_kernel = m4_mul_avx2;
+            q4_to_m4_kernel = q4_to_m4_avx2;
+            break;
+#else
+        default:
+            vector_lanes = vector_lanes_scalar;
+            rotation_lanes = rotation_lanes_scalar;
+            m4_mul_kernel = m4_mul_scalar;
+            q4_to_m4_kernel = q4_to_m4_scalar;
+            break;
+#endif
+    }
+
+    return type;
+}
+
+const char *pose_kernel_name(PoseKernelType type) {
+    switch(type) {
+        case POSE_KERNEL_SCALAR: return "scalar";
+        case POSE_KERNEL_SSE2: return "sse2";
+        case POSE_KERNEL_AVX2: return "avx2";
+    }
+    return "unknown";
+}
@@ -0,0 +1,108 @@
+#ifndef _POSE_KERNELS_H_
+#define _POSE_KERNELS_H_
+
+#include "common.h"
+#include "animation.h"
+
+// NOTE: The SIMD kernels replace the sin/atan2 of q4_slerp with Eberly's polynomial
+// approximation (8 terms). Every component of the result match the scalar path
+// within POSE_KERNEL_EPSILON, positions and scales are bit exact lerps. The onlerp
+// kernels match q4_onlerp within the same epsilon.
+#define POSE_KERNEL_EPSILON 5e-5f
+
+enum PoseKernelType {
+    POSE_KERNEL_SCALAR,
+    POSE_KERNEL_SSE2,
+    POSE_KERNEL_AVX2,
+};
+
+// NOTE: the poses of POSE_LANES joints as a structure of arrays, the layout the kernels work on.
+// The samplers gather the keys of the clips directly into the lanes. The kernels use aligned
+// loads, allocations on the heap must keep the alignment of the struct
+#define POSE_LANES 64
+
+struct PoseLanes {
+    alignas(32) f32 position[3][POSE_LANES];
+    alignas(32) f32 rotation[4][POSE_LANES];
+    alignas(32) f32 scale[3][POSE_LANES];
+};
+
+static inline void pose_lanes_set(PoseLanes *lanes, u32 lane, V3 position, Q4 rotation, V3 scale) {
+    lanes->position[0][lane] = position.x;
+    lanes->position[1][lane] = position.y;
+    lanes->position[2][lane] = position.z;
+    lanes->rotation[0][lane] = rotation.w;
+    lanes->rotation[1][lane] = rotation.x;
+    lanes->rotation[2][lane] = rotation.y;
+    lanes->rotation[3][lane] = rotation.z;
+    lanes->scale[0][lane] = scale.x;
+    lanes->scale[1][lane] = scale.y;
+    lanes->scale[2][lane] = scale.z;
+}
+
+static inline void pose_lanes_set_rotation(PoseLanes *lanes, u32 lane, Q4 rotation) {
+    lanes->rotation[0][lane] = rotation.w;
+    lanes->rotation[1][lane] = rotation.x;
+    lanes->rotation[2][lane] = rotation.y;
+    lanes->rotation[3][lane] = rotation.z;
+}
+
+static inline Q4 pose_lanes_get_rotation(PoseLanes *lanes, u32 lane) {
+    Q4 rotation;
+    rotation.w = lanes->rotation[0][lane];
+    rotation.x = lanes->rotation[1][lane];
+    rotation.y = lanes->rotation[2][lane];
+    rotation.z = lanes->rotation[3][lane];
+    return rotation;
+}
+
+static inline void pose_lanes_get(PoseLanes *lanes, u32 lane, JointPose *pose) {
+    pose->position.x = lanes->position[0][lane];
+    pose->position.y = lanes->position[1][lane];
+    pose->position.z = lanes->position[2][lane];
+    pose->rotation = pose_lanes_get_rotation(lanes, lane);
+    pose->scale.x = lanes->scale[0][lane];
+    pose->scale.y = lanes->scale[1][lane];
+    pose->scale.z = lanes->scale[2][lane];
+}
+
+// NOTE: dst = mix(a, b, t[lane]) for the first count lanes, dst can be the same as a or b
+void pose_lanes_mix(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 count, RotationInterpolation interpolation);
+
+// NOTE: same as pose_lanes_mix for the rotations only, the sparse clips interpolate the positions and
+// scales of their tracks with other key times
+void pose_lanes_mix_rotations(PoseLanes *dst, PoseLanes *a, PoseLanes *b, f32 *t, u32 count, RotationInterpolation interpolation);
+
+// NOTE: dst[i] = mix(a[i], b[i], t) for count joints, dst can be the same array as a or b.
+// The joints are transposed to PoseLanes and back, the transposes cost about as much as the SIMD
+// kernels, callers that mix many times keep their poses in PoseLanes and call pose_lanes_mix
+void pose_mix(JointPose *dst, JointPose *a, JointPose *b, f32 t, u32 count, RotationInterpolation interpolation);
+
+// NOTE: dst[i] += weight*src[i] and weights[i] += weight. The rotations are negated when they are not in
+// the hemisphere of reference[i], so the sum does not depend on the order of the calls
+void pose_accumulate(JointPose *dst, f32 *weights, JointPose *src, JointPose *reference, f32 weight, u32 count);
+
+// NOTE: divide the accumulated positions and scales by the weights and normalize the rotations,
+// the joints without weight get the fallback pose
+void pose_normalize(JointPose *dst, f32 *weights, JointPose *fallback, u32 count);
+
+// NOTE: dst[i] = base[i] + weight*delta[i], delta is a pose of an ANIMATION_CLIP_ADDITIVE clip. The positions
+// are added, the rotations are applied in the local space of the joint and the scales multiplied. dst can
+// be the same array as base. The weight is clamped to [0, 1] for all the channels, an additive layer is
+// never extrapolated
+void pose_add(JointPose *dst, JointPose *base, JointPose *delta, f32 weight, u32 count);
+
+// NOTE: the batch products and quaternion conversions of the hierarchy and bind passes
+// (AnimationSet::calculate_final_transform_matrices), with the kernel selected by pose_kernels_initialize.
+// The SSE2 kernels are m4_mul_n and q4_to_m4_n, the AVX2 kernels are compiled with a target attribute
+// so the build does not need -mavx. result[i] is written before a[i + 1] and b[i + 1] are read
+void transforms_m4_mul_n(M4 *result, M4 *a, M4 *b, u32 count);
+void transforms_q4_to_m4_n(M4 *result, Q4 *q, u32 count);
+
+// NOTE: Select the best kernel supported by the cpu, max_type limit the selection
+// so the scalar path can be forced for debugging
+PoseKernelType pose_kernels_initialize(PoseKernelType max_type);
+
+const char *pose_kernel_name(PoseKernelType type);
+
+#endif // _POSE_KERNELS_H_
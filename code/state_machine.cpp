@@ -0,0 +1,410 @@
+#include "state_machine.h"
+#include "common.h"
+
+#include <cstdlib>
+#include <string.h>
+
+/* -------------------------------------------- */
+/*        Description                           */
+/* -------------------------------------------- */
+
+void StateMachine::initialize(u32 max_states_count, u32 max_transitions_count, u32 max_conditions_count, u32 max_parameters_count) {
+    max_states = max_states_count;
+    max_transitions = max_transitions_count;
+    max_conditions = max_conditions_count;
+    max_parameters = max_parameters_count;
+    num_states = 0;
+    num_transitions = 0;
+    num_conditions = 0;
+    num_parameters = 0;
+    states = (MachineState *)malloc(sizeof(MachineState)*max_states);
+    transitions = (MachineTransition *)malloc(sizeof(MachineTransition)*max_transitions);
+    conditions = (StateCondition *)malloc(sizeof(StateCondition)*max_conditions);
+    condition_transitions = (u32 *)malloc(sizeof(u32)*max_conditions);
+    parameters = (MachineParameter *)malloc(sizeof(MachineParameter)*max_parameters);
+    entry_state = 0;
+
+    state_first_transition = nullptr;
+    transition_table = nullptr;
+    num_table_transitions = 0;
+    condition_table = nullptr;
+}
+
+void StateMachine::terminate(void) {
+    free(states);
+    free(transitions);
+    free(conditions);
+    free(condition_transitions);
+    free(parameters);
+    free(state_first_transition);
+    free(transition_table);
+    free(condition_table);
+}
+
+u32 StateMachine::add_parameter(f32 value, bool trigger) {
+    ASSERT(num_parameters < max_parameters);
+    parameters[num_parameters].value = value;
+    parameters[num_parameters].trigger = trigger;
+    return num_parameters++;
+}
+
+u32 StateMachine::add_state(AnimationHandle clip, bool loop) {
+    ASSERT(num_states < max_states);
+    MachineState *state = states + num_states;
+    state->clip = clip;
+    state->loop = loop;
+    state->space = nullptr;
+    state->parameter = STATE_MACHINE_INVALID;
+    state->parameter_y = STATE_MACHINE_INVALID;
+    return num_states++;
+}
+
+u32 StateMachine::add_blend_space_state(BlendSpace *space, u32 parameter, u32 parameter_y, bool loop) {
+    ASSERT(space->num_triangles > 0);
+    ASSERT(parameter < num_parameters);
+    ASSERT(space->dimensions == 1 || parameter_y < num_parameters);
+    u32 state = add_state({ANIMATION_INVALID_HANDLE}, loop);
+    states[state].space = space;
+    states[state].parameter = parameter;
+    states[state].parameter_y = parameter_y;
+    return state;
+}
+
+u32 StateMachine::add_transition(u32 from, u32 to, f32 duration) {
+    ASSERT(num_transitions < max_transitions);
+    ASSERT(from == STATE_MACHINE_ANY_STATE || from < num_states);
+    ASSERT(to < num_states);
+    MachineTransition *transition = transitions + num_transitions;
+    transition->from = from;
+    transition->to = to;
+    transition->duration = duration;
+    transition->inertialized = false;
+    transition->first_condition = 0;
+    transition->num_conditions = 0;
+    return num_transitions++;
+}
+
+u32 StateMachine::add_inertialized_transition(u32 from, u32 to, f32 duration) {
+    u32 transition = add_transition(from, to, duration);
+    transitions[transition].inertialized = true;
+    return transition;
+}
+
+void StateMachine::add_condition(u32 transition, u32 parameter, StateConditionOp op, f32 value) {
+    ASSERT(num_conditions < max_conditions);
+    ASSERT(transition < num_transitions);
+    ASSERT(op == STATE_CONDITION_EXIT_TIME || parameter < num_parameters);
+    StateCondition *condition = conditions + num_conditions;
+    condition->op = op;
+    condition->parameter = parameter;
+    condition->value = value;
+    condition_transitions[num_conditions] = transition;
+    ++transitions[transition].num_conditions;
+    ++num_conditions;
+}
+
+void StateMachine::add_exit_time_condition(u32 transition, f32 normalized_time) {
+    add_condition(transition, STATE_MACHINE_INVALID, STATE_CONDITION_EXIT_TIME, normalized_time);
+}
+
+/* -------------------------------------------- */
+/*        Compilation                           */
+/* -------------------------------------------- */
+
+void StateMachine::compile(void) {
+
+    ASSERT(num_states > 0);
+    free(state_first_transition);
+    free(transition_table);
+    free(condition_table);
+
+    // NOTE: the conditions of every transition are contiguous, in the order they were added
+    condition_table = (StateCondition *)malloc(sizeof(StateCondition)*MAX(num_conditions, 1u));
+    u32 first_condition = 0;
+    for(u32 transition_index = 0; transition_index < num_transitions; ++transition_index) {
+        transitions[transition_index].first_condition = first_condition;
+        first_condition += transitions[transition_index].num_conditions;
+    }
+    u32 *condition_cursors = (u32 *)malloc(sizeof(u32)*MAX(num_transitions, 1u));
+    for(u32 transition_index = 0; transition_index < num_transitions; ++transition_index) {
+        condition_cursors[transition_index] = transitions[transition_index].first_condition;
+    }
+    for(u32 condition_index = 0; condition_index < num_conditions; ++condition_index) {
+        u32 transition_index = condition_transitions[condition_index];
+        condition_table[condition_cursors[transition_index]++] = conditions[condition_index];
+    }
+    free(condition_cursors);
+
+    // NOTE: two passes, count the transitions of every state and then fill the table. The transitions
+    // from any state are copied in the table of every state, after its own transitions
+    state_first_transition = (u32 *)malloc(sizeof(u32)*(num_states + 1));
+    transition_table = nullptr;
+    for(u32 pass = 0; pass < 2; ++pass) {
+        num_table_transitions = 0;
+        for(u32 state_index = 0; state_index < num_states; ++state_index) {
+            state_first_transition[state_index] = num_table_transitions;
+            for(u32 any = 0; any < 2; ++any) {
+                for(u32 transition_index = 0; transition_index < num_transitions; ++transition_index) {
+                    MachineTransition *transition = transitions + transition_index;
+                    bool from_state = any ? transition->from == STATE_MACHINE_ANY_STATE && transition->to != state_index : transition->from == state_index;
+                    if(!from_state) continue;
+                    if(pass == 1) {
+                        transition_table[num_table_transitions] = *transition;
+                    }
+                    ++num_table_transitions;
+                }
+            }
+        }
+        state_first_transition[num_states] = num_table_transitions;
+        if(pass == 0) {
+            transition_table = (MachineTransition *)malloc(sizeof(MachineTransition)*MAX(num_table_transitions, 1u));
+        }
+    }
+}
+
+/* -------------------------------------------- */
+/*        Instance                              */
+/* -------------------------------------------- */
+
+void StateMachineInstance::initialize(StateMachine *state_machine, AnimationSet *animation_set) {
+    ASSERT(state_machine->state_first_transition != nullptr);
+    machine = state_machine;
+    set = animation_set;
+    parameters = (f32 *)malloc(sizeof(f32)*MAX(machine->num_parameters, 1u));
+    for(u32 parameter = 0; parameter < machine->num_parameters; ++parameter) {
+        parameters[parameter] = machine->parameters[parameter].value;
+    }
+    for(u32 state_index = 0; state_index < machine->num_states; ++state_index) {
+        MachineState *state = machine->states + state_index;
+        if(state->space) {
+            for(u32 sample_index = 0; sample_index < state->space->num_samples; ++sample_index) {
+                ASSERT(state->space->samples[sample_index].clip.index < set->num_states);
+            }
+        } else {
+            ASSERT(state->clip.index < set->num_states || state->clip.index == ANIMATION_INVALID_HANDLE);
+        }
+    }
+
+    set->set_blend_mode(POSE_BLEND_MODE_ACCUMULATE);
+
+    current_state = machine->entry_state;
+    previous_state = STATE_MACHINE_INVALID;
+    transition_time = 0;
+    transition_duration = 0;
+    play_state(current_state, 1);
+}
+
+void StateMachineInstance::terminate(void) {
+    free(parameters);
+}
+
+void StateMachineInstance::set_parameter(u32 parameter, f32 value) {
+    ASSERT(parameter < machine->num_parameters);
+    parameters[parameter] = value;
+}
+
+void StateMachineInstance::set_trigger(u32 parameter) {
+    ASSERT(parameter < machine->num_parameters);
+    ASSERT(machine->parameters[parameter].trigger);
+    parameters[parameter] = 1;
+}
+
+bool StateMachineInstance::conditions_hold(MachineTransition *transition) {
+    StateCondition *condition = machine->condition_table + transition->first_condition;
+    StateCondition *end = condition + transition->num_conditions;
+    for(; condition < end; ++condition) {
+        bool holds = false;
+        switch(condition->op) {
+            case STATE_CONDITION_GREATER: {
+                holds = parameters[condition->parameter] > condition->value;
+            } break;
+            case STATE_CONDITION_LESS: {
+                holds = parameters[condition->parameter] < condition->value;
+            } break;
+            case STATE_CONDITION_EQUAL: {
+                holds = parameters[condition->parameter] == condition->value;
+            } break;
+            case STATE_CONDITION_NOT_EQUAL: {
+                holds = parameters[condition->parameter] != condition->value;
+            } break;
+            case STATE_CONDITION_EXIT_TIME: {
+                AnimationHandle clip = get_state_clip(current_state);
+                if(clip.index == ANIMATION_INVALID_HANDLE) {
+                    holds = true;
+                    break;
+                }
+                AnimationState *state = set->states + clip.index;
+                holds = !state->enable || state->time >= condition->value*state->animation->duration;
+            } break;
+        }
+        if(!holds) return false;
+    }
+    return true;
+}
+
+// NOTE: a transition during a crossfade stops the state that was fading out. A transition back to the
+// state that was fading out reverses the crossfade instead, the state keeps its time and both weights
+// continue from their current values. A state can not crossfade with itself (one AnimationState per
+// clip), a transition to the current state restarts its clip
+void StateMachineInstance::start_transition(MachineTransition *transition) {
+    if(transition->to == current_state && !transition->inertialized) {
+        if(previous_state != STATE_MACHINE_INVALID) {
+            stop_state(previous_state);
+            previous_state = STATE_MACHINE_INVALID;
+        }
+        play_state(current_state, 1);
+        return;
+    }
+
+    if(previous_state != STATE_MACHINE_INVALID && transition->to == previous_state && !transition->inertialized) {
+        f32 weight = transition_duration > 0 ? CLAMP(transition_time / transition_duration, 0.0f, 1.0f) : 1;
+        previous_state = current_state;
+        current_state = transition->to;
+        transition_duration = transition->duration;
+        transition_time = (1 - weight)*transition_duration;
+        if(transition_duration <= 0) {
+            stop_state(previous_state);
+            previous_state = STATE_MACHINE_INVALID;
+        }
+        return;
+    }
+
+    if(previous_state != STATE_MACHINE_INVALID) {
+        stop_state(previous_state);
+    }
+    previous_state = current_state;
+    current_state = transition->to;
+    transition_time = 0;
+    transition_duration = transition->duration;
+
+    MachineState *state = machine->states + current_state;
+    if(transition->inertialized) {
+        // NOTE: play_inertialized only stops the states that overlap the new one, the machine owns the old one
+        if(previous_state != current_state) {
+            stop_state(previous_state);
+        }
+        if(state->space || state->clip.index == ANIMATION_INVALID_HANDLE) {
+            // NOTE: the clips of a blend space are played together, they start without inertialization
+            play_state(current_state, 1);
+        } else {
+            set->play_inertialized(state->clip, transition_duration, state->loop);
+        }
+        previous_state = STATE_MACHINE_INVALID;
+        return;
+    }
+    play_state(current_state, 0);
+    if(transition_duration <= 0) {
+        stop_state(previous_state);
+        previous_state = STATE_MACHINE_INVALID;
+    }
+}
+
+void StateMachineInstance::play_state(u32 state_index, f32 weight) {
+    MachineState *state = machine->states + state_index;
+    if(state->space) {
+        for(u32 sample_index = 0; sample_index < state->space->num_samples; ++sample_index) {
+            set->play(state->space->samples[sample_index].clip, 0, state->loop);
+        }
+        update_state_weight(state_index, weight);
+    } else if(state->clip.index != ANIMATION_INVALID_HANDLE) {
+        set->play(state->clip, weight, state->loop);
+    }
+}
+
+void StateMachineInstance::stop_state(u32 state_index) {
+    MachineState *state = machine->states + state_index;
+    if(state->space) {
+        for(u32 sample_index = 0; sample_index < state->space->num_samples; ++sample_index) {
+            set->stop(state->space->samples[sample_index].clip);
+        }
+    } else if(state->clip.index != ANIMATION_INVALID_HANDLE) {
+        set->stop(state->clip);
+    }
+}
+
+// NOTE: the clips of a blend space that are not in the triangle of the parameters keep playing with
+// weight 0, their clocks stay in phase with the others
+void StateMachineInstance::update_state_weight(u32 state_index, f32 weight) {
+    MachineState *state = machine->states + state_index;
+    if(state->space) {
+        f32 x = parameters[state->parameter];
+        f32 y = state->space->dimensions == 2 ? parameters[state->parameter_y] : 0;
+        AnimationHandle clips[BLEND_SPACE_MAX_CLIPS];
+        f32 weights[BLEND_SPACE_MAX_CLIPS];
+        u32 num_clips = state->space->find_clips(x, y, clips, weights);
+        for(u32 sample_index = 0; sample_index < state->space->num_samples; ++sample_index) {
+            set->update_weight(state->space->samples[sample_index].clip, 0);
+        }
+        for(u32 clip_index = 0; clip_index < num_clips; ++clip_index) {
+            set->update_weight(clips[clip_index], weight*weights[clip_index]);
+        }
+    } else if(state->clip.index != ANIMATION_INVALID_HANDLE) {
+        set->update_weight(state->clip, weight);
+    }
+}
+
+bool StateMachineInstance::state_finish(u32 state_index) {
+    MachineState *state = machine->states + state_index;
+    if(state->space) {
+        for(u32 sample_index = 0; sample_index < state->space->num_samples; ++sample_index) {
+            if(!set->animation_finish(state->space->samples[sample_index].clip)) return false;
+        }
+        return true;
+    }
+    // NOTE: a state without clip is never over, the crossfades from it last their whole duration
+    return state->clip.index != ANIMATION_INVALID_HANDLE && set->animation_finish(state->clip);
+}
+
+AnimationHandle StateMachineInstance::get_state_clip(u32 state_index) {
+    MachineState *state = machine->states + state_index;
+    if(!state->space) return state->clip;
+    f32 x = parameters[state->parameter];
+    f32 y = state->space->dimensions == 2 ? parameters[state->parameter_y] : 0;
+    AnimationHandle clips[BLEND_SPACE_MAX_CLIPS];
+    f32 weights[BLEND_SPACE_MAX_CLIPS];
+    u32 num_clips = state->space->find_clips(x, y, clips, weights);
+    u32 best = 0;
+    for(u32 clip_index = 1; clip_index < num_clips; ++clip_index) {
+        best = weights[clip_index] > weights[best] ? clip_index : best;
+    }
+    return clips[best];
+}
+
+void StateMachineInstance::update(f32 dt) {
+
+    // NOTE: the crossfade ends early when the clip fading out is over
+    if(previous_state != STATE_MACHINE_INVALID) {
+        transition_time += dt;
+        if(transition_time >= transition_duration || state_finish(previous_state)) {
+            stop_state(previous_state);
+            previous_state = STATE_MACHINE_INVALID;
+        }
+    }
+
+    u32 first = machine->state_first_transition[current_state];
+    u32 end = machine->state_first_transition[current_state + 1];
+    for(u32 transition_index = first; transition_index < end; ++transition_index) {
+        MachineTransition *transition = machine->transition_table + transition_index;
+        if(conditions_hold(transition)) {
+            start_transition(transition);
+            break;
+        }
+    }
+
+    if(previous_state != STATE_MACHINE_INVALID && state_finish(previous_state)) {
+        previous_state = STATE_MACHINE_INVALID;
+    }
+
+    f32 weight = 1;
+    if(previous_state != STATE_MACHINE_INVALID) {
+        weight = transition_time / transition_duration;
+        update_state_weight(previous_state, 1 - weight);
+    }
+    update_state_weight(current_state, weight);
+
+    for(u32 parameter = 0; parameter < machine->num_parameters; ++parameter) {
+        if(machine->parameters[parameter].trigger) {
+            parameters[parameter] = 0;
+        }
+    }
+}
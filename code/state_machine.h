@@ -0,0 +1,146 @@
+#ifndef _STATE_MACHINE_H_
+#define _STATE_MACHINE_H_
+
+#include "common.h"
+#include "animation.h"
+#include "blend_space.h"
+
+// NOTE: A state machine is described with states (one clip, the clips of a blend space or no clip),
+// transitions with a crossfade duration and the conditions of every transition. compile() groups the
+// transitions of every state in one table (the transitions from any state go after the ones of the
+// state) and the conditions in another one, the machine is shared by all the instances. An instance
+// keeps the parameters and the current state of one AnimationSet, the parameters are referenced by the
+// integer ids returned by add_parameter
+
+#define STATE_MACHINE_INVALID 0xFFFFFFFF
+#define STATE_MACHINE_ANY_STATE 0xFFFFFFFE
+
+enum StateConditionOp {
+    STATE_CONDITION_GREATER,
+    STATE_CONDITION_LESS,
+    STATE_CONDITION_EQUAL,
+    STATE_CONDITION_NOT_EQUAL,
+    // NOTE: the clip of the current state is over or its normalized time is >= value, no parameter
+    STATE_CONDITION_EXIT_TIME,
+};
+
+struct StateCondition {
+    StateConditionOp op;
+    u32 parameter;
+    f32 value;
+};
+
+// NOTE: a state plays one clip, or all the clips of a blend space with the weights of the lookup at its
+// parameters (the state weight is split between them), or nothing when clip is ANIMATION_INVALID_HANDLE
+struct MachineState {
+    AnimationHandle clip;
+    bool loop;
+    BlendSpace *space;
+    u32 parameter;
+    u32 parameter_y;
+};
+
+// NOTE: in the compiled table the conditions of a transition are condition_table[first_condition, first_condition + num_conditions)
+struct MachineTransition {
+    u32 from;
+    u32 to;
+    f32 duration;
+    // NOTE: the target state plays alone and the difference with the last pose decays in duration
+    // (AnimationSet::play_inertialized) instead of a crossfade that samples both states
+    bool inertialized;
+    u32 first_condition;
+    u32 num_conditions;
+};
+
+struct MachineParameter {
+    f32 value;
+    // NOTE: triggers are reset at the end of every update
+    bool trigger;
+};
+
+struct StateMachine {
+
+    // NOTE: description
+    MachineState *states;
+    u32 num_states;
+    u32 max_states;
+
+    MachineTransition *transitions;
+    u32 num_transitions;
+    u32 max_transitions;
+
+    StateCondition *conditions;
+    u32 *condition_transitions;
+    u32 num_conditions;
+    u32 max_conditions;
+
+    MachineParameter *parameters;
+    u32 num_parameters;
+    u32 max_parameters;
+
+    u32 entry_state;
+
+    // NOTE: compiled tables, the transitions of state i are transition_table[state_first_transition[i], state_first_transition[i + 1])
+    u32 *state_first_transition;
+    MachineTransition *transition_table;
+    u32 num_table_transitions;
+    StateCondition *condition_table;
+
+    void initialize(u32 max_states, u32 max_transitions, u32 max_conditions, u32 max_parameters);
+    void terminate(void);
+
+    u32 add_parameter(f32 value, bool trigger);
+    // NOTE: the first state added is the entry state. A state without clip (ANIMATION_INVALID_HANDLE) is the
+    // rest state of a machine that drives a layer
+    u32 add_state(AnimationHandle clip, bool loop);
+    // NOTE: parameter_y is only read by 2D spaces, the space must be built
+    u32 add_blend_space_state(BlendSpace *space, u32 parameter, u32 parameter_y, bool loop);
+    // NOTE: from can be STATE_MACHINE_ANY_STATE, the transitions are checked in the order they are added.
+    // A transition from a state to itself restarts the clip, without crossfade unless it is inertialized
+    u32 add_transition(u32 from, u32 to, f32 duration);
+    u32 add_inertialized_transition(u32 from, u32 to, f32 duration);
+    void add_condition(u32 transition, u32 parameter, StateConditionOp op, f32 value);
+    void add_exit_time_condition(u32 transition, f32 normalized_time);
+
+    void compile(void);
+
+};
+
+// NOTE: the instance uses POSE_BLEND_MODE_ACCUMULATE so the crossfade does not depend on the order of
+// the states in the set, the states of the machine must use different clips. Several instances can drive
+// the same set with different clips, a machine whose clips are layers (AnimationSet::set_layer) plays
+// over the others
+struct StateMachineInstance {
+    StateMachine *machine;
+    AnimationSet *set;
+    f32 *parameters;
+
+    u32 current_state;
+    // NOTE: STATE_MACHINE_INVALID when there is no crossfade
+    u32 previous_state;
+    f32 transition_time;
+    f32 transition_duration;
+
+    void initialize(StateMachine *state_machine, AnimationSet *animation_set);
+    void terminate(void);
+
+    void set_parameter(u32 parameter, f32 value);
+    void set_trigger(u32 parameter);
+
+    // NOTE: call before AnimationSet::update, fires at most one transition and updates the weights of the crossfade
+    void update(f32 dt);
+
+private:
+
+    bool conditions_hold(MachineTransition *transition);
+    void start_transition(MachineTransition *transition);
+    void play_state(u32 state, f32 weight);
+    void stop_state(u32 state);
+    void update_state_weight(u32 state, f32 weight);
+    bool state_finish(u32 state);
+    // NOTE: the clip of the state, for blend spaces the clip with the largest weight
+    AnimationHandle get_state_clip(u32 state);
+
+};
+
+#endif // _STATE_MACHINE_H_
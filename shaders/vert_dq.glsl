@@ -0,0 +1,65 @@
+#version 330 core
+
+layout (location = 0) in vec3 aVert;
+layout (location = 1) in vec2 aUvs;
+layout (location = 2) in vec3 aColor;
+
+layout (location = 3) in ivec4 aBonesIds;
+layout (location = 4) in vec4  aWeigths;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+const int MAX_BONES = 100;
+const int MAX_BONE_INFLUENCE = 4;
+// NOTE: two vec4 per bone, the real part and then the dual part, both stored as (w, x, y, z)
+uniform vec4 bone_dual_quaternions[2*MAX_BONES];
+
+out vec2 uv;
+out vec3 color;
+
+void main() {
+    
+    uv = aUvs;
+    color = aColor;
+
+    vec4 real = vec4(0.0);
+    vec4 dual = vec4(0.0);
+    vec4 first = vec4(0.0);
+    bool skinned = false;
+    for(int i = 0; i < MAX_BONE_INFLUENCE; ++i) {
+        if(aBonesIds[i] == -1) {
+            continue;
+        }
+        if(aBonesIds[i] >= MAX_BONES) {
+            skinned = false;
+            break;
+        }
+        vec4 bone_real = bone_dual_quaternions[2*aBonesIds[i]];
+        vec4 bone_dual = bone_dual_quaternions[2*aBonesIds[i] + 1];
+        float weight = aWeigths[i];
+        // NOTE: all the quaternions in the hemisphere of the first one
+        if(!skinned) {
+            first = bone_real;
+            skinned = true;
+        } else if(dot(first, bone_real) < 0.0) {
+            weight = -weight;
+        }
+        real += bone_real * weight;
+        dual += bone_dual * weight;
+    }
+
+    vec3 position = aVert;
+    if(skinned) {
+        float len = length(real);
+        real /= len;
+        dual /= len;
+        vec3 v = real.yzw;
+        vec3 d = dual.yzw;
+        position += 2.0 * cross(v, cross(v, aVert) + real.x * aVert);
+        position += 2.0 * (real.x * d - dual.x * v + cross(v, d));
+    }
+
+    gl_Position = projection * view * model * vec4(position, 1.0);
+} 
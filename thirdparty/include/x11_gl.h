@@ -81,6 +81,7 @@
   X(void, glVertexAttribDivisor, (GLuint index, GLuint divisor)) \
   X(void, glUniform2f, (GLint	location, GLfloat	v0, GLfloat	v1)) \
   X(void, glUniform1i, (GLint location, GLint v0)) \
+  X(void, glUniform4fv, (GLint location, GLsizei count, const GLfloat *value)) \
   X(void, glBufferSubData, (GLenum	target, GLintptr	offset, GLsizeiptr size, const GLvoid *data)) \
   X(void, glGenTextures, (GLsizei	n, GLuint *textures)) \
   X(void, glBindTexture, (GLenum	target, GLuint	texture)) \